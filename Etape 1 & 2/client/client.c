@@ -6,6 +6,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <time.h>
 
 #define BUFFER_SIZE 516
 #define TIMEOUT_SEC 5 // Timeout de 5 secondes pour attendre les réponses
@@ -14,18 +15,41 @@
 #define OP_DATA 3
 #define OP_ACK 4
 #define OP_ERROR 5
+#define MAX_RETRIES 3
+
+// Numéro de bloc qui suit 65535 (option -r) : 0 ou 1 selon le serveur
+int rolloverBase = 0;
+
+// Paquets en double ignorés et paquets d'un autre TID rejetés pendant le transfert
+unsigned long duplicatesIgnored = 0;
+unsigned long strangersRejected = 0;
 
 // Déclaration des fonctions pour envoyer des requêtes RRQ et WRQ
 void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode);
 void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode);
+unsigned int wireBlockNum(unsigned long block);
+int waitForAck(int sockfd, struct sockaddr_in *serverAddr, unsigned int expectedBlockNum);
+int sameTid(const struct sockaddr_in *a, const struct sockaddr_in *b);
+void rejectUnknownTid(int sockfd, struct sockaddr_in *fromAddr, socklen_t fromAddrLen);
+long long nowMs(void);
 
 // Fonction principale
-int main() {
+int main(int argc, char *argv[]) {
     char serverIP[INET_ADDRSTRLEN];
     int serverPort;
     char filename[100];
     char mode[10];
     int operation;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r') {
+            rolloverBase = atoi(optarg) == 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-r 0|1]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Saisie des informations par l'utilisateur
     printf("Enter server IP: ");
@@ -75,8 +99,9 @@ int main() {
 void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode) {
     char buffer[BUFFER_SIZE];
     FILE *file;
-    int bytesRead, block = 0;
-    int ackBlockNum;
+    int bytesRead;
+    unsigned long block = 0; // Compté sans roll-over, seul le paquet porte le numéro sur 16 bits
+    unsigned int ackBlockNum;
     socklen_t addrLen = sizeof(*serverAddr);
 
     // Ouverture du fichier à envoyer
@@ -92,7 +117,7 @@ void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename,
     // Attente de l'ACK pour WRQ
     recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)serverAddr, &addrLen);
     if (buffer[1] == OP_ACK) {
-        ackBlockNum = (buffer[2] << 8) + buffer[3];
+        ackBlockNum = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
         if (ackBlockNum != 0) {
             printf("Invalid ACK number for WRQ.\n");
             fclose(file);
@@ -111,13 +136,16 @@ void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename,
         bytesRead = fread(buffer + 4, 1, 512, file);
         block++;
         buffer[0] = 0; buffer[1] = OP_DATA;
-        buffer[2] = (block >> 8) & 0xFF; buffer[3] = block & 0xFF;
+        buffer[2] = (wireBlockNum(block) >> 8) & 0xFF; buffer[3] = wireBlockNum(block) & 0xFF;
 
-        sendto(sockfd, buffer, bytesRead + 4, 0, (const struct sockaddr *)serverAddr, addrLen);
-        
-        // Attente de l'ACK pour chaque bloc de données
-        recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)serverAddr, &addrLen);
-        if (buffer[1] != OP_ACK || ((buffer[2] << 8) + buffer[3]) != block) {
+        // Attente de l'ACK pour chaque bloc de données : le bloc n'est réémis qu'à l'expiration
+        // du délai, jamais en réponse à un ACK en double (RFC 1123 §4.2.3.1)
+        int acked = 0;
+        for (int attempt = 0; attempt <= MAX_RETRIES && acked == 0; attempt++) {
+            sendto(sockfd, buffer, bytesRead + 4, 0, (const struct sockaddr *)serverAddr, addrLen);
+            acked = waitForAck(sockfd, serverAddr, wireBlockNum(block));
+        }
+        if (acked <= 0) {
             printf("ACK error or block number mismatch.\n");
             fclose(file);
             close(sockfd);
@@ -127,14 +155,67 @@ void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename,
 
     fclose(file);
     printf("File transfer complete.\n");
+    if (duplicatesIgnored > 0 || strangersRejected > 0) {
+        printf("%lu duplicate ACKs ignored, %lu packets from unknown TIDs rejected\n", duplicatesIgnored, strangersRejected);
+    }
+}
+
+// Attend l'ACK du bloc attendu pendant TIMEOUT_SEC. Les ACK en double et les paquets d'un
+// autre TID sont ignorés sans écourter l'attente. Retourne 1 si l'ACK est reçu, 0 à
+// l'expiration du délai et -1 sur un paquet ERROR.
+int waitForAck(int sockfd, struct sockaddr_in *serverAddr, unsigned int expectedBlockNum) {
+    char buffer[BUFFER_SIZE];
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    long long deadline = nowMs() + TIMEOUT_SEC * 1000;
+    fd_set readfds;
+    struct timeval tv;
+
+    while (1) {
+        long long remaining = deadline - nowMs();
+        if (remaining <= 0) {
+            return 0;
+        }
+        FD_ZERO(&readfds);
+        FD_SET(sockfd, &readfds);
+        tv.tv_sec = remaining / 1000;
+        tv.tv_usec = (remaining % 1000) * 1000;
+        if (select(sockfd + 1, &readfds, NULL, NULL, &tv) <= 0) {
+            return 0;
+        }
+
+        fromAddrLen = sizeof(fromAddr);
+        int recvLen = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (recvLen < 4) {
+            continue;
+        }
+        if (!sameTid(&fromAddr, serverAddr)) {
+            rejectUnknownTid(sockfd, &fromAddr, fromAddrLen);
+            continue;
+        }
+        if (buffer[1] == OP_ERROR) {
+            buffer[recvLen] = '\0';
+            printf("Error received: %s\n", &buffer[4]);
+            return -1;
+        }
+        if (buffer[1] == OP_ACK) {
+            unsigned int ackBlockNum = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
+            if (ackBlockNum == expectedBlockNum) {
+                return 1;
+            }
+            duplicatesIgnored++;
+        }
+    }
 }
 
 void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode) {
     char buffer[BUFFER_SIZE];
     struct sockaddr_in fromAddr;
     socklen_t fromAddrLen = sizeof(fromAddr);
+    struct sockaddr_in serverTid; // Adresse et port de la session, fixés par la première réponse
+    int tidLocked = 0;
     int len, recvLen, retryCount = 0;
-    unsigned short block = 1;
+    unsigned long block = 1; // Bloc attendu, compté sans roll-over
 
     // Envoi de la requête RRQ
     len = sprintf(buffer, "%c%c%s%c%s%c", 0, OP_RRQ, filename, 0, mode, 0);
@@ -171,23 +252,37 @@ void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const
             }
             // Retransmission du dernier ACK
             buffer[0] = 0; buffer[1] = OP_ACK;
-            buffer[2] = (block - 1) >> 8; buffer[3] = (block - 1) & 0xFF;
-            sendto(sockfd, buffer, 4, 0, (const struct sockaddr *)serverAddr, sizeof(*serverAddr));
+            buffer[2] = wireBlockNum(block - 1) >> 8; buffer[3] = wireBlockNum(block - 1) & 0xFF;
+            if (tidLocked) {
+                sendto(sockfd, buffer, 4, 0, (const struct sockaddr *)&serverTid, sizeof(serverTid));
+            } else {
+                // Aucune réponse encore : c'est la requête qui s'est perdue
+                len = sprintf(buffer, "%c%c%s%c%s%c", 0, OP_RRQ, filename, 0, mode, 0);
+                sendto(sockfd, buffer, len, 0, (const struct sockaddr *)serverAddr, sizeof(*serverAddr));
+            }
         } else {
             // Réception du paquet de données
+            fromAddrLen = sizeof(fromAddr);
             recvLen = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
             if (recvLen < 4) { // Vérification de la longueur minimale d'un paquet TFTP
                 printf("Received packet is too short.\n");
                 break;
             }
+            if (!tidLocked) {
+                serverTid = fromAddr;
+                tidLocked = 1;
+            } else if (!sameTid(&fromAddr, &serverTid)) {
+                rejectUnknownTid(sockfd, &fromAddr, fromAddrLen);
+                continue;
+            }
 
             int opcode = buffer[1];
-            unsigned short receivedBlock = (buffer[2] << 8) | buffer[3];
+            unsigned int receivedBlock = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
             
             if (opcode == OP_ERROR) {
                 printf("Error received: %s\n", &buffer[4]);
                 break;
-            } else if (opcode == OP_DATA && receivedBlock == block) {
+            } else if (opcode == OP_DATA && receivedBlock == wireBlockNum(block)) {
                 // Écriture des données dans le fichier
                 fwrite(buffer + 4, 1, recvLen - 4, file);
                 // Envoi de l'ACK
@@ -200,10 +295,45 @@ void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const
                     break;
                 }
                 block++; // Préparation pour le prochain bloc
+                retryCount = 0;
+            } else if (opcode == OP_DATA && block > 1 && receivedBlock == wireBlockNum(block - 1)) {
+                // DATA en double : notre ACK s'est perdu, on le renvoie pour ce doublon seulement
+                buffer[0] = 0; buffer[1] = OP_ACK;
+                sendto(sockfd, buffer, 4, 0, (const struct sockaddr *)&fromAddr, fromAddrLen);
+                duplicatesIgnored++;
             }
         }
     }
 
     fclose(file); // Fermeture du fichier
+    if (duplicatesIgnored > 0 || strangersRejected > 0) {
+        printf("%lu duplicate DATA re-acknowledged, %lu packets from unknown TIDs rejected\n", duplicatesIgnored, strangersRejected);
+    }
+}
+
+// Numéro de bloc sur 16 bits d'un bloc absolu : après 65535 on repart à rolloverBase
+unsigned int wireBlockNum(unsigned long block) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rolloverBase ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
 }
 
+// Vrai si deux adresses désignent la même extrémité (adresse IP et port), le TID de la RFC 1350
+int sameTid(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Réponse à un paquet étranger au transfert (RFC 1350 : erreur 5, sans interrompre le transfert)
+void rejectUnknownTid(int sockfd, struct sockaddr_in *fromAddr, socklen_t fromAddrLen) {
+    char buffer[32];
+    int len = sprintf(buffer, "%c%c%c%cUnknown transfer ID", 0, OP_ERROR, 0, 5);
+    sendto(sockfd, buffer, len + 1, 0, (struct sockaddr *)fromAddr, fromAddrLen);
+    strangersRejected++;
+}
+
+long long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -6,6 +6,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <time.h>
 
 #define BUFFER_SIZE 516
 #define OP_RRQ 1
@@ -15,17 +16,35 @@
 #define OP_ERROR 5
 #define TFTP_PORT 66
 #define TIMEOUT_SEC 5
+
+// Numéro de bloc qui suit 65535 (option -r) : 0 ou 1 selon les implémentations
+int rolloverBase = 0;
+
 // Prototypes for functions that handle RRQ and WRQ
 void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode);
 void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode);
+unsigned int wireBlockNum(unsigned long block);
+int sameTid(const struct sockaddr_in *a, const struct sockaddr_in *b);
+int rejectUnknownTid(int sockfd, const char *packet, int len, struct sockaddr_in *fromAddr, socklen_t fromAddrLen);
+long long nowMs(void);
 
-int main() {
+int main(int argc, char *argv[]) {
      int sockfd;
     struct sockaddr_in serverAddr, clientAddr;
     char buffer[BUFFER_SIZE];
     char serverIP[INET_ADDRSTRLEN];  // Buffer for the IP address
     int serverPort;                  // Variable for the server port
     socklen_t clientAddrLen = sizeof(clientAddr);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r') {
+            rolloverBase = atoi(optarg) == 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-r 0|1]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Ask for server IP and port from the user
     printf("Enter server IP address: ");
@@ -87,7 +106,12 @@ int main() {
 void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode) {
     FILE *file;
     char buffer[BUFFER_SIZE];
-    int bytesRead, blockNum = 1;
+    char ackBuffer[BUFFER_SIZE]; // L'ACK ne doit pas écraser le bloc à réémettre
+    int bytesRead;
+    unsigned long blockNum = 1; // Compté sans roll-over, seul le paquet porte le numéro sur 16 bits
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    int duplicates = 0, strangers = 0;
 
     file = fopen(filename, "rb");
     if (file == NULL) {
@@ -105,35 +129,56 @@ void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrL
         bytesRead = fread(buffer + 4, 1, 512, file);
         buffer[0] = 0;
         buffer[1] = OP_DATA;
-        buffer[2] = (blockNum >> 8) & 0xFF;
-        buffer[3] = blockNum & 0xFF;
+        buffer[2] = (wireBlockNum(blockNum) >> 8) & 0xFF;
+        buffer[3] = wireBlockNum(blockNum) & 0xFF;
 
         // Send the DATA packet
         sendto(sockfd, buffer, bytesRead + 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
 
         // Wait for ACK
         // Expected ACK format: | 0x00 | 0x04 | Block # |
+        // Le DATA n'est réémis qu'à l'expiration du timer, jamais sur un ACK en double : sinon
+        // chaque doublon provoquerait un DATA en double, donc un ACK en double, et ainsi de
+        // suite (syndrome de l'apprenti sorcier, RFC 1123 §4.2.3.1). L'échéance est fixée à
+        // l'envoi, pour que des paquets ignorés ne repoussent pas la retransmission.
         int ackReceived = 0;
+        long long deadline = nowMs() + TIMEOUT_SEC * 1000;
         while (!ackReceived) {
             fd_set readfds;
             struct timeval tv;
+            long long remaining = deadline - nowMs();
+            if (remaining < 0) {
+                remaining = 0;
+            }
             FD_ZERO(&readfds);
             FD_SET(sockfd, &readfds);
-            tv.tv_sec = TIMEOUT_SEC;
-            tv.tv_usec = 0;
-            
+            tv.tv_sec = remaining / 1000;
+            tv.tv_usec = (remaining % 1000) * 1000;
+
             int rv = select(sockfd + 1, &readfds, NULL, NULL, &tv);
             if (rv > 0) {
-                int len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)clientAddr, &clientAddrLen);
-                if (len >= 4 && buffer[1] == OP_ACK) {
-                    int ackBlockNum = (buffer[2] << 8) | buffer[3];
-                    if (ackBlockNum == blockNum) {
+                fromAddrLen = sizeof(fromAddr);
+                int len = recvfrom(sockfd, ackBuffer, BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+                if (len < 0) {
+                    continue;
+                }
+                if (!sameTid(&fromAddr, clientAddr)) {
+                    // Paquet d'une autre adresse ou d'un autre port : il ne touche pas au transfert
+                    strangers += rejectUnknownTid(sockfd, ackBuffer, len, &fromAddr, fromAddrLen);
+                    continue;
+                }
+                if (len >= 4 && ackBuffer[1] == OP_ACK) {
+                    unsigned int ackBlockNum = ((unsigned char)ackBuffer[2] << 8) | (unsigned char)ackBuffer[3];
+                    if (ackBlockNum == wireBlockNum(blockNum)) {
                         ackReceived = 1;
+                    } else {
+                        duplicates++; // ACK en double ou périmé : ignoré
                     }
                 }
             } else if (rv == 0) {
                 // Timeout occurred, retransmit the DATA packet
                 sendto(sockfd, buffer, bytesRead + 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
+                deadline = nowMs() + TIMEOUT_SEC * 1000;
             } else {
                 // Error occurred
                 perror("Error receiving ACK");
@@ -144,6 +189,9 @@ void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrL
         blockNum++;
     } while (bytesRead == 512);  // The last packet must be less than 512 bytes
 
+    if (duplicates > 0 || strangers > 0) {
+        printf("%s: %d duplicate ACKs ignored, %d packets from unknown TIDs rejected\n", filename, duplicates, strangers);
+    }
     fclose(file);
 }
 
@@ -152,9 +200,12 @@ void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrL
 void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode) {
     FILE *file;
     char buffer[BUFFER_SIZE];
-    int blockNum = 0;
-    int expectedBlockNum = 1;
+    unsigned int blockNum = 0;
+    unsigned long expectedBlockNum = 1; // Compté sans roll-over
     int writeComplete = 0;
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    int duplicates = 0, strangers = 0;
 
     // Open file for writing
     file = fopen(filename, "wb");
@@ -184,15 +235,20 @@ void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrL
         // Wait for DATA packet
         int rv = select(sockfd + 1, &readfds, NULL, NULL, &tv);
         if (rv > 0) {
-            int len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)clientAddr, &clientAddrLen);
+            fromAddrLen = sizeof(fromAddr);
+            int len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+            if (len >= 0 && !sameTid(&fromAddr, clientAddr)) {
+                strangers += rejectUnknownTid(sockfd, buffer, len, &fromAddr, fromAddrLen);
+                continue;
+            }
             if (len < 4) {
                 // Malformed packet
                 break;
             }
             int opcode = buffer[1];
-            blockNum = (buffer[2] << 8) | buffer[3];
+            blockNum = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
 
-            if (opcode == OP_DATA && blockNum == expectedBlockNum) {
+            if (opcode == OP_DATA && blockNum == wireBlockNum(expectedBlockNum)) {
                 // Write block to file
                 fwrite(buffer + 4, 1, len - 4, file);
 
@@ -206,13 +262,19 @@ void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrL
                 }
 
                 expectedBlockNum++;
+            } else if (opcode == OP_DATA && expectedBlockNum > 1 && blockNum == wireBlockNum(expectedBlockNum - 1)) {
+                // DATA en double : notre ACK s'est perdu, on le renvoie. Le client, lui, ne doit
+                // pas réémettre sur l'ACK en double qui en résulte.
+                buffer[1] = OP_ACK;
+                sendto(sockfd, buffer, 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
+                duplicates++;
             } else if (opcode == OP_ERROR) {
                 // Handle error
                 break;
             }
         } else if (rv == 0) {
             // Timeout occurred
-            printf("Timeout occurred while waiting for data block %d\n", expectedBlockNum);
+            printf("Timeout occurred while waiting for data block %u\n", wireBlockNum(expectedBlockNum));
             break;
         } else {
             // Error occurred
@@ -221,5 +283,40 @@ void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrL
         }
     }
 
+    if (duplicates > 0 || strangers > 0) {
+        printf("%s: %d duplicate DATA re-acknowledged, %d packets from unknown TIDs rejected\n", filename, duplicates, strangers);
+    }
     fclose(file);
-}
\ No newline at end of file
+}
+
+// Numéro de bloc sur 16 bits d'un bloc absolu : après 65535 on repart à rolloverBase
+unsigned int wireBlockNum(unsigned long block) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rolloverBase ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
+}
+
+// Vrai si deux adresses désignent la même extrémité (adresse IP et port), le TID de la RFC 1350
+int sameTid(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Réponse à un paquet étranger au transfert en cours, sans interrompre le transfert. Le
+// transfert se fait sur le port d'écoute : une nouvelle requête (RRQ, WRQ) vient d'un client
+// qui attend son tour et reçoit l'erreur 0 « Server busy » ; un DATA ou un ACK égaré reçoit
+// l'erreur 5 de la RFC 1350. Retourne 1 si le paquet est compté comme étranger.
+int rejectUnknownTid(int sockfd, const char *packet, int len, struct sockaddr_in *fromAddr, socklen_t fromAddrLen) {
+    char buffer[32];
+    int request = len >= 2 && packet[0] == 0 && (packet[1] == OP_RRQ || packet[1] == OP_WRQ);
+    int errorLen = request ? sprintf(buffer, "%c%c%c%cServer busy", 0, OP_ERROR, 0, 0)
+                           : sprintf(buffer, "%c%c%c%cUnknown transfer ID", 0, OP_ERROR, 0, 5);
+    sendto(sockfd, buffer, errorLen + 1, 0, (struct sockaddr *)fromAddr, fromAddrLen);
+    return !request;
+}
+
+long long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
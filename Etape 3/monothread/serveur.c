@@ -5,8 +5,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <sys/select.h>
-#include <sys/file.h> 
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 #define BUFFER_SIZE 516
 #define OP_RRQ 1
@@ -15,18 +19,104 @@
 #define OP_ACK 4
 #define OP_ERROR 5
 #define TFTP_PORT 66
-#define TIMEOUT_SEC 5
-// Prototypes for functions that handle RRQ and WRQ
-void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode);
-void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode);
+#define TIMEOUT_SEC 5 // Plafond du délai de retransmission adaptatif
+#define MAX_RETRIES 5
+#define MAX_EVENTS 256 // Événements traités par appel à epoll_wait
+#define INITIAL_RTO_MS 1000 // Délai de retransmission avant la première mesure (RFC 6298)
+#define MIN_RTO_MS 200 // Plancher : sur un LAN, une perte coûte 200 ms au lieu de TIMEOUT_SEC
+#define MAX_RTO_MS (TIMEOUT_SEC * 1000)
+#define WRITE_BUFFER_SIZE (256 * 1024) // Tampon stdio d'un téléversement : un write() tous les 512 blocs
+
+// Estimation du délai de retransmission à la Jacobson/Karels (RFC 6298). Seuls les paquets
+// émis une seule fois sont mesurés (algorithme de Karn) et chaque timeout double le délai.
+typedef struct {
+    long long srttUs;        // RTT lissé
+    long long rttvarUs;      // Variation moyenne du RTT
+    long long rtoMs;         // Délai de retransmission courant, backoff compris
+    int hasSample;
+    int timing;              // Vrai si une mesure est en cours
+    int timedBlock;          // Bloc dont on attend l'ACK (RRQ) ou le DATA (WRQ)
+    long long sentUs;        // Date d'émission du paquet mesuré
+} RttEstimator;
+
+// Un transfert en cours, servi par sa propre socket éphémère (TID serveur, RFC 1350).
+// La session avance uniquement sur réception d'un paquet ou sur expiration de son timer.
+typedef struct {
+    int sockfd;
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen;
+    int opcode;                    // OP_RRQ ou OP_WRQ
+    FILE *file;
+    unsigned long blockNum;        // RRQ : bloc en vol, WRQ : dernier bloc acquitté (sans roll-over)
+    char dataBuffer[BUFFER_SIZE];  // RRQ : paquet DATA en vol, conservé pour la retransmission
+    int dataLen;
+    int lastBlock;                 // Vrai quand le dernier bloc a été envoyé ou reçu
+    RttEstimator rtt;
+    unsigned long duplicates;      // ACK en double ignorés (RRQ) ou DATA en double réacquittés (WRQ)
+    unsigned long strangers;       // Paquets d'un autre TID, rejetés par une erreur 5
+    long long lastProgress;        // Date du dernier bloc acquitté ou reçu, en ms
+    long long deadline;            // Échéance du timer en ms (horloge monotone)
+    int timerIndex;                // Position dans le tas des timers, -1 si désarmé
+    int tableIndex;                // Position dans la table des sessions
+} Session;
+
+// Toutes les sessions sont servies par un seul thread via epoll ; les timers sont
+// rangés dans un tas binaire trié par échéance.
+typedef struct {
+    int epollfd;
+    int listenfd;
+    struct sockaddr_in bindAddr;
+    Session **sessions;
+    int sessionCount;
+    Session **timers;
+    int timerCount;
+    int capacity;
+} Engine;
+
+// Numéro de bloc qui suit 65535 (option -r) : 0 ou 1 selon les implémentations
+int rolloverBase = 0;
 
-int main() {
+// Prototypes for functions that handle RRQ and WRQ
+int handleRRQ(Engine *engine, Session *session, const char *filename, const char *mode);
+int handleWRQ(Engine *engine, Session *session, const char *filename, const char *mode);
+int sendNextBlock(Session *session);
+void engineInit(Engine *engine, int listenfd, struct sockaddr_in *bindAddr);
+void engineRun(Engine *engine);
+void acceptRequests(Engine *engine);
+Session* createSession(Engine *engine, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, int opcode);
+void destroySession(Engine *engine, Session *session);
+void sessionReadable(Engine *engine, Session *session);
+int sessionPacket(Engine *engine, Session *session, const char *buffer, int len);
+void sessionTimeout(Engine *engine, Session *session);
+long long nowMs(void);
+long long nowUs(void);
+void rttInit(RttEstimator *rtt);
+void rttStart(RttEstimator *rtt, int block);
+void rttAcked(RttEstimator *rtt, int block);
+void rttCancel(RttEstimator *rtt);
+void rttBackoff(RttEstimator *rtt);
+void armTimer(Engine *engine, Session *session, long long deadline);
+void cancelTimer(Engine *engine, Session *session);
+void timerSiftUp(Engine *engine, int index);
+void timerSiftDown(Engine *engine, int index);
+unsigned int wireBlockNum(unsigned long block);
+
+int main(int argc, char *argv[]) {
      int sockfd;
-    struct sockaddr_in serverAddr, clientAddr;
-    char buffer[BUFFER_SIZE];
+    struct sockaddr_in serverAddr;
     char serverIP[INET_ADDRSTRLEN];  // Buffer for the IP address
     int serverPort;                  // Variable for the server port
-    socklen_t clientAddrLen = sizeof(clientAddr);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r') {
+            rolloverBase = atoi(optarg) == 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-r 0|1]\n", argv[0]);
+            fprintf(stderr, "  -r  block number after 65535 (default 0)\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Ask for server IP and port from the user
     printf("Enter server IP address: ");
@@ -53,47 +143,19 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("TFTP Server started on %s:%d...\n", serverIP, serverPort);
-
-     // Configuration de select()
-    fd_set master_fds, read_fds;
-    FD_ZERO(&master_fds);
-    FD_SET(sockfd, &master_fds);
-    int fdmax = sockfd;
-
-    while (1) {
-        read_fds = master_fds;
-        if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
-            perror("select");
-            exit(4);
-        }
+    // Chaque session consomme une socket et un fichier : on relève la limite de descripteurs
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
-        if (FD_ISSET(sockfd, &read_fds)) {
-            int receivedBytes = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                                         (struct sockaddr *)&clientAddr, &clientAddrLen);
-            if (receivedBytes < 0) {
-                perror("recvfrom failed");
-                continue;
-            }
+    printf("TFTP Server started on %s:%d...\n", serverIP, serverPort);
+    fflush(stdout);
 
-            // Traitement des requêtes
-            int opcode = buffer[1];
-            char *filename = buffer + 2;
-            char *mode = filename + strlen(filename) + 1;
-
-            switch (opcode) {
-                case OP_RRQ:
-                    handleRRQ(sockfd, &clientAddr, clientAddrLen, filename, mode);
-                    break;
-                case OP_WRQ:
-                    handleWRQ(sockfd, &clientAddr, clientAddrLen, filename, mode);
-                    break;
-                default:
-                    fprintf(stderr, "Unsupported request. Only RRQ and WRQ are supported.\n");
-                    break;
-            }
-        }
-    }
+    Engine engine;
+    engineInit(&engine, sockfd, &serverAddr);
+    engineRun(&engine);
 
     close(sockfd);
     return 0;
@@ -115,149 +177,555 @@ void sendACK(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen
     sendto(sockfd, ackPacket, 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
 }
 
-// Implement the handleRRQ function to handle read requests
-void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("File not found or cannot be opened");
-        sendError(sockfd, clientAddr, clientAddrLen, 1, "File not found");
-        return;
+void engineInit(Engine *engine, int listenfd, struct sockaddr_in *bindAddr) {
+    memset(engine, 0, sizeof(*engine));
+    engine->listenfd = listenfd;
+    engine->bindAddr = *bindAddr;
+    engine->bindAddr.sin_port = 0;
+
+    engine->epollfd = epoll_create1(0);
+    if (engine->epollfd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
     }
 
-    // Verrouillage du fichier en lecture
-    if (flock(fileno(file), LOCK_SH) == -1) { // LOCK_SH pour un verrou partagé (lecture)
-        perror("flock failed");
-        fclose(file);
-        return;
+    // La socket d'écoute est repérée par un pointeur nul dans les événements
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
     }
+}
 
-    char dataBuffer[BUFFER_SIZE];
-    int bytesRead, blockNum = 1;
-    fd_set readfds;
-    struct timeval tv;
+void engineRun(Engine *engine) {
+    struct epoll_event events[MAX_EVENTS];
 
-    do {
-        bytesRead = fread(dataBuffer + 4, 1, 512, file);
-        if (ferror(file)) {
-            sendError(sockfd, clientAddr, clientAddrLen, 0, "Error reading the file");
-            break;
+    while (1) {
+        // On dort jusqu'au prochain paquet ou jusqu'à l'échéance du timer le plus proche
+        int timeout = -1;
+        if (engine->timerCount > 0) {
+            long long delay = engine->timers[0]->deadline - nowMs();
+            timeout = delay > 0 ? (int)delay : 0;
         }
 
-        dataBuffer[0] = 0;
-        dataBuffer[1] = OP_DATA;
-        dataBuffer[2] = (blockNum >> 8) & 0xFF;
-        dataBuffer[3] = blockNum & 0xFF;
-        
-        sendto(sockfd, dataBuffer, bytesRead + 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
-
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-        tv.tv_sec = TIMEOUT_SEC;
-        tv.tv_usec = 0;
-
-        int ackReceived = 0;
-        while (!ackReceived) {
-            int rv = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-            if (rv > 0) {
-                int len = recvfrom(sockfd, dataBuffer, BUFFER_SIZE, 0, (struct sockaddr *)clientAddr, &clientAddrLen);
-                if (len >= 4 && dataBuffer[1] == OP_ACK) {
-                    int ackBlockNum = (dataBuffer[2] << 8) | dataBuffer[3];
-                    if (ackBlockNum == blockNum) {
-                        ackReceived = 1;
-                    }
-                }
-            } else if (rv == 0) {
-                // Timeout occurred, retransmit the DATA packet
-                sendto(sockfd, dataBuffer, bytesRead + 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
+        int n = epoll_wait(engine->epollfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(4);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptRequests(engine);
             } else {
-                // Error occurred
-                perror("Error or timeout on ACK reception");
-                break;
+                sessionReadable(engine, events[i].data.ptr);
+            }
+        }
+
+        long long now = nowMs();
+        while (engine->timerCount > 0 && engine->timers[0]->deadline <= now) {
+            Session *session = engine->timers[0];
+            cancelTimer(engine, session);
+            sessionTimeout(engine, session);
+        }
+    }
+}
+
+void acceptRequests(Engine *engine) {
+    char buffer[BUFFER_SIZE + 1];
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen;
+
+    while (1) {
+        clientAddrLen = sizeof(clientAddr);
+        int receivedBytes = recvfrom(engine->listenfd, buffer, BUFFER_SIZE, 0,
+                                     (struct sockaddr *)&clientAddr, &clientAddrLen);
+        if (receivedBytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("recvfrom failed");
             }
+            return;
+        }
+        if (receivedBytes < 4) {
+            continue;
+        }
+        buffer[receivedBytes] = '\0';
+
+        // Traitement des requêtes
+        int opcode = buffer[1];
+        char *filename = buffer + 2;
+        char *mode = filename + strlen(filename) + 1;
+        if (opcode != OP_RRQ && opcode != OP_WRQ) {
+            fprintf(stderr, "Unsupported request. Only RRQ and WRQ are supported.\n");
+            continue;
         }
 
-        blockNum++;
-    } while (bytesRead == 512); // Continue if last read was a full block
+        Session *session = createSession(engine, &clientAddr, clientAddrLen, opcode);
+        if (!session) {
+            sendError(engine->listenfd, &clientAddr, clientAddrLen, 0, "Server busy");
+            continue;
+        }
 
-    flock(fileno(file), LOCK_UN); // Déverrouillage du fichier
-    fclose(file);
+        int started = (opcode == OP_RRQ) ? handleRRQ(engine, session, filename, mode)
+                                         : handleWRQ(engine, session, filename, mode);
+        if (!started) {
+            destroySession(engine, session);
+        }
+    }
 }
 
-// Implement the handleWRQ function to handle write requests
+Session* createSession(Engine *engine, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, int opcode) {
+    if (engine->sessionCount == engine->capacity) {
+        int capacity = engine->capacity ? engine->capacity * 2 : 64;
+        Session **sessions = realloc(engine->sessions, capacity * sizeof(Session *));
+        if (!sessions) {
+            return NULL;
+        }
+        engine->sessions = sessions;
+        Session **timers = realloc(engine->timers, capacity * sizeof(Session *));
+        if (!timers) {
+            return NULL;
+        }
+        engine->timers = timers;
+        engine->capacity = capacity;
+    }
 
-void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode) {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        perror("Cannot open file");
-        sendError(sockfd, clientAddr, clientAddrLen, 1, "Could not open file for writing");
-        return;
+    Session *session = calloc(1, sizeof(Session));
+    if (!session) {
+        return NULL;
     }
 
-    // Verrouillage du fichier en écriture
-    if (flock(fileno(file), LOCK_EX) == -1) { // LOCK_EX pour un verrou exclusif (écriture)
-        perror("flock failed");
-        fclose(file);
-        return;
+    session->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (session->sockfd < 0) {
+        perror("Failed to create socket for client session");
+        free(session);
+        return NULL;
+    }
+    if (bind(session->sockfd, (struct sockaddr *)&engine->bindAddr, sizeof(engine->bindAddr)) < 0) {
+        perror("Bind of session socket failed");
+        close(session->sockfd);
+        free(session);
+        return NULL;
     }
 
-    int blockNum = 0;
-    char buffer[BUFFER_SIZE];
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = session;
+    if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, session->sockfd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(session->sockfd);
+        free(session);
+        return NULL;
+    }
 
-    // Envoi du premier ACK pour confirmer la réception de la requête WRQ
-    sendACK(sockfd, clientAddr, clientAddrLen, 0);
+    session->clientAddr = *clientAddr;
+    session->clientAddrLen = clientAddrLen;
+    session->opcode = opcode;
+    rttInit(&session->rtt);
+    session->lastProgress = nowMs();
+    session->timerIndex = -1;
+    session->tableIndex = engine->sessionCount;
+    engine->sessions[engine->sessionCount++] = session;
+    return session;
+}
+
+void destroySession(Engine *engine, Session *session) {
+    cancelTimer(engine, session);
+    if (session->duplicates > 0 || session->strangers > 0) {
+        printf("Session %s:%d: %lu duplicate packets, %lu packets from unknown TIDs\n",
+               inet_ntoa(session->clientAddr.sin_addr), ntohs(session->clientAddr.sin_port),
+               session->duplicates, session->strangers);
+    }
+
+    Session *last = engine->sessions[--engine->sessionCount];
+    engine->sessions[session->tableIndex] = last;
+    last->tableIndex = session->tableIndex;
+
+    epoll_ctl(engine->epollfd, EPOLL_CTL_DEL, session->sockfd, NULL);
+    close(session->sockfd);
+    if (session->file) {
+        flock(fileno(session->file), LOCK_UN); // Déverrouillage du fichier
+        fclose(session->file);
+    }
+    free(session);
+}
 
-    fd_set readfds;
-    struct timeval tv;
+void sessionReadable(Engine *engine, Session *session) {
+    char buffer[BUFFER_SIZE];
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
 
     while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-        tv.tv_sec = TIMEOUT_SEC;
-        tv.tv_usec = 0;
-
-        int rv = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-        if (rv < 0) {
-            perror("Select error");
-            break;
-        } else if (rv == 0) {
-            printf("Timeout waiting for data packet\n");
-            break; // Timeout atteint sans recevoir de paquet DATA
+        fromAddrLen = sizeof(fromAddr);
+        int len = recvfrom(session->sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (len < 0) {
+            return; // EAGAIN : plus rien à lire
+        }
+        if (len < 4) { // Vérifie que le paquet est suffisamment grand pour contenir un en-tête
+            continue;
+        }
+        // La socket de la session n'est pas connectée : un paquet d'une autre adresse ou d'un
+        // autre port est rejeté sans toucher au transfert (RFC 1350, erreur 5)
+        if (fromAddr.sin_addr.s_addr != session->clientAddr.sin_addr.s_addr ||
+            fromAddr.sin_port != session->clientAddr.sin_port) {
+            sendError(session->sockfd, &fromAddr, fromAddrLen, 5, "Unknown transfer ID");
+            session->strangers++;
+            continue;
+        }
+        if (!sessionPacket(engine, session, buffer, len)) {
+            return; // Transfert terminé, la session n'existe plus
         }
+    }
+}
 
-        int recvLen = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)clientAddr, &clientAddrLen);
-        if (recvLen < 4) { // Vérifie que le paquet est suffisamment grand pour contenir un en-tête
-            sendError(sockfd, clientAddr, clientAddrLen, 0, "Received packet is too short");
-            break;
+// Traite un paquet reçu sur la socket de la session. Retourne 0 si la session a été détruite.
+int sessionPacket(Engine *engine, Session *session, const char *buffer, int len) {
+    int opcode = buffer[1];
+    int receivedBlockNum = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
+
+    if (opcode == OP_ERROR) {
+        destroySession(engine, session);
+        return 0;
+    }
+
+    if (session->opcode == OP_RRQ) {
+        if (opcode != OP_ACK || receivedBlockNum != (int)wireBlockNum(session->blockNum)) {
+            // ACK en double : le DATA n'est réémis qu'à l'expiration du timer, sinon chaque
+            // doublon dédoublerait la suite du transfert (RFC 1123 §4.2.3.1)
+            if (opcode == OP_ACK) {
+                session->duplicates++;
+            }
+            return 1;
+        }
+        if (session->lastBlock) {
+            destroySession(engine, session); // Dernier bloc acquitté
+            return 0;
+        }
+        rttAcked(&session->rtt, session->blockNum);
+        session->blockNum++;
+        session->lastProgress = nowMs();
+        if (!sendNextBlock(session)) {
+            sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Error reading the file");
+            destroySession(engine, session);
+            return 0;
         }
+        armTimer(engine, session, nowMs() + session->rtt.rtoMs);
+        return 1;
+    }
 
-        int opcode = buffer[1];
-        int receivedBlockNum = (buffer[2] << 8) + buffer[3];
+    if (opcode != OP_DATA) {
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Expected DATA packet");
+        destroySession(engine, session);
+        return 0;
+    }
 
-        if (opcode != OP_DATA) {
-            sendError(sockfd, clientAddr, clientAddrLen, 0, "Expected DATA packet");
-            break;
+    if (receivedBlockNum == (int)wireBlockNum(session->blockNum + 1) && !session->lastBlock) {
+        size_t writtenBytes = fwrite(buffer + 4, 1, len - 4, session->file);
+        if (writtenBytes < (size_t)(len - 4)) {
+            sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Failed to write data to file");
+            destroySession(engine, session);
+            return 0;
         }
 
-        if (receivedBlockNum == blockNum + 1) {
-            size_t writtenBytes = fwrite(buffer + 4, 1, recvLen - 4, file);
-            if (writtenBytes < (size_t)(recvLen - 4)) {
-                sendError(sockfd, clientAddr, clientAddrLen, 0, "Failed to write data to file");
-                break;
+        if (len < BUFFER_SIZE) {
+            printf("Last data packet received\n");
+            // Le tampon de setvbuf retient encore des données : on ne confirme le dernier bloc
+            // qu'une fois le fichier réellement écrit, sinon le client croirait l'envoi réussi
+            int flushed = fflush(session->file) == 0;
+            int flushErrno = errno;
+            flock(fileno(session->file), LOCK_UN); // Déverrouillage du fichier
+            if (fclose(session->file) != 0 && flushed) {
+                flushed = 0;
+                flushErrno = errno;
+            }
+            session->file = NULL;
+            if (!flushed) {
+                if (flushErrno == ENOSPC) {
+                    sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 3, "Disk full");
+                } else {
+                    sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Failed to write data to file");
+                }
+                destroySession(engine, session);
+                return 0;
             }
+            // Le fichier est complet, mais on garde la session jusqu'au timeout
+            // pour réacquitter un doublon du dernier bloc
+            session->lastBlock = 1;
+        }
+
+        session->blockNum++;
+        session->lastProgress = nowMs();
+        rttAcked(&session->rtt, session->blockNum);
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, receivedBlockNum);
+        rttStart(&session->rtt, session->blockNum + 1);
+        // L'attente finale couvre les retransmissions du client au délai maximal
+        armTimer(engine, session, nowMs() + (session->lastBlock ? MAX_RTO_MS : session->rtt.rtoMs));
+    } else if (receivedBlockNum == (int)wireBlockNum(session->blockNum)) {
+        // Doublon : notre ACK s'est perdu, on le renvoie
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, receivedBlockNum);
+        rttCancel(&session->rtt);
+        session->duplicates++;
+    } else {
+        printf("Unexpected block number received: %d\n", receivedBlockNum);
+    }
+    return 1;
+}
 
-            sendACK(sockfd, clientAddr, clientAddrLen, receivedBlockNum);
-            blockNum = receivedBlockNum; // Mise à jour du numéro de bloc attendu pour le prochain paquet
+void sessionTimeout(Engine *engine, Session *session) {
+    if (session->opcode == OP_WRQ && session->lastBlock) {
+        destroySession(engine, session); // Fichier complet, plus de doublon à attendre
+        return;
+    }
 
-            if (recvLen < 512) {
-                printf("Last data packet received\n");
-                break; // Si la longueur du paquet DATA est < 512, c'est le dernier paquet
-            }
-        } else {
-            // Si le numéro de bloc ne correspond pas à celui attendu, ignorez le paquet ou traitez l'erreur
-            printf("Unexpected block number received: %d\n", receivedBlockNum);
+    // Les retransmissions s'espacent ; on abandonne quand MAX_RETRIES délais maximaux
+    // se sont écoulés sans progression, comme avec l'ancien timeout fixe
+    if (nowMs() - session->lastProgress >= (long long)MAX_RTO_MS * MAX_RETRIES) {
+        printf("Timeout occurred, transfer aborted\n");
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Transfer timed out");
+        destroySession(engine, session);
+        return;
+    }
+    rttBackoff(&session->rtt);
+
+    if (session->opcode == OP_RRQ) {
+        // Timeout occurred, retransmit the DATA packet
+        sendto(session->sockfd, session->dataBuffer, session->dataLen, 0,
+               (struct sockaddr *)&session->clientAddr, session->clientAddrLen);
+    } else {
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, wireBlockNum(session->blockNum));
+    }
+    armTimer(engine, session, nowMs() + session->rtt.rtoMs);
+}
+
+// Implement the handleRRQ function to handle read requests
+// Retourne 0 si la session doit être détruite.
+int handleRRQ(Engine *engine, Session *session, const char *filename, const char *mode) {
+    (void)mode;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("File not found or cannot be opened");
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 1, "File not found");
+        return 0;
+    }
+
+    // Verrouillage du fichier en lecture ; la boucle ne doit jamais bloquer, un fichier
+    // en cours d'écriture par une autre session est donc refusé
+    if (flock(fileno(file), LOCK_SH | LOCK_NB) == -1) { // LOCK_SH pour un verrou partagé (lecture)
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 2, "File is being written");
+        fclose(file);
+        return 0;
+    }
+    session->file = file;
+    session->blockNum = 1;
+
+    if (!sendNextBlock(session)) {
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Error reading the file");
+        return 0;
+    }
+    armTimer(engine, session, nowMs() + session->rtt.rtoMs);
+    return 1;
+}
+
+// Lit et envoie le bloc session->blockNum ; le paquet est conservé pour la retransmission
+int sendNextBlock(Session *session) {
+    char *dataBuffer = session->dataBuffer;
+    int bytesRead = fread(dataBuffer + 4, 1, 512, session->file);
+    if (ferror(session->file)) {
+        return 0;
+    }
+
+    dataBuffer[0] = 0;
+    dataBuffer[1] = OP_DATA;
+    dataBuffer[2] = wireBlockNum(session->blockNum) >> 8;
+    dataBuffer[3] = wireBlockNum(session->blockNum) & 0xFF;
+    session->dataLen = bytesRead + 4;
+    session->lastBlock = (bytesRead < 512); // The last packet must be less than 512 bytes
+
+    sendto(session->sockfd, dataBuffer, session->dataLen, 0, (struct sockaddr *)&session->clientAddr, session->clientAddrLen);
+    rttStart(&session->rtt, session->blockNum);
+    return 1;
+}
+
+// Implement the handleWRQ function to handle write requests
+
+int handleWRQ(Engine *engine, Session *session, const char *filename, const char *mode) {
+    (void)mode;
+    // Le fichier n'est tronqué qu'une fois le verrou exclusif obtenu
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (file == NULL) {
+        perror("Cannot open file");
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 1, "Could not open file for writing");
+        if (fd >= 0) {
+            close(fd);
         }
+        return 0;
     }
 
-    flock(fileno(file), LOCK_UN); // Déverrouillage du fichier
-    fclose(file);
-}
\ No newline at end of file
+    // Verrouillage du fichier en écriture
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) { // LOCK_EX pour un verrou exclusif (écriture)
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 2, "File is in use");
+        fclose(file);
+        return 0;
+    }
+    if (ftruncate(fd, 0) == -1) {
+        perror("ftruncate failed");
+    }
+    // Les blocs de 512 octets sont regroupés en grandes écritures. Pas de fsync ici : la
+    // boucle unique attendrait le disque pour toutes les sessions.
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+    session->file = file;
+    session->blockNum = 0;
+
+    // Envoi du premier ACK pour confirmer la réception de la requête WRQ
+    sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, 0);
+    rttStart(&session->rtt, 1);
+    armTimer(engine, session, nowMs() + session->rtt.rtoMs);
+    return 1;
+}
+
+// Numéro de bloc sur 16 bits d'un bloc absolu : après 65535 on repart à rolloverBase
+unsigned int wireBlockNum(unsigned long block) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rolloverBase ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
+}
+
+long long nowMs(void) {
+    return nowUs() / 1000;
+}
+
+long long nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rttInit(RttEstimator *rtt) {
+    memset(rtt, 0, sizeof(*rtt));
+    rtt->rtoMs = INITIAL_RTO_MS;
+}
+
+// Début de mesure à la première émission du paquet qui attend la réponse block
+void rttStart(RttEstimator *rtt, int block) {
+    if (!rtt->timing) {
+        rtt->timing = 1;
+        rtt->timedBlock = block;
+        rtt->sentUs = nowUs();
+    }
+}
+
+// Réponse attendue reçue : nouvel échantillon si elle correspond au paquet mesuré
+void rttAcked(RttEstimator *rtt, int block) {
+    if (!rtt->timing || block < rtt->timedBlock) {
+        return;
+    }
+    rtt->timing = 0;
+
+    long long sample = nowUs() - rtt->sentUs;
+    if (!rtt->hasSample) {
+        rtt->srttUs = sample;
+        rtt->rttvarUs = sample / 2;
+        rtt->hasSample = 1;
+    } else {
+        long long delta = rtt->srttUs > sample ? rtt->srttUs - sample : sample - rtt->srttUs;
+        rtt->rttvarUs = (3 * rtt->rttvarUs + delta) / 4;
+        rtt->srttUs = (7 * rtt->srttUs + sample) / 8;
+    }
+
+    long long rto = (rtt->srttUs + 4 * rtt->rttvarUs) / 1000;
+    rtt->rtoMs = rto < MIN_RTO_MS ? MIN_RTO_MS : (rto > MAX_RTO_MS ? MAX_RTO_MS : rto);
+}
+
+// Le paquet mesuré va être réémis : sa réponse serait ambiguë (Karn)
+void rttCancel(RttEstimator *rtt) {
+    rtt->timing = 0;
+}
+
+// Timeout : le délai double jusqu'au plafond, jusqu'à la prochaine mesure valide
+void rttBackoff(RttEstimator *rtt) {
+    rtt->timing = 0;
+    rtt->rtoMs = rtt->rtoMs * 2 > MAX_RTO_MS ? MAX_RTO_MS : rtt->rtoMs * 2;
+}
+
+// (Ré)arme le timer d'une session dans le tas
+void armTimer(Engine *engine, Session *session, long long deadline) {
+    if (session->timerIndex < 0) {
+        session->timerIndex = engine->timerCount;
+        engine->timers[engine->timerCount++] = session;
+        session->deadline = deadline;
+        timerSiftUp(engine, session->timerIndex);
+        return;
+    }
+
+    long long previous = session->deadline;
+    session->deadline = deadline;
+    if (deadline < previous) {
+        timerSiftUp(engine, session->timerIndex);
+    } else {
+        timerSiftDown(engine, session->timerIndex);
+    }
+}
+
+void cancelTimer(Engine *engine, Session *session) {
+    int index = session->timerIndex;
+    if (index < 0) {
+        return;
+    }
+
+    session->timerIndex = -1;
+    Session *last = engine->timers[--engine->timerCount];
+    if (index == engine->timerCount) {
+        return;
+    }
+    engine->timers[index] = last;
+    last->timerIndex = index;
+    timerSiftUp(engine, index);
+    timerSiftDown(engine, last->timerIndex);
+}
+
+void timerSiftUp(Engine *engine, int index) {
+    Session **timers = engine->timers;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (timers[parent]->deadline <= timers[index]->deadline) {
+            break;
+        }
+        Session *tmp = timers[parent];
+        timers[parent] = timers[index];
+        timers[index] = tmp;
+        timers[parent]->timerIndex = parent;
+        timers[index]->timerIndex = index;
+        index = parent;
+    }
+}
+
+void timerSiftDown(Engine *engine, int index) {
+    Session **timers = engine->timers;
+    while (1) {
+        int smallest = index;
+        int left = 2 * index + 1, right = left + 1;
+        if (left < engine->timerCount && timers[left]->deadline < timers[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < engine->timerCount && timers[right]->deadline < timers[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            break;
+        }
+        Session *tmp = timers[smallest];
+        timers[smallest] = timers[index];
+        timers[index] = tmp;
+        timers[smallest]->timerIndex = smallest;
+        timers[index]->timerIndex = index;
+        index = smallest;
+    }
+}
@@ -1,12 +1,24 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/time.h> // Pour struct timeval
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #define BUFFER_SIZE 516
 #define OP_RRQ 1
@@ -14,44 +26,322 @@
 #define OP_DATA 3
 #define OP_ACK 4
 #define OP_ERROR 5
+#define OP_OACK 6
+#define OPTION_MULTICAST "multicast" // Diffusion d'un fichier à un groupe de clients (RFC 2090)
 #define DEFAULT_TFTP_PORT 6969
-#define MAX_FILES 100
-#define TIMEOUT_SEC 60 // Timeout pour recvfrom en secondes
+#define LOCK_SHARDS 64 // Nombre de partitions de la table des verrous (puissance de 2)
+#define TIMEOUT_SEC 60 // Plafond du délai de retransmission adaptatif, en secondes
+#define INITIAL_RTO_MS 1000 // Délai de retransmission avant la première mesure (RFC 6298)
+#define MIN_RTO_MS 200 // Plancher : sur un LAN, une perte coûte 200 ms au lieu de TIMEOUT_SEC
+#define MAX_RTO_MS (TIMEOUT_SEC * 1000)
 // #define MAX_RETRIES 3
+#define DEFAULT_WORKERS 8 // Threads du pool de traitement (option -w)
+#define DEFAULT_QUEUE_DEPTH 256 // Requêtes en attente au plus, arrondi à une puissance de 2 (option -q)
+#define DEFAULT_STATS_INTERVAL 10 // Secondes entre deux rapports de la file, 0 pour désactiver (option -s)
+#define DEFAULT_CACHE_MB 64 // Taille du cache de fichiers en Mo, 0 pour le désactiver (option -c)
+#define CACHE_MAX_FRACTION 4 // Un fichier plus gros que capacité / 4 n'est pas mis en cache
+#define MAX_LISTENERS 64 // Threads de réception des requêtes au plus (option -l)
+#define WRITE_BUFFER_SIZE (256 * 1024) // Tampon d'un worker pour les téléversements : un write() tous les 512 blocs
+#define REORDER_HOLD_MS 20 // Retenue minimale d'un paquet réordonné, pour que les suivants le doublent
+#define MAX_MULTICAST_SESSIONS 16 // Fichiers diffusés en même temps, un port de groupe chacun
+#define MULTICAST_MASTER_RETRIES 4 // Délais sans ACK avant de remplacer le client maître
+#define MULTICAST_TTL 1 // Les DATA multicast restent sur le réseau local
 
 typedef struct {
     int sockfd;
     struct sockaddr_in clientAddr;
     socklen_t clientAddrLen;
+    int opcode;
     char filename[100];
     char mode[10];
+    int multicast;        // Vrai si le RRQ porte l'option multicast et que -m est actif
+    long long enqueuedUs; // Date d'entrée dans la file, pour mesurer l'attente
 } ClientRequest;
 
+// Estimation du délai de retransmission à la Jacobson/Karels (RFC 6298), propre à chaque
+// session. Seuls les paquets émis une seule fois sont mesurés (algorithme de Karn) et
+// chaque timeout double le délai.
 typedef struct {
+    long long srttUs;        // RTT lissé
+    long long rttvarUs;      // Variation moyenne du RTT
+    long long rtoMs;         // Délai de retransmission courant, backoff compris
+    int hasSample;
+    int timing;              // Vrai si une mesure est en cours
+    int timedBlock;          // Bloc dont on attend l'ACK (RRQ) ou le DATA (WRQ)
+    long long sentUs;        // Date d'émission du paquet mesuré
+} RttEstimator;
+
+// Case de la file : le numéro de séquence indique si la case est libre ou occupée
+typedef struct {
+    atomic_size_t sequence;
+    ClientRequest request;
+} QueueCell;
+
+// File MPMC bornée sans verrou (algorithme de D. Vyukov). Les workers dorment sur
+// un sémaphore qui compte les requêtes disponibles ; la file elle-même ne prend aucun verrou.
+typedef struct {
+    QueueCell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueuePos;
+    _Alignas(64) atomic_size_t dequeuePos;
+    sem_t items;
+} RequestQueue;
+
+// Statistiques de la file, mises à jour sans verrou par le thread principal et les workers
+typedef struct {
+    atomic_ulong enqueued;
+    atomic_ulong rejected;
+    atomic_ulong served;
+    atomic_ulong totalWaitUs;
+    atomic_ulong maxWaitUs;
+    atomic_ulong maxDepth;
+} QueueStats;
+
+// Verrou lecteurs/rédacteur d'un fichier : plusieurs RRQ lisent en parallèle,
+// un WRQ prend l'accès exclusif. L'entrée est libérée quand plus personne ne la référence.
+typedef struct FileLock {
     char filename[100];
-    pthread_mutex_t mutex;
+    pthread_rwlock_t rwlock;
+    int refCount;            // Protégé par le mutex de la partition
+    unsigned int shard;
+    struct FileLock* next;   // Chaînage dans la partition
 } FileLock;
 
-FileLock fileLocks[MAX_FILES];
-int fileLockCount = 0;
-pthread_mutex_t fileLocksMutex = PTHREAD_MUTEX_INITIALIZER;
+// Partition de la table : un mutex ne protège que les entrées dont le nom tombe dans ce hachage.
+// Les entrées libérées restent dans la partition, leur rwlock initialisé, pour le fichier suivant.
+typedef struct {
+    pthread_mutex_t mutex;
+    FileLock* head;
+    FileLock* freeLocks;
+} LockShard;
+
+LockShard lockShards[LOCK_SHARDS];
+
+// Contenu d'un fichier gardé en mémoire. La clé est le nom plus l'inode et la date de
+// modification : un fichier remplacé ou modifié hors du serveur n'est jamais servi périmé.
+typedef struct CacheEntry {
+    char filename[100];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t size;
+    char* data;
+    int refCount;              // Une par session qui envoie l'entrée, plus une tant qu'elle est dans le cache
+    struct CacheEntry* prev;   // Liste LRU, l'entrée la plus récente en tête
+    struct CacheEntry* next;
+} CacheEntry;
+
+// Cache LRU borné en octets, partagé par tous les workers. Une entrée évincée ou invalidée
+// pendant un envoi reste valide pour les sessions qui la tiennent jusqu'à leur dernière libération.
+typedef struct {
+    pthread_mutex_t mutex;
+    CacheEntry* head;
+    CacheEntry* tail;
+    size_t used;
+    size_t capacity;
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong evictions;
+    atomic_ulong invalidations;
+} FileCache;
+
+FileCache fileCache;
+
+// Allocations sur le tas faites en cours de service. Les workers allouent leur tampon une fois
+// au démarrage et les verrous sont recyclés : en régime établi seul le cache alloue encore
+// (à chaque chargement), les sessions servies depuis le cache ne comptent que des reprises.
+typedef struct {
+    atomic_ulong heapAllocs;
+    atomic_ulong reused;
+} AllocStats;
+
+// Paquets écartés par les sessions : ACK en double ignorés (le bloc n'est réémis qu'à
+// l'expiration du délai, RFC 1123 §4.2.3.1), DATA en double réacquittés une fois chacun,
+// paquets d'un autre TID rejetés par une erreur 5
+typedef struct {
+    atomic_ulong duplicateAcks;
+    atomic_ulong duplicateData;
+    atomic_ulong strangers;
+} SessionStats;
+
+// Dégradations simulées du réseau (option -I), pour exercer les retransmissions sans vrai réseau
+// défaillant. Les envois et réceptions des sessions passent par impairedSend et impairedRecv :
+// un paquet peut être perdu, dupliqué, retardé (délai uniforme entre delayMs et delayMs + jitterMs)
+// ou retenu assez longtemps pour que les suivants le doublent. Les paquets retardés attendent
+// dans une liste triée par échéance, émis par le thread delayLoop.
+typedef struct DelayedPacket {
+    struct DelayedPacket* next;
+    long long dueUs;
+    int sockfd;                   // Copie (dup) de la socket : la session peut se terminer avant l'envoi
+    struct sockaddr_in addr;
+    socklen_t addrLen;
+    size_t len;
+    char data[];
+} DelayedPacket;
+
+typedef struct {
+    int enabled;
+    double drop, duplicate, reorder; // Probabilités par paquet
+    int delayMs, jitterMs;
+    unsigned int seed;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    DelayedPacket* delayed;
+    atomic_ulong dropped, duplicated, reordered, delayedCount;
+} Impairment;
+
+// Sessions multicast (option -m). Les clients d'une session forment une liste dont le premier
+// est le maître ; les workers qui reçoivent un nouveau client l'ajoutent en fin de liste sous
+// le verrou, seul le worker de la session retire des clients.
+typedef struct MulticastClient {
+    struct MulticastClient* next;
+    struct sockaddr_in addr;
+    socklen_t addrLen;
+} MulticastClient;
+
+typedef struct {
+    int active;
+    char filename[100];
+    int sockfd;                 // Socket du worker de la session : TID de tous ses clients
+    struct sockaddr_in group;   // Groupe et port de diffusion des DATA
+    MulticastClient* clients;
+} MulticastSession;
+
+typedef struct {
+    int enabled;
+    struct sockaddr_in group;   // Adresse du groupe et port de la première session
+    struct in_addr interface;   // Interface d'émission : l'adresse d'écoute saisie
+    pthread_mutex_t mutex;
+    MulticastSession sessions[MAX_MULTICAST_SESSIONS];
+    atomic_ulong sessionsStarted, clientsJoined, blocksSent;
+} Multicast;
+
+RequestQueue requestQueue;
+QueueStats queueStats;
+AllocStats allocStats;
+SessionStats sessionStats;
+Impairment impairment;
+Multicast multicast;
+int pinListeners = 0; // Vrai si chaque thread de réception est épinglé sur son processeur (-l > 1)
+int listenSockets[MAX_LISTENERS]; // Socket de chaque thread de réception, désigné par son rang
+int statsInterval = DEFAULT_STATS_INTERVAL;
+int rolloverBase = 0; // Numéro de bloc qui suit 65535 (option -r) : 0 ou 1 selon les implémentations
 
 // Prototypes des fonctions
-void* handleRRQ(void* arg);
-void* handleWRQ(void* arg);
+void handleRRQ(ClientRequest* request);
+void handleWRQ(ClientRequest* request, char* uploadBuffer);
+void handleMulticastRRQ(ClientRequest* request);
+void multicastSend(MulticastSession* session, const char* map, size_t fileSize);
+size_t multicastBlockLen(size_t fileSize, unsigned long block);
+int multicastNextMaster(MulticastSession* session, MulticastClient* master);
+void multicastEnd(MulticastSession* session, const char* errorMessage);
+int multicastJoin(MulticastSession* session, ClientRequest* request);
+MulticastClient* multicastLast(MulticastSession* session);
+MulticastClient* multicastFind(MulticastSession* session, struct sockaddr_in* addr);
+void multicastRemove(MulticastSession* session, MulticastClient* client);
+void sendMulticastOACK(MulticastSession* session, MulticastClient* client, int master);
+int multicastInit(const char* spec);
+int writeAll(int fd, const char* data, size_t len);
+int queueInit(RequestQueue* queue, size_t depth);
+int queuePush(RequestQueue* queue, const ClientRequest* request);
+int queuePop(RequestQueue* queue, ClientRequest* request);
+size_t queueDepth(RequestQueue* queue);
+void* workerLoop(void* arg);
+void* listenerLoop(void* arg);
+int openListener(struct sockaddr_in* serverAddr, int reusePort);
+void pinToCpu(int index);
+void* statsLoop(void* arg);
+void atomicMax(atomic_ulong* target, unsigned long value);
+long long nowUs(void);
+void rttInit(RttEstimator* rtt);
+void rttStart(RttEstimator* rtt, int block);
+void rttAcked(RttEstimator* rtt, int block);
+void rttCancel(RttEstimator* rtt);
+void rttBackoff(RttEstimator* rtt);
+void setReceiveTimeout(int sockfd, long long timeoutMs);
+int sameTid(const struct sockaddr_in* a, const struct sockaddr_in* b);
+void rejectUnknownTid(int sockfd, struct sockaddr_in* fromAddr, socklen_t fromAddrLen);
+void initFileLocks(void);
+unsigned int hashFilename(const char* filename);
 FileLock* getFileLock(const char* filename);
-void lockFile(FileLock* lock);
+void lockFile(FileLock* lock, int exclusive);
 void unlockFile(FileLock* lock);
+void cacheInit(size_t capacity);
+CacheEntry* cacheLookup(const char* filename, const struct stat* st);
+CacheEntry* cacheLoad(const char* filename, int fd);
+void cacheRelease(CacheEntry* entry);
+void cacheInvalidate(const char* filename);
+void cacheRemove(CacheEntry* entry);
 void sendError(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrLen, const char* errorMessage);
 void sendACK(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrLen, int blockNum);
+unsigned int wireBlockNum(unsigned long block);
+ssize_t sendDataBlock(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrLen, int blockNum, const char* data, size_t len);
+int impairmentInit(const char* spec);
+void impairmentThread(unsigned int stream);
+double impairmentRandom(void);
+ssize_t impairedSend(int sockfd, const struct msghdr* msg);
+ssize_t impairedSendto(int sockfd, const void* data, size_t len, const struct sockaddr_in* addr, socklen_t addrLen);
+ssize_t impairedRecv(int sockfd, void* buf, size_t len, struct sockaddr* addr, socklen_t* addrLen);
+void delayPacket(int sockfd, const struct msghdr* msg, size_t len, long long delayUs);
+void* delayLoop(void* arg);
 
-int main() {
-    int sockfd;
-    struct sockaddr_in serverAddr, clientAddr;
-    char buffer[BUFFER_SIZE];
-    socklen_t clientAddrLen = sizeof(clientAddr);
+int main(int argc, char *argv[]) {
+    struct sockaddr_in serverAddr;
     char serverIP[INET_ADDRSTRLEN]; // Buffer pour l'adresse IP du serveur
     int serverPort; // Variable pour le port du serveur
+    int workers = DEFAULT_WORKERS;
+    int queueDepthLimit = DEFAULT_QUEUE_DEPTH;
+    int cacheMb = DEFAULT_CACHE_MB;
+    int listeners = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:q:s:c:l:r:I:m:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'q':
+                queueDepthLimit = atoi(optarg);
+                break;
+            case 's':
+                statsInterval = atoi(optarg);
+                break;
+            case 'c':
+                cacheMb = atoi(optarg);
+                break;
+            case 'l':
+                listeners = atoi(optarg);
+                if (listeners <= 0) {
+                    listeners = sysconf(_SC_NPROCESSORS_ONLN); // 0 : un thread par processeur
+                }
+                if (listeners > MAX_LISTENERS) {
+                    listeners = MAX_LISTENERS;
+                }
+                break;
+            case 'r':
+                rolloverBase = atoi(optarg) == 1;
+                break;
+            case 'I':
+                if (!impairmentInit(optarg)) {
+                    fprintf(stderr, "Invalid impairment \"%s\", expected drop=P,dup=P,reorder=P,delay=MS,jitter=MS,seed=N\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if (!multicastInit(optarg)) {
+                    fprintf(stderr, "Invalid multicast group \"%s\", expected address:port, for example 239.255.0.69:1758\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-q queue depth] [-s stats interval] [-c cache MB] [-l listeners] [-r rollover 0|1] [-I impairment] [-m group:port]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (workers < 1 || queueDepthLimit < 1 || cacheMb < 0) {
+        fprintf(stderr, "Workers and queue depth must be positive, cache size non-negative\n");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Enter server IP address (or 'any' to listen on all interfaces): ");
     scanf("%s", serverIP);
@@ -60,157 +350,397 @@ int main() {
     if (serverPort == 0) {
         serverPort = DEFAULT_TFTP_PORT; // Utilisation du port par défaut si 0 est saisi
     }
-
-    // Initialisation du socket serveur
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    if (multicast.enabled) {
+        // Les groupes sont joints sur l'interface de l'adresse saisie ("any" : interface par défaut)
+        inet_pton(AF_INET, serverIP, &multicast.interface);
     }
 
+    // Initialisation des sockets serveur : une par thread de réception, qui partagent le
+    // port avec SO_REUSEPORT quand il y en a plusieurs
     memset(&serverAddr, 0, sizeof(serverAddr));
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     serverAddr.sin_port = htons(serverPort);
 
-    if (bind(sockfd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-        perror("Bind failed");
+    for (int i = 0; i < listeners; i++) {
+        listenSockets[i] = openListener(&serverAddr, listeners > 1);
+    }
+
+    initFileLocks();
+    cacheInit((size_t)cacheMb * 1024 * 1024);
+
+    // Pool de workers de taille fixe alimenté par la file bornée
+    if (!queueInit(&requestQueue, queueDepthLimit)) {
+        perror("Failed to allocate request queue");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerLoop, (void*)(intptr_t)i) != 0) {
+            perror("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    if (statsInterval > 0) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, statsLoop, NULL) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    if (impairment.enabled) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, delayLoop, NULL) != 0) {
+            perror("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+        printf("Impairment: drop %.3f, duplicate %.3f, reorder %.3f, delay %d+%d ms\n", impairment.drop,
+               impairment.duplicate, impairment.reorder, impairment.delayMs, impairment.jitterMs);
+    }
+
+    printf("TFTP Server running on port %d (%d workers, %d listeners, queue depth %zu)\n",
+           serverPort, workers, listeners, requestQueue.mask + 1);
+    fflush(stdout);
+
+    // Chaque thread de réception est épinglé sur son processeur et alimente la même file,
+    // qui ne prend aucun verrou ; le premier tourne dans le thread principal
+    pinListeners = listeners > 1;
+    for (int i = 1; i < listeners; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, listenerLoop, (void*)(intptr_t)i) != 0) {
+            perror("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    listenerLoop((void*)(intptr_t)0);
+    return 0;
+}
+
+// Réception des requêtes sur une socket d'écoute et mise en file pour les workers
+void* listenerLoop(void* arg) {
+    int index = (int)(intptr_t)arg;
+    int sockfd = listenSockets[index];
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen;
+    char buffer[BUFFER_SIZE];
+    static atomic_int nextCpu;
 
-    printf("TFTP Server running on port %d\n", serverPort);
+    if (pinListeners) {
+        pinToCpu(atomic_fetch_add(&nextCpu, 1));
+    }
+    impairmentThread(2 * index + 1);
 
     while (1) {
-        int receivedBytes = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&clientAddr, &clientAddrLen);
+        clientAddrLen = sizeof(clientAddr);
+        int receivedBytes = impairedRecv(sockfd, buffer, BUFFER_SIZE - 1, (struct sockaddr *)&clientAddr, &clientAddrLen);
         if (receivedBytes < 0) {
             perror("recvfrom failed");
             continue;
         }
+        buffer[receivedBytes] = '\0';
 
-        // Création d'une socket pour la session client
-        int clientSockfd = socket(AF_INET, SOCK_DGRAM, 0);
-        if (clientSockfd < 0) {
-            perror("Failed to create socket for client session");
+        // Gestion des requêtes non supportées
+        if (receivedBytes < 4 || (buffer[1] != OP_RRQ && buffer[1] != OP_WRQ)) {
+            sendError(sockfd, &clientAddr, clientAddrLen, "Unsupported request.");
             continue;
         }
 
-        // Préparation de la requête client
-        ClientRequest* request = (ClientRequest*)malloc(sizeof(ClientRequest));
-        if (!request) {
-            perror("Failed to allocate memory for client request");
-            close(clientSockfd);
+        // Préparation de la requête client ; la socket de session est créée par le worker
+        ClientRequest request;
+        memset(&request, 0, sizeof(request));
+        request.sockfd = -1;
+        request.clientAddr = clientAddr;
+        request.clientAddrLen = clientAddrLen;
+        request.opcode = buffer[1];
+        strncpy(request.filename, buffer + 2, sizeof(request.filename) - 1);
+        const char* mode = buffer + 2 + strlen(buffer + 2) + 1;
+        if (mode < buffer + receivedBytes) {
+            strncpy(request.mode, mode, sizeof(request.mode) - 1);
+        }
+        // Options (RFC 2347) : seule multicast est reconnue, pour un RRQ et avec -m
+        if (request.opcode == OP_RRQ && multicast.enabled && mode < buffer + receivedBytes) {
+            const char* option = mode + strlen(mode) + 1;
+            while (option < buffer + receivedBytes) {
+                const char* value = option + strlen(option) + 1;
+                if (value > buffer + receivedBytes) {
+                    break;
+                }
+                if (strcasecmp(option, OPTION_MULTICAST) == 0) {
+                    request.multicast = 1;
+                }
+                option = value + strlen(value) + 1;
+            }
+        }
+        request.enqueuedUs = nowUs();
+
+        // File pleine : on refuse tout de suite plutôt que d'accumuler du retard
+        if (!queuePush(&requestQueue, &request)) {
+            atomic_fetch_add(&queueStats.rejected, 1);
+            sendError(sockfd, &clientAddr, clientAddrLen, "Server busy");
             continue;
         }
-        
-        request->sockfd = clientSockfd;
-        request->clientAddr = clientAddr;
-        request->clientAddrLen = clientAddrLen;
-        strncpy(request->filename, buffer + 2, sizeof(request->filename) - 1);
-        // Assurez-vous de gérer correctement le mode ici
-        // Déclaration du pointeur vers la fonction
+        atomic_fetch_add(&queueStats.enqueued, 1);
+        atomicMax(&queueStats.maxDepth, queueDepth(&requestQueue));
+        sem_post(&requestQueue.items);
+    }
 
-        // Lancement du thread pour traiter la requête
-        pthread_t thread;
-// Déclaration du pointeur vers la fonction
-void* (*handlerFunc)(void *) = NULL; // This declares a function pointer correctly.
+    close(sockfd);
+    return NULL;
+}
+
+int openListener(struct sockaddr_in* serverAddr, int reusePort) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
 
+    int one = 1;
+    if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
 
-// Affectation conditionnelle basée sur le type de requête
-if (buffer[1] == OP_RRQ) {
-    handlerFunc = handleRRQ;
-} else if (buffer[1] == OP_WRQ) {
-    handlerFunc = handleWRQ;
-} else {
-    // Gestion des requêtes non supportées
-    sendError(clientSockfd, &clientAddr, clientAddrLen, "Unsupported request.");
-    free(request);
-    continue; // Passez à la prochaine itération de la boucle si la requête n'est pas supportée
+    if (bind(sockfd, (struct sockaddr *)serverAddr, sizeof(*serverAddr)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
 }
 
-// Création d'un thread pour gérer la requête avec la fonction appropriée
-if (pthread_create(&thread, NULL, handlerFunc, (void*)request) != 0) {
-    perror("Thread creation failed");
-    close(clientSockfd);
-    free(request);
-} else {
-    pthread_detach(thread);
+// Épingle le thread courant sur le index-ième processeur autorisé au processus
+void pinToCpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    index %= CPU_COUNT(&allowed);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                fprintf(stderr, "Failed to pin listener thread to CPU %d\n", cpu);
+            }
+            return;
+        }
+    }
 }
+
+// Boucle d'un worker : attend une requête, ouvre sa socket de session et la traite.
+// Le tampon des téléversements est alloué une fois et sert à toutes les sessions du worker.
+void* workerLoop(void* arg) {
+    impairmentThread(2 * (int)(intptr_t)arg);
+    ClientRequest request;
+    char* uploadBuffer = malloc(WRITE_BUFFER_SIZE);
+    if (!uploadBuffer) {
+        perror("Failed to allocate worker upload buffer");
+        exit(EXIT_FAILURE);
     }
+    atomic_fetch_add(&allocStats.heapAllocs, 1);
 
-    close(sockfd);
-    return 0;
+    while (1) {
+        while (sem_wait(&requestQueue.items) != 0 && errno == EINTR) {
+        }
+        // Un jeton correspond à une requête publiée ou en passant de l'être : avec plusieurs
+        // listeners, la case en tête peut être réservée mais pas encore écrite alors qu'une
+        // suivante est déjà publiée. On attend donc la tête au lieu de perdre le jeton.
+        while (!queuePop(&requestQueue, &request)) {
+            sched_yield();
+        }
+
+        unsigned long waitUs = nowUs() - request.enqueuedUs;
+        atomic_fetch_add(&queueStats.served, 1);
+        atomic_fetch_add(&queueStats.totalWaitUs, waitUs);
+        atomicMax(&queueStats.maxWaitUs, waitUs);
+
+        // Création d'une socket pour la session client
+        request.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (request.sockfd < 0) {
+            perror("Failed to create socket for client session");
+            continue;
+        }
+
+        if (request.opcode == OP_RRQ && request.multicast) {
+            handleMulticastRRQ(&request);
+        } else if (request.opcode == OP_RRQ) {
+            handleRRQ(&request);
+        } else {
+            handleWRQ(&request, uploadBuffer);
+        }
+        close(request.sockfd);
+    }
+    return NULL;
+}
+
+// Affiche périodiquement l'état de la file
+void* statsLoop(void* arg) {
+    (void)arg;
+    while (1) {
+        sleep(statsInterval);
+        unsigned long served = atomic_load(&queueStats.served);
+        unsigned long totalWaitUs = atomic_load(&queueStats.totalWaitUs);
+        printf("queue: depth %zu (max %lu), enqueued %lu, rejected %lu, served %lu, wait avg %.2f ms max %.2f ms\n",
+               queueDepth(&requestQueue), atomic_load(&queueStats.maxDepth),
+               atomic_load(&queueStats.enqueued), atomic_load(&queueStats.rejected), served,
+               served ? totalWaitUs / (double)served / 1000.0 : 0.0,
+               atomic_load(&queueStats.maxWaitUs) / 1000.0);
+        if (fileCache.capacity > 0) {
+            pthread_mutex_lock(&fileCache.mutex);
+            size_t used = fileCache.used;
+            pthread_mutex_unlock(&fileCache.mutex);
+            printf("cache: %zu/%zu bytes, hits %lu, misses %lu, evictions %lu, invalidations %lu\n",
+                   used, fileCache.capacity, atomic_load(&fileCache.hits), atomic_load(&fileCache.misses),
+                   atomic_load(&fileCache.evictions), atomic_load(&fileCache.invalidations));
+        }
+        printf("alloc: heap %lu, reused %lu\n", atomic_load(&allocStats.heapAllocs), atomic_load(&allocStats.reused));
+        printf("sessions: duplicate ACKs ignored %lu, duplicate DATA re-acked %lu, unknown TIDs rejected %lu\n",
+               atomic_load(&sessionStats.duplicateAcks), atomic_load(&sessionStats.duplicateData),
+               atomic_load(&sessionStats.strangers));
+        if (multicast.enabled) {
+            printf("multicast: sessions %lu, clients %lu, blocks sent %lu\n", atomic_load(&multicast.sessionsStarted),
+                   atomic_load(&multicast.clientsJoined), atomic_load(&multicast.blocksSent));
+        }
+        if (impairment.enabled) {
+            printf("impairment: dropped %lu, duplicated %lu, reordered %lu, delayed %lu\n",
+                   atomic_load(&impairment.dropped), atomic_load(&impairment.duplicated),
+                   atomic_load(&impairment.reordered), atomic_load(&impairment.delayedCount));
+        }
+        fflush(stdout);
+    }
+    return NULL;
 }
 
 // Fonction pour gérer les requêtes de lecture (RRQ)
-void* handleRRQ(void* arg) {
-    ClientRequest* request = (ClientRequest*)arg;
-    FILE* file;
+void handleRRQ(ClientRequest* request) {
+    int fd = -1;
     char dataBuf[BUFFER_SIZE];
-    int bytesRead, blockNum = 1;
-    const int MAX_RETRIES = 5;  // Nombre maximal de tentatives de retransmission
-
-    // Configurer le timeout pour recvfrom
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_SEC;  // Timeout en secondes
-    tv.tv_usec = 0;          // Timeout en microsecondes
-    if (setsockopt(request->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Error setting socket timeout");
-        free(request);
-        return NULL;
-    }
+    char ackBuf[4];
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    int bytesRead;
+    unsigned long blockNum = 1; // Compté sans roll-over, seul le paquet porte le numéro sur 16 bits
+    const int MAX_RETRIES = 5;  // Abandon après MAX_RETRIES délais maximaux sans ACK
+    RttEstimator rtt;
+    rttInit(&rtt);
 
     // Obtention du verrou pour le fichier demandé
     FileLock* fileLock = getFileLock(request->filename);
     if (!fileLock) {
         sendError(request->sockfd, &request->clientAddr, request->clientAddrLen, "Server error: file lock unavailable.");
-        free(request);
-        return NULL;
+        return;
     }
 
-    lockFile(fileLock);  // Verrouillage du fichier
+    lockFile(fileLock, 0);  // Verrouillage partagé : les lectures d'un même fichier sont parallèles
 
-    // Ouverture du fichier en mode lecture binaire
-    file = fopen(request->filename, "rb");
-    if (!file) {
-        sendError(request->sockfd, &request->clientAddr, request->clientAddrLen, "File not found.");
-        unlockFile(fileLock);  // Déverrouillage du fichier
-        free(request);
-        return NULL;
+    // Fichier déjà en cache : ni ouverture ni lecture disque
+    CacheEntry* cached = NULL;
+    struct stat st;
+    if (stat(request->filename, &st) == 0 && S_ISREG(st.st_mode)) {
+        cached = cacheLookup(request->filename, &st);
     }
 
-    // Boucle de lecture et d'envoi du fichier par blocs
-    while ((bytesRead = fread(dataBuf + 4, 1, 512, file)) > 0) {
-        int attempts = 0;
-        while (attempts < MAX_RETRIES) {
-            // Préparation du paquet de données
-            dataBuf[0] = 0; dataBuf[1] = OP_DATA;
-            dataBuf[2] = (blockNum >> 8) & 0xFF; dataBuf[3] = blockNum & 0xFF;
-            ssize_t sentBytes = sendto(request->sockfd, dataBuf, bytesRead + 4, 0,
-                                       (struct sockaddr*)&request->clientAddr, request->clientAddrLen);
+    if (!cached) {
+        // Ouverture du fichier en lecture
+        fd = open(request->filename, O_RDONLY);
+        if (fd < 0) {
+            sendError(request->sockfd, &request->clientAddr, request->clientAddrLen, "File not found.");
+            unlockFile(fileLock);  // Déverrouillage du fichier
+            return;
+        }
+        cached = cacheLoad(request->filename, fd);
+    }
+
+    // Le contenu en cache est une copie privée : le verrou peut être rendu tout de suite,
+    // un WRQ sur le même fichier n'attend pas la fin des envois en cours
+    const char* map = NULL;
+    size_t fileSize = 0, offset = 0;
+    if (cached) {
+        map = cached->data;
+        fileSize = cached->size;
+        unlockFile(fileLock);
+        fileLock = NULL;
+    } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // Projection du fichier en mémoire : les blocs partent directement des pages du fichier,
+        // sans passer par un tampon intermédiaire. Le verrou partagé empêche un WRQ de le tronquer
+        // pendant l'envoi. Fichier vide ou spécial, ou échec de mmap : on revient à read.
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            map = addr;
+            fileSize = st.st_size;
+        }
+    }
+
+    // Boucle de lecture et d'envoi du fichier par blocs. Le dernier bloc est toujours
+    // plus court que 512 octets, éventuellement vide si la taille en est un multiple.
+    while (1) {
+        const char* data;
+        if (map) {
+            data = map + offset;
+            bytesRead = fileSize - offset < 512 ? (int)(fileSize - offset) : 512;
+            offset += bytesRead;
+        } else {
+            data = dataBuf + 4;
+            bytesRead = 0;
+            ssize_t n;
+            while (bytesRead < 512 && (n = read(fd, dataBuf + 4 + bytesRead, 512 - bytesRead)) > 0) {
+                bytesRead += n;
+            }
+        }
+
+        // Les réémissions s'espacent avec le délai adaptatif
+        long long blockStart = nowUs() / 1000;
+        int acked = 0, aborted = 0;
+        rttStart(&rtt, blockNum);
+        while (!acked && !aborted && nowUs() / 1000 - blockStart < (long long)MAX_RTO_MS * MAX_RETRIES) {
+            ssize_t sentBytes = sendDataBlock(request->sockfd, &request->clientAddr, request->clientAddrLen,
+                                              wireBlockNum(blockNum), data, bytesRead);
             if (sentBytes < 0) {
-                perror("sendto failed");
-                attempts++;
-                continue;
+                perror("sendmsg failed");
             }
 
-            // Attente de l'ACK correspondant avec gestion du timeout
-            ssize_t rcvLen = recvfrom(request->sockfd, dataBuf, 4, 0, NULL, NULL);
-            if (rcvLen < 0) {
-                // Timeout ou erreur, on réessaie d'envoyer le paquet
-                perror("recvfrom timed out or failed");
-                attempts++;
-            } else if (dataBuf[1] == OP_ACK && dataBuf[2] == ((blockNum >> 8) & 0xFF) && 
-                       dataBuf[3] == (blockNum & 0xFF)) {
-                blockNum++; // ACK reçu, on passe au bloc suivant
-                break;
-            } else {
-                // Réponse inattendue, on réessaie d'envoyer le paquet
-                attempts++;
+            // Attente de l'ACK correspondant jusqu'à l'expiration du délai. Un ACK en double
+            // n'écourte pas l'attente : y répondre par le bloc ferait doubler chaque DATA
+            // jusqu'à la fin du transfert (syndrome de l'apprenti sorcier).
+            long long deadline = nowUs() / 1000 + rtt.rtoMs;
+            while (!acked && !aborted) {
+                long long remaining = deadline - nowUs() / 1000;
+                if (remaining <= 0) {
+                    rttBackoff(&rtt);
+                    break;
+                }
+                setReceiveTimeout(request->sockfd, remaining);
+                fromAddrLen = sizeof(fromAddr);
+                ssize_t rcvLen = impairedRecv(request->sockfd, ackBuf, sizeof(ackBuf), (struct sockaddr *)&fromAddr, &fromAddrLen);
+                if (rcvLen < 0) {
+                    // Timeout ou erreur, on réessaie d'envoyer le paquet
+                    perror("recvfrom timed out or failed");
+                    rttBackoff(&rtt);
+                    break;
+                } else if (!sameTid(&fromAddr, &request->clientAddr)) {
+                    rejectUnknownTid(request->sockfd, &fromAddr, fromAddrLen);
+                } else if (rcvLen >= 4 && ackBuf[1] == OP_ACK &&
+                           (unsigned int)(((unsigned char)ackBuf[2] << 8) | (unsigned char)ackBuf[3]) == wireBlockNum(blockNum)) {
+                    rttAcked(&rtt, blockNum);
+                    blockNum++; // ACK reçu, on passe au bloc suivant
+                    acked = 1;
+                } else if (rcvLen >= 4 && ackBuf[1] == OP_ERROR) {
+                    aborted = 1; // Le client abandonne le transfert
+                } else {
+                    atomic_fetch_add(&sessionStats.duplicateAcks, 1);
+                }
             }
         }
 
-        if (attempts >= MAX_RETRIES) {
-            fprintf(stderr, "Max retries exceeded for block %d\n", blockNum);
+        if (!acked) {
+            if (!aborted) {
+                fprintf(stderr, "Max retries exceeded for block %lu\n", blockNum);
+            }
             break;
         }
 
@@ -219,95 +749,518 @@ void* handleRRQ(void* arg) {
         }
     }
 
-    fclose(file);
-    unlockFile(fileLock);  // Déverrouillage du fichier
-    close(request->sockfd);
-    free(request);
+    if (cached) {
+        cacheRelease(cached);
+    } else if (map) {
+        munmap((void*)map, fileSize);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (fileLock) {
+        unlockFile(fileLock);  // Déverrouillage du fichier
+    }
+}
+
+// Envoi d'un bloc DATA : l'en-tête de 4 octets et les données sont transmis en deux iovec,
+// les données pouvant pointer directement dans la projection du fichier
+ssize_t sendDataBlock(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrLen, int blockNum, const char* data, size_t len) {
+    char header[4];
+    header[0] = 0; header[1] = OP_DATA;
+    header[2] = (blockNum >> 8) & 0xFF; header[3] = blockNum & 0xFF;
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = clientAddr;
+    msg.msg_namelen = clientAddrLen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+    return impairedSend(sockfd, &msg);
+}
+
+// Diffusion multicast (RFC 2090). La première requête d'un fichier avec l'option multicast
+// ouvre une session de groupe servie par son worker ; les requêtes suivantes pour le même
+// fichier s'y ajoutent et libèrent aussitôt leur worker. Chaque bloc part une seule fois vers
+// le groupe, au rythme des ACK du client maître (mc=1 dans l'OACK), les autres écoutent.
+// Quand le maître a tout reçu ou se tait, le client suivant est désigné maître et acquitte
+// le dernier bloc de sa partie contiguë : la diffusion reprend là, ce qui complète les
+// clients arrivés en cours de route.
+void handleMulticastRRQ(ClientRequest* request) {
+    int slot = -1;
+
+    pthread_mutex_lock(&multicast.mutex);
+    for (int i = 0; i < MAX_MULTICAST_SESSIONS; i++) {
+        MulticastSession* session = &multicast.sessions[i];
+        if (session->active && strcmp(session->filename, request->filename) == 0) {
+            // Session en cours : le client la rejoint en auditeur. Un RRQ réémis par un
+            // client déjà inscrit ne fait que renvoyer son OACK.
+            MulticastClient* client = multicastFind(session, &request->clientAddr);
+            if (client) {
+                sendMulticastOACK(session, client, client == session->clients);
+            } else if (multicastJoin(session, request)) {
+                sendMulticastOACK(session, multicastLast(session), 0);
+            }
+            pthread_mutex_unlock(&multicast.mutex);
+            return;
+        }
+        if (!session->active && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        // Tous les groupes sont pris : ce client est servi seul
+        pthread_mutex_unlock(&multicast.mutex);
+        handleRRQ(request);
+        return;
+    }
+
+    // Le fichier doit pouvoir être relu à n'importe quel bloc : cache ou projection
+    int fd = open(request->filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size / 512 + 1 > 65535) {
+        // Absent, spécial, ou trop grand pour que les ACK des retardataires soient sans
+        // ambiguïté (pas de roll-over en multicast) : le chemin unicast s'en occupe
+        pthread_mutex_unlock(&multicast.mutex);
+        if (fd >= 0) {
+            close(fd);
+        }
+        handleRRQ(request);
+        return;
+    }
+
+    MulticastSession* session = &multicast.sessions[slot];
+    memset(session, 0, sizeof(*session));
+    session->active = 1;
+    session->sockfd = request->sockfd;
+    strcpy(session->filename, request->filename);
+    session->group = multicast.group;
+    session->group.sin_port = htons(ntohs(multicast.group.sin_port) + slot);
+    if (!multicastJoin(session, request)) {
+        session->active = 0;
+        pthread_mutex_unlock(&multicast.mutex);
+        close(fd);
+        sendError(request->sockfd, &request->clientAddr, request->clientAddrLen, "Server error: out of memory.");
+        return;
+    }
+    pthread_mutex_unlock(&multicast.mutex);
+    atomic_fetch_add(&multicast.sessionsStarted, 1);
+
+    // Les DATA sortent par l'interface d'écoute ; IP_MULTICAST_LOOP les livre aussi aux
+    // clients de la machine
+    unsigned char loop = 1, ttl = MULTICAST_TTL;
+    setsockopt(session->sockfd, IPPROTO_IP, IP_MULTICAST_IF, &multicast.interface, sizeof(multicast.interface));
+    setsockopt(session->sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(session->sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    // Comme pour un RRQ unicast, le verrou partagé protège la projection d'un WRQ ; une
+    // copie en cache n'en a pas besoin
+    FileLock* fileLock = getFileLock(request->filename);
+    if (fileLock) {
+        lockFile(fileLock, 0);
+    }
+    // Un WRQ a pu tronquer ou réécrire le fichier entre l'ouverture et la prise du verrou :
+    // la taille est relue sous le verrou, sinon la projection dépasserait la fin du fichier
+    // et la diffusion s'arrêterait sur un SIGBUS
+    if (fstat(fd, &st) != 0 || st.st_size / 512 + 1 > 65535) {
+        close(fd);
+        multicastEnd(session, "Server error: file changed.");
+        if (fileLock) {
+            unlockFile(fileLock);
+        }
+        return;
+    }
+    CacheEntry* cached = cacheLookup(request->filename, &st);
+    if (!cached) {
+        cached = cacheLoad(request->filename, fd);
+    }
+    const char* map = NULL;
+    size_t fileSize = st.st_size;
+    if (cached) {
+        map = cached->data;
+        fileSize = cached->size;
+        if (fileLock) {
+            unlockFile(fileLock);
+            fileLock = NULL;
+        }
+    } else if (st.st_size > 0) {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            map = addr;
+        }
+    }
+    close(fd);
+    if (map || fileSize == 0) {
+        multicastSend(session, map, fileSize);
+    } else {
+        multicastEnd(session, "Server error: cannot map file.");
+    }
+
+    if (cached) {
+        cacheRelease(cached);
+    } else if (map) {
+        munmap((void*)map, fileSize);
+    }
+    if (fileLock) {
+        unlockFile(fileLock);
+    }
+}
+
+// Boucle de diffusion d'une session de groupe, pilotée par les ACK du maître
+void multicastSend(MulticastSession* session, const char* map, size_t fileSize) {
+    char ackBuf[BUFFER_SIZE];
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    unsigned long lastBlock = fileSize / 512 + 1; // Bloc final, plus court que 512 octets
+    unsigned long current = 0;                    // Bloc diffusé dont on attend l'ACK, 0 : OACK
+    int silentTimeouts = 0;
+    RttEstimator rtt;
+    rttInit(&rtt);
+
+    sendMulticastOACK(session, session->clients, 1);
+    rttStart(&rtt, 0);
+    long long deadline = nowUs() / 1000 + rtt.rtoMs;
+
+    while (1) {
+        long long remaining = deadline - nowUs() / 1000;
+        ssize_t rcvLen = -1;
+        if (remaining > 0) {
+            setReceiveTimeout(session->sockfd, remaining);
+            fromAddrLen = sizeof(fromAddr);
+            rcvLen = impairedRecv(session->sockfd, ackBuf, sizeof(ackBuf), (struct sockaddr*)&fromAddr, &fromAddrLen);
+        }
+        if (rcvLen < 0) {
+            // Le maître se tait : réémission, puis au bout de MULTICAST_MASTER_RETRIES
+            // délais on passe la main au client suivant
+            rttBackoff(&rtt);
+            if (++silentTimeouts >= MULTICAST_MASTER_RETRIES) {
+                if (!multicastNextMaster(session, session->clients)) {
+                    return;
+                }
+                current = 0;
+                silentTimeouts = 0;
+            } else if (current == 0) {
+                sendMulticastOACK(session, session->clients, 1);
+            } else {
+                sendDataBlock(session->sockfd, &session->group, sizeof(session->group), current,
+                              map + (current - 1) * 512, multicastBlockLen(fileSize, current));
+                atomic_fetch_add(&multicast.blocksSent, 1);
+            }
+            deadline = nowUs() / 1000 + rtt.rtoMs;
+            continue;
+        }
+
+        pthread_mutex_lock(&multicast.mutex);
+        MulticastClient* client = multicastFind(session, &fromAddr);
+        pthread_mutex_unlock(&multicast.mutex);
+        if (!client) {
+            rejectUnknownTid(session->sockfd, &fromAddr, fromAddrLen);
+            continue;
+        }
+        if (rcvLen < 4 || (ackBuf[1] != OP_ACK && ackBuf[1] != OP_ERROR)) {
+            continue;
+        }
+        unsigned long acked = ((unsigned char)ackBuf[2] << 8) | (unsigned char)ackBuf[3];
+        int master = (client == session->clients);
+
+        if (ackBuf[1] == OP_ERROR || acked >= lastBlock) {
+            // Client parti ou fichier complet : le maître est remplacé, un auditeur retiré
+            if (!master) {
+                pthread_mutex_lock(&multicast.mutex);
+                multicastRemove(session, client);
+                pthread_mutex_unlock(&multicast.mutex);
+                continue;
+            }
+            if (!multicastNextMaster(session, client)) {
+                return;
+            }
+            current = 0;
+            silentTimeouts = 0;
+            rttStart(&rtt, 0);
+            deadline = nowUs() / 1000 + rtt.rtoMs;
+            continue;
+        }
+        if (!master) {
+            continue; // Seul le maître règle la diffusion
+        }
+        if (current > 0 && acked + 1 == current) {
+            // ACK en double : le bloc n'est réémis qu'à l'expiration du délai (RFC 1123)
+            atomic_fetch_add(&sessionStats.duplicateAcks, 1);
+            continue;
+        }
+
+        // ACK du bloc diffusé, ou premier ACK d'un nouveau maître : on diffuse le suivant
+        if (acked == current) {
+            rttAcked(&rtt, current);
+        } else {
+            rttCancel(&rtt);
+        }
+        current = acked + 1;
+        silentTimeouts = 0;
+        sendDataBlock(session->sockfd, &session->group, sizeof(session->group), current,
+                      map + (current - 1) * 512, multicastBlockLen(fileSize, current));
+        atomic_fetch_add(&multicast.blocksSent, 1);
+        rttStart(&rtt, current);
+        deadline = nowUs() / 1000 + rtt.rtoMs;
+    }
+}
+
+// Taille des données du bloc block (numéroté à partir de 1)
+size_t multicastBlockLen(size_t fileSize, unsigned long block) {
+    size_t offset = (block - 1) * 512;
+    return fileSize - offset < 512 ? fileSize - offset : 512;
+}
+
+// Retire le maître et désigne le client suivant. Retourne 0 si la session est terminée,
+// plus aucun client n'attendant le fichier.
+int multicastNextMaster(MulticastSession* session, MulticastClient* master) {
+    pthread_mutex_lock(&multicast.mutex);
+    multicastRemove(session, master);
+    if (!session->clients) {
+        session->active = 0; // Sous le verrou : un nouveau client ouvrira une autre session
+        pthread_mutex_unlock(&multicast.mutex);
+        return 0;
+    }
+    sendMulticastOACK(session, session->clients, 1);
+    pthread_mutex_unlock(&multicast.mutex);
+    return 1;
+}
+
+// Fin anormale d'une session : chaque client reçoit l'erreur
+void multicastEnd(MulticastSession* session, const char* errorMessage) {
+    pthread_mutex_lock(&multicast.mutex);
+    while (session->clients) {
+        sendError(session->sockfd, &session->clients->addr, session->clients->addrLen, errorMessage);
+        multicastRemove(session, session->clients);
+    }
+    session->active = 0;
+    pthread_mutex_unlock(&multicast.mutex);
+}
+
+// Ajoute le client en fin de liste (le premier est le maître). Appelée sous le verrou.
+int multicastJoin(MulticastSession* session, ClientRequest* request) {
+    MulticastClient* client = malloc(sizeof(MulticastClient));
+    if (!client) {
+        return 0;
+    }
+    atomic_fetch_add(&allocStats.heapAllocs, 1);
+    client->addr = request->clientAddr;
+    client->addrLen = request->clientAddrLen;
+    client->next = NULL;
+    MulticastClient** tail = &session->clients;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = client;
+    atomic_fetch_add(&multicast.clientsJoined, 1);
+    return 1;
+}
+
+MulticastClient* multicastLast(MulticastSession* session) {
+    MulticastClient* client = session->clients;
+    while (client && client->next) {
+        client = client->next;
+    }
+    return client;
+}
+
+MulticastClient* multicastFind(MulticastSession* session, struct sockaddr_in* addr) {
+    for (MulticastClient* client = session->clients; client; client = client->next) {
+        if (sameTid(&client->addr, addr)) {
+            return client;
+        }
+    }
     return NULL;
 }
 
+void multicastRemove(MulticastSession* session, MulticastClient* client) {
+    for (MulticastClient** link = &session->clients; *link; link = &(*link)->next) {
+        if (*link == client) {
+            *link = client->next;
+            free(client);
+            return;
+        }
+    }
+}
 
-void* handleWRQ(void* arg) {
-    ClientRequest* request = (ClientRequest*)arg;
+// OACK multicast : "adresse,port,mc" avec mc à 1 pour le maître (RFC 2090)
+void sendMulticastOACK(MulticastSession* session, MulticastClient* client, int master) {
     char buffer[BUFFER_SIZE];
-    FILE* file = NULL;
-    int blockNum = 0, attempts = 0;
-    const int MAX_RETRIES = 5; // Nombre maximal de tentatives de réception
-
-    // Création d'une nouvelle socket pour isoler la session de communication
-    int sessionSockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sessionSockfd < 0) {
-        perror("Socket creation for WRQ session failed");
-        free(request);
-        return NULL;
+    char group[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &session->group.sin_addr, group, sizeof(group));
+    int len = sprintf(buffer, "%c%c%s%c%s,%d,%d%c", 0, OP_OACK, OPTION_MULTICAST, 0,
+                      group, ntohs(session->group.sin_port), master, 0);
+    impairedSendto(session->sockfd, buffer, len, &client->addr, client->addrLen);
+}
+
+// Lit "adresse:port" (option -m), le port étant celui du premier groupe. Retourne 0 si invalide.
+int multicastInit(const char* spec) {
+    char address[INET_ADDRSTRLEN];
+    int port;
+    if (sscanf(spec, "%15[^:]:%d", address, &port) != 2 || port <= 0 || port + MAX_MULTICAST_SESSIONS > 65535 ||
+        inet_pton(AF_INET, address, &multicast.group.sin_addr) != 1 || !IN_MULTICAST(ntohl(multicast.group.sin_addr.s_addr))) {
+        return 0;
     }
+    multicast.group.sin_family = AF_INET;
+    multicast.group.sin_port = htons(port);
+    multicast.interface.s_addr = htonl(INADDR_ANY);
+    pthread_mutex_init(&multicast.mutex, NULL);
+    multicast.enabled = 1;
+    return 1;
+}
 
-    // Configurer le timeout pour recvfrom
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_SEC; // Timeout en secondes
-    tv.tv_usec = 0; // Timeout en microsecondes
-    setsockopt(sessionSockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+// Les blocs sont regroupés dans le tampon du worker et écrits par WRITE_BUFFER_SIZE
+void handleWRQ(ClientRequest* request, char* uploadBuffer) {
+    char buffer[BUFFER_SIZE];
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    size_t buffered = 0;
+    unsigned long blockNum = 0; // Dernier bloc reçu, compté sans roll-over
+    const int MAX_RETRIES = 5; // Abandon après MAX_RETRIES délais maximaux sans DATA
+    RttEstimator rtt;
+    rttInit(&rtt);
+
+    // La socket de session, créée par le worker, isole la session de communication
+    int sessionSockfd = request->sockfd;
 
     // Obtention du verrou pour le fichier demandé
     FileLock* fileLock = getFileLock(request->filename);
     if (!fileLock) {
         sendError(sessionSockfd, &request->clientAddr, request->clientAddrLen, "Server error: file lock unavailable.");
-        close(sessionSockfd);
-        free(request);
-        return NULL;
+        return;
     }
 
-    lockFile(fileLock); // Verrouillage du fichier
+    lockFile(fileLock, 1); // Verrouillage exclusif pour l'écriture
 
     // Ouverture/Création du fichier pour écriture
-    file = fopen(request->filename, "wb");
-    if (!file) {
+    int fd = open(request->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         sendError(sessionSockfd, &request->clientAddr, request->clientAddrLen, "Cannot open file for writing.");
         unlockFile(fileLock);
-        close(sessionSockfd);
-        free(request);
-        return NULL;
+        return;
     }
-
     // Envoi de l'ACK initial pour la requête WRQ
     sendACK(sessionSockfd, &request->clientAddr, request->clientAddrLen, blockNum);
+    rttStart(&rtt, 1);
+    long long lastProgress = nowUs() / 1000;
 
     // Boucle de réception des blocs de données
     while (1) {
-        ssize_t recvLen = recvfrom(sessionSockfd, buffer, BUFFER_SIZE, 0, NULL, NULL);
-        if (recvLen < 0 && ++attempts < MAX_RETRIES) {
+        setReceiveTimeout(sessionSockfd, rtt.rtoMs);
+        fromAddrLen = sizeof(fromAddr);
+        ssize_t recvLen = impairedRecv(sessionSockfd, buffer, BUFFER_SIZE, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (recvLen < 0) {
+            if (nowUs() / 1000 - lastProgress >= (long long)MAX_RTO_MS * MAX_RETRIES) {
+                fprintf(stderr, "Max retries exceeded for block %lu\n", blockNum + 1);
+                break;
+            }
             perror("recvfrom timeout or error, retrying");
-            sendACK(sessionSockfd, &request->clientAddr, request->clientAddrLen, blockNum); // Retransmission de l'ACK
+            rttBackoff(&rtt);
+            sendACK(sessionSockfd, &request->clientAddr, request->clientAddrLen, wireBlockNum(blockNum)); // Retransmission de l'ACK
+            continue;
+        }
+        if (!sameTid(&fromAddr, &request->clientAddr)) {
+            rejectUnknownTid(sessionSockfd, &fromAddr, fromAddrLen);
+            continue;
+        }
+        if (recvLen < 4) {
             continue;
-        } else if (attempts >= MAX_RETRIES) {
-            fprintf(stderr, "Max retries exceeded for block %d\n", blockNum + 1);
-            break;
         }
 
         if (buffer[1] == OP_DATA) {
-            int receivedBlockNum = (buffer[2] << 8) | buffer[3];
-            if (receivedBlockNum == blockNum + 1) {
-                fwrite(buffer + 4, 1, recvLen - 4, file); // Écrire les données reçues
+            unsigned int receivedBlockNum = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
+            if (receivedBlockNum == wireBlockNum(blockNum + 1)) {
+                // Les données reçues rejoignent le tampon, vidé quand il est plein
+                if (buffered + (recvLen - 4) > WRITE_BUFFER_SIZE) {
+                    if (!writeAll(fd, uploadBuffer, buffered)) {
+                        perror("Failed to write uploaded file");
+                        sendError(sessionSockfd, &request->clientAddr, request->clientAddrLen, "Failed to write file.");
+                        break;
+                    }
+                    buffered = 0;
+                }
+                memcpy(uploadBuffer + buffered, buffer + 4, recvLen - 4);
+                buffered += recvLen - 4;
+                if (recvLen < 516) {
+                    // Le dernier ACK promet que le fichier est sur disque
+                    int flushed = writeAll(fd, uploadBuffer, buffered) && fsync(fd) == 0;
+                    buffered = 0;
+                    if (!flushed) {
+                        perror("Failed to flush uploaded file");
+                        sendError(sessionSockfd, &request->clientAddr, request->clientAddrLen, "Failed to write file.");
+                        break;
+                    }
+                }
                 blockNum++;
-                sendACK(sessionSockfd, &request->clientAddr, request->clientAddrLen, blockNum);
-                attempts = 0; // Réinitialiser les tentatives pour le prochain bloc
+                rttAcked(&rtt, blockNum);
+                lastProgress = nowUs() / 1000;
+                sendACK(sessionSockfd, &request->clientAddr, request->clientAddrLen, receivedBlockNum);
+                rttStart(&rtt, blockNum + 1);
+
+                if (recvLen < 516) { // Dernier bloc reçu
+                    printf("File transfer completed.\n");
+                    break;
+                }
+            } else if (blockNum > 0 && receivedBlockNum == wireBlockNum(blockNum)) {
+                // Doublon : notre ACK s'est perdu, on le renvoie pour ce doublon seulement
+                sendACK(sessionSockfd, &request->clientAddr, request->clientAddrLen, receivedBlockNum);
+                rttCancel(&rtt);
+                atomic_fetch_add(&sessionStats.duplicateData, 1);
             }
         } else {
             fprintf(stderr, "Unexpected packet type\n");
             break;
         }
+    }
 
-        if (recvLen < 516) { // Dernier bloc reçu
-            printf("File transfer completed.\n");
-            break;
+    writeAll(fd, uploadBuffer, buffered); // Transfert interrompu : on garde ce qui a été reçu
+    close(fd);
+    cacheInvalidate(request->filename); // Le contenu a changé, même si le transfert a échoué
+    unlockFile(fileLock);
+}
+
+// Écrit len octets en reprenant après les écritures partielles. Retourne 0 en cas d'erreur.
+int writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
         }
+        data += n;
+        len -= n;
     }
+    return 1;
+}
 
-    fclose(file);
-    unlockFile(fileLock);
-    close(sessionSockfd);
-    free(request);
-    return NULL;
+// Numéro de bloc sur 16 bits d'un bloc absolu : après 65535 on repart à rolloverBase
+unsigned int wireBlockNum(unsigned long block) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rolloverBase ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
+}
+
+// Vrai si deux adresses désignent la même extrémité (adresse IP et port), le TID de la RFC 1350
+int sameTid(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Un paquet étranger à la session reçoit une erreur 5 sans interrompre le transfert
+void rejectUnknownTid(int sockfd, struct sockaddr_in* fromAddr, socklen_t fromAddrLen) {
+    char buffer[32];
+    int len = sprintf(buffer, "%c%c%c%cUnknown transfer ID", 0, OP_ERROR, 0, 5);
+    impairedSendto(sockfd, buffer, len + 1, fromAddr, fromAddrLen);
+    atomic_fetch_add(&sessionStats.strangers, 1);
 }
 
 // Fonction helper pour envoyer un ACK
@@ -317,36 +1270,95 @@ void sendACK(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrLen
     ackPacket[1] = OP_ACK;
     ackPacket[2] = (blockNum >> 8) & 0xFF;
     ackPacket[3] = blockNum & 0xFF;
-    sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (const struct sockaddr*)clientAddr, clientAddrLen);
+    impairedSendto(sockfd, ackPacket, sizeof(ackPacket), clientAddr, clientAddrLen);
+}
+
+
+void initFileLocks(void) {
+    for (int i = 0; i < LOCK_SHARDS; i++) {
+        pthread_mutex_init(&lockShards[i].mutex, NULL);
+        lockShards[i].head = NULL;
+        lockShards[i].freeLocks = NULL;
+    }
 }
 
+// Hachage FNV-1a du nom de fichier
+unsigned int hashFilename(const char* filename) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)filename; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
+// Retourne le verrou du fichier en prenant une référence, en le créant au besoin.
+// Seul le mutex de la partition du fichier est pris, et seulement le temps de la recherche.
 FileLock* getFileLock(const char* filename) {
-    pthread_mutex_lock(&fileLocksMutex);
-    for (int i = 0; i < fileLockCount; ++i) {
-        if (strcmp(fileLocks[i].filename, filename) == 0) {
-            pthread_mutex_unlock(&fileLocksMutex);
-            return &fileLocks[i];
+    unsigned int shard = hashFilename(filename) & (LOCK_SHARDS - 1);
+    LockShard* lockShard = &lockShards[shard];
+
+    pthread_mutex_lock(&lockShard->mutex);
+    for (FileLock* lock = lockShard->head; lock; lock = lock->next) {
+        if (strcmp(lock->filename, filename) == 0) {
+            lock->refCount++;
+            pthread_mutex_unlock(&lockShard->mutex);
+            return lock;
         }
     }
-    if (fileLockCount < MAX_FILES) {
-        strncpy(fileLocks[fileLockCount].filename, filename, sizeof(fileLocks[fileLockCount].filename) - 1);
-        pthread_mutex_init(&fileLocks[fileLockCount].mutex, NULL);
-        FileLock* newLock = &fileLocks[fileLockCount++];
-        pthread_mutex_unlock(&fileLocksMutex);
-        return newLock;
+
+    // Une entrée libérée est reprise avant de toucher au tas
+    FileLock* newLock = lockShard->freeLocks;
+    if (newLock) {
+        lockShard->freeLocks = newLock->next;
+        atomic_fetch_add(&allocStats.reused, 1);
+    } else {
+        newLock = calloc(1, sizeof(FileLock));
+        if (!newLock || pthread_rwlock_init(&newLock->rwlock, NULL) != 0) {
+            pthread_mutex_unlock(&lockShard->mutex);
+            free(newLock);
+            return NULL; // Retourne NULL si la mémoire manque
+        }
+        atomic_fetch_add(&allocStats.heapAllocs, 1);
     }
-    pthread_mutex_unlock(&fileLocksMutex);
-    return NULL; // Retourne NULL si le nombre maximal de fichiers est atteint
+    memset(newLock->filename, 0, sizeof(newLock->filename));
+    strncpy(newLock->filename, filename, sizeof(newLock->filename) - 1);
+    newLock->refCount = 1;
+    newLock->shard = shard;
+    newLock->next = lockShard->head;
+    lockShard->head = newLock;
+    pthread_mutex_unlock(&lockShard->mutex);
+    return newLock;
 }
 
 
-void lockFile(FileLock* lock) {
-    pthread_mutex_lock(&lock->mutex);
+void lockFile(FileLock* lock, int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&lock->rwlock);
+    } else {
+        pthread_rwlock_rdlock(&lock->rwlock);
+    }
 }
 
+// Déverrouille le fichier et rend la référence prise par getFileLock ;
+// la dernière référence retire l'entrée de la table et la garde pour un prochain fichier
 void unlockFile(FileLock* lock) {
-    pthread_mutex_unlock(&lock->mutex);
+    LockShard* lockShard = &lockShards[lock->shard];
+    pthread_rwlock_unlock(&lock->rwlock);
+
+    pthread_mutex_lock(&lockShard->mutex);
+    if (--lock->refCount > 0) {
+        pthread_mutex_unlock(&lockShard->mutex);
+        return;
+    }
+    FileLock** link = &lockShard->head;
+    while (*link != lock) {
+        link = &(*link)->next;
+    }
+    *link = lock->next;
+    lock->next = lockShard->freeLocks;
+    lockShard->freeLocks = lock;
+    pthread_mutex_unlock(&lockShard->mutex);
 }
 
 void sendError(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrLen, const char* errorMessage) {
@@ -359,5 +1371,499 @@ void sendError(int sockfd, struct sockaddr_in* clientAddr, socklen_t clientAddrL
     strncpy(buffer + 4, errorMessage, BUFFER_SIZE - 5); // Copie du message d'erreur
     buffer[BUFFER_SIZE - 1] = '\0'; // Assure que le message est null-terminé
 
-    sendto(sockfd, buffer, strlen(buffer + 4) + 5, 0, (struct sockaddr*)clientAddr, clientAddrLen);
-}
\ No newline at end of file
+    impairedSendto(sockfd, buffer, strlen(buffer + 4) + 5, clientAddr, clientAddrLen);
+}
+
+// Initialise une file de capacité puissance de 2 (au moins depth cases)
+int queueInit(RequestQueue* queue, size_t depth) {
+    size_t capacity = 1;
+    while (capacity < depth) {
+        capacity <<= 1;
+    }
+
+    queue->cells = calloc(capacity, sizeof(QueueCell));
+    if (!queue->cells) {
+        return 0;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = capacity - 1;
+    atomic_init(&queue->enqueuePos, 0);
+    atomic_init(&queue->dequeuePos, 0);
+    return sem_init(&queue->items, 0, 0) == 0;
+}
+
+// Ajoute une requête. Retourne 0 si la file est pleine.
+int queuePush(RequestQueue* queue, const ClientRequest* request) {
+    QueueCell* cell;
+    size_t pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            // Case libre : on tente de la réserver
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; // La case n'a pas encore été consommée : file pleine
+        } else {
+            pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+        }
+    }
+
+    cell->request = *request;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+// Retire la plus ancienne requête. Retourne 0 si la file est vide.
+int queuePop(RequestQueue* queue, ClientRequest* request) {
+    QueueCell* cell;
+    size_t pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; // File vide
+        } else {
+            pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+        }
+    }
+
+    *request = cell->request;
+    // La case redevient libre pour le tour suivant de l'anneau
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return 1;
+}
+
+size_t queueDepth(RequestQueue* queue) {
+    size_t enqueued = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+    size_t dequeued = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+void atomicMax(atomic_ulong* target, unsigned long value) {
+    unsigned long current = atomic_load_explicit(target, memory_order_relaxed);
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(target, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+long long nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rttInit(RttEstimator* rtt) {
+    memset(rtt, 0, sizeof(*rtt));
+    rtt->rtoMs = INITIAL_RTO_MS;
+}
+
+// Début de mesure à la première émission du paquet qui attend la réponse block
+void rttStart(RttEstimator* rtt, int block) {
+    if (!rtt->timing) {
+        rtt->timing = 1;
+        rtt->timedBlock = block;
+        rtt->sentUs = nowUs();
+    }
+}
+
+// Réponse attendue reçue : nouvel échantillon si elle correspond au paquet mesuré
+void rttAcked(RttEstimator* rtt, int block) {
+    if (!rtt->timing || block < rtt->timedBlock) {
+        return;
+    }
+    rtt->timing = 0;
+
+    long long sample = nowUs() - rtt->sentUs;
+    if (!rtt->hasSample) {
+        rtt->srttUs = sample;
+        rtt->rttvarUs = sample / 2;
+        rtt->hasSample = 1;
+    } else {
+        long long delta = rtt->srttUs > sample ? rtt->srttUs - sample : sample - rtt->srttUs;
+        rtt->rttvarUs = (3 * rtt->rttvarUs + delta) / 4;
+        rtt->srttUs = (7 * rtt->srttUs + sample) / 8;
+    }
+
+    long long rto = (rtt->srttUs + 4 * rtt->rttvarUs) / 1000;
+    rtt->rtoMs = rto < MIN_RTO_MS ? MIN_RTO_MS : (rto > MAX_RTO_MS ? MAX_RTO_MS : rto);
+}
+
+// Le paquet mesuré va être réémis : sa réponse serait ambiguë (Karn)
+void rttCancel(RttEstimator* rtt) {
+    rtt->timing = 0;
+}
+
+// Timeout : le délai double jusqu'au plafond, jusqu'à la prochaine mesure valide
+void rttBackoff(RttEstimator* rtt) {
+    rtt->timing = 0;
+    rtt->rtoMs = rtt->rtoMs * 2 > MAX_RTO_MS ? MAX_RTO_MS : rtt->rtoMs * 2;
+}
+
+// Délai de réception de la socket de session, réglé avant chaque attente
+void setReceiveTimeout(int sockfd, long long timeoutMs) {
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("Error setting socket timeout");
+    }
+}
+
+// Lit la description des dégradations, par exemple "drop=0.05,dup=0.01,reorder=0.02,delay=5,jitter=20".
+// Retourne 0 si elle est invalide.
+int impairmentInit(const char* spec) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    impairment.seed = (unsigned int)time(NULL);
+
+    for (char* item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char* value = strchr(item, '=');
+        if (!value) {
+            return 0;
+        }
+        *value++ = '\0';
+        if (strcmp(item, "drop") == 0) {
+            impairment.drop = atof(value);
+        } else if (strcmp(item, "dup") == 0) {
+            impairment.duplicate = atof(value);
+        } else if (strcmp(item, "reorder") == 0) {
+            impairment.reorder = atof(value);
+        } else if (strcmp(item, "delay") == 0) {
+            impairment.delayMs = atoi(value);
+        } else if (strcmp(item, "jitter") == 0) {
+            impairment.jitterMs = atoi(value);
+        } else if (strcmp(item, "seed") == 0) {
+            impairment.seed = (unsigned int)strtoul(value, NULL, 10);
+        } else {
+            return 0;
+        }
+    }
+    if (impairment.drop < 0 || impairment.drop > 1 || impairment.duplicate < 0 || impairment.duplicate > 1 ||
+        impairment.reorder < 0 || impairment.reorder > 1 || impairment.delayMs < 0 || impairment.jitterMs < 0) {
+        return 0;
+    }
+
+    pthread_mutex_init(&impairment.mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Les échéances sont en temps nowUs
+    pthread_cond_init(&impairment.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    impairment.enabled = 1;
+    return 1;
+}
+
+// Générateur du thread courant, initialisé par impairmentThread
+static __thread unsigned int impairmentState;
+
+// Fixe le flux de tirages du thread courant d'après son rang à la création (workers sur les
+// flux pairs, threads de réception sur les flux impairs) et non d'après l'ordre dans lequel
+// les threads tirent pour la première fois : une graine fixe (seed=) rejoue ainsi les mêmes
+// tirages dans chaque thread. Le résultat d'ensemble ne se répète que si les requêtes sont
+// réparties de la même façon, par exemple avec un seul worker.
+void impairmentThread(unsigned int stream) {
+    impairmentState = impairment.seed + stream * 2654435761u;
+}
+
+// Tirage uniforme dans [0, 1)
+double impairmentRandom(void) {
+    return rand_r(&impairmentState) / ((double)RAND_MAX + 1);
+}
+
+// sendmsg à travers les dégradations simulées. Un paquet perdu est compté comme envoyé,
+// comme le ferait un réseau qui le jette plus loin.
+ssize_t impairedSend(int sockfd, const struct msghdr* msg) {
+    if (!impairment.enabled) {
+        return sendmsg(sockfd, msg, 0);
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        len += msg->msg_iov[i].iov_len;
+    }
+    if (impairmentRandom() < impairment.drop) {
+        atomic_fetch_add(&impairment.dropped, 1);
+        return len;
+    }
+
+    int copies = 1;
+    if (impairmentRandom() < impairment.duplicate) {
+        atomic_fetch_add(&impairment.duplicated, 1);
+        copies = 2;
+    }
+
+    ssize_t result = len;
+    for (int i = 0; i < copies; i++) {
+        long long delayUs = impairment.delayMs * 1000LL;
+        if (impairment.jitterMs > 0) {
+            delayUs += (long long)(impairmentRandom() * impairment.jitterMs * 1000);
+        }
+        if (impairmentRandom() < impairment.reorder) {
+            // Retenu au-delà du délai le plus long : les paquets suivants arrivent avant lui
+            atomic_fetch_add(&impairment.reordered, 1);
+            delayUs = (impairment.delayMs + impairment.jitterMs + REORDER_HOLD_MS) * 1000LL;
+        }
+        if (delayUs > 0) {
+            delayPacket(sockfd, msg, len, delayUs);
+        } else {
+            result = sendmsg(sockfd, msg, 0);
+        }
+    }
+    return result;
+}
+
+ssize_t impairedSendto(int sockfd, const void* data, size_t len, const struct sockaddr_in* addr, socklen_t addrLen) {
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)addr;
+    msg.msg_namelen = addrLen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return impairedSend(sockfd, &msg);
+}
+
+// recvfrom à travers les dégradations simulées : un datagramme perdu est lu puis ignoré.
+// L'attente recommence alors avec le délai complet de la socket, un peu plus long que sur un
+// vrai réseau où la perte n'interrompt pas l'attente.
+ssize_t impairedRecv(int sockfd, void* buf, size_t len, struct sockaddr* addr, socklen_t* addrLen) {
+    socklen_t initialLen = addrLen ? *addrLen : 0;
+    while (1) {
+        ssize_t n = recvfrom(sockfd, buf, len, 0, addr, addrLen);
+        if (n < 0 || !impairment.enabled || impairmentRandom() >= impairment.drop) {
+            return n;
+        }
+        atomic_fetch_add(&impairment.dropped, 1);
+        if (addrLen) {
+            *addrLen = initialLen;
+        }
+    }
+}
+
+// Recopie un paquet dans la liste des paquets retardés, triée par échéance
+void delayPacket(int sockfd, const struct msghdr* msg, size_t len, long long delayUs) {
+    DelayedPacket* packet = malloc(sizeof(DelayedPacket) + len);
+    if (!packet) {
+        return; // Perdu, comme sur un routeur saturé
+    }
+    packet->sockfd = dup(sockfd);
+    if (packet->sockfd < 0) {
+        free(packet);
+        return;
+    }
+    packet->dueUs = nowUs() + delayUs;
+    memcpy(&packet->addr, msg->msg_name, msg->msg_namelen);
+    packet->addrLen = msg->msg_namelen;
+    packet->len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        memcpy(packet->data + packet->len, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        packet->len += msg->msg_iov[i].iov_len;
+    }
+    atomic_fetch_add(&impairment.delayedCount, 1);
+
+    pthread_mutex_lock(&impairment.mutex);
+    DelayedPacket** link = &impairment.delayed;
+    while (*link && (*link)->dueUs <= packet->dueUs) {
+        link = &(*link)->next;
+    }
+    packet->next = *link;
+    *link = packet;
+    if (impairment.delayed == packet) {
+        pthread_cond_signal(&impairment.wake); // Nouvelle échéance la plus proche
+    }
+    pthread_mutex_unlock(&impairment.mutex);
+}
+
+// Émet les paquets retardés à leur échéance
+void* delayLoop(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&impairment.mutex);
+    while (1) {
+        DelayedPacket* packet = impairment.delayed;
+        if (!packet) {
+            pthread_cond_wait(&impairment.wake, &impairment.mutex);
+            continue;
+        }
+        long long now = nowUs();
+        if (packet->dueUs > now) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            long long wakeNs = ts.tv_nsec + (packet->dueUs - now) * 1000;
+            ts.tv_sec += wakeNs / 1000000000;
+            ts.tv_nsec = wakeNs % 1000000000;
+            pthread_cond_timedwait(&impairment.wake, &impairment.mutex, &ts);
+            continue;
+        }
+
+        impairment.delayed = packet->next;
+        pthread_mutex_unlock(&impairment.mutex);
+        sendto(packet->sockfd, packet->data, packet->len, 0, (struct sockaddr*)&packet->addr, packet->addrLen);
+        close(packet->sockfd);
+        free(packet);
+        pthread_mutex_lock(&impairment.mutex);
+    }
+    return NULL;
+}
+
+void cacheInit(size_t capacity) {
+    pthread_mutex_init(&fileCache.mutex, NULL);
+    fileCache.capacity = capacity;
+}
+
+// Recherche d'un fichier dans le cache. Retourne l'entrée avec une référence prise si
+// elle correspond encore au fichier sur disque ; une entrée périmée est retirée.
+CacheEntry* cacheLookup(const char* filename, const struct stat* st) {
+    if (fileCache.capacity == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&fileCache.mutex);
+    for (CacheEntry* entry = fileCache.head; entry; entry = entry->next) {
+        if (strcmp(entry->filename, filename) != 0) {
+            continue;
+        }
+        if (entry->dev != st->st_dev || entry->ino != st->st_ino || entry->size != (size_t)st->st_size ||
+            entry->mtime.tv_sec != st->st_mtim.tv_sec || entry->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+            cacheRemove(entry);
+            atomic_fetch_add(&fileCache.invalidations, 1);
+            break;
+        }
+
+        // Passage en tête de la liste LRU
+        if (entry != fileCache.head) {
+            entry->prev->next = entry->next;
+            if (entry->next) {
+                entry->next->prev = entry->prev;
+            } else {
+                fileCache.tail = entry->prev;
+            }
+            entry->prev = NULL;
+            entry->next = fileCache.head;
+            fileCache.head->prev = entry;
+            fileCache.head = entry;
+        }
+        entry->refCount++;
+        pthread_mutex_unlock(&fileCache.mutex);
+        atomic_fetch_add(&fileCache.hits, 1);
+        return entry;
+    }
+    pthread_mutex_unlock(&fileCache.mutex);
+    atomic_fetch_add(&fileCache.misses, 1);
+    return NULL;
+}
+
+// Lit un fichier entier et l'ajoute au cache, en évinçant les entrées les moins récentes.
+// Retourne l'entrée avec une référence prise, ou NULL si le fichier ne s'y prête pas
+// (vide, spécial, trop gros) ; pread laisse la position intacte pour une lecture normale.
+CacheEntry* cacheLoad(const char* filename, int fd) {
+    struct stat st;
+    if (fileCache.capacity == 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || (size_t)st.st_size > fileCache.capacity / CACHE_MAX_FRACTION) {
+        return NULL;
+    }
+
+    // Lecture hors du mutex : seul le verrou partagé du fichier est tenu
+    CacheEntry* entry = calloc(1, sizeof(CacheEntry));
+    char* data = malloc(st.st_size);
+    if (!entry || !data || pread(fd, data, st.st_size, 0) != st.st_size) {
+        free(entry);
+        free(data);
+        return NULL;
+    }
+    atomic_fetch_add(&allocStats.heapAllocs, 2);
+    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    entry->data = data;
+    entry->refCount = 2; // Le cache et l'appelant
+
+    pthread_mutex_lock(&fileCache.mutex);
+    // Un autre worker a pu charger le même fichier entre-temps : on garde la copie la plus récente
+    for (CacheEntry* other = fileCache.head; other; other = other->next) {
+        if (strcmp(other->filename, filename) == 0) {
+            cacheRemove(other);
+            break;
+        }
+    }
+    while (fileCache.tail && fileCache.used + entry->size > fileCache.capacity) {
+        cacheRemove(fileCache.tail);
+        atomic_fetch_add(&fileCache.evictions, 1);
+    }
+    entry->next = fileCache.head;
+    if (fileCache.head) {
+        fileCache.head->prev = entry;
+    } else {
+        fileCache.tail = entry;
+    }
+    fileCache.head = entry;
+    fileCache.used += entry->size;
+    pthread_mutex_unlock(&fileCache.mutex);
+    return entry;
+}
+
+// Rend la référence d'une session ; la dernière libère le contenu
+void cacheRelease(CacheEntry* entry) {
+    pthread_mutex_lock(&fileCache.mutex);
+    int last = (--entry->refCount == 0);
+    pthread_mutex_unlock(&fileCache.mutex);
+    if (last) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// Retire un fichier du cache, appelé à la fin de chaque WRQ sur ce fichier
+void cacheInvalidate(const char* filename) {
+    if (fileCache.capacity == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fileCache.mutex);
+    for (CacheEntry* entry = fileCache.head; entry; entry = entry->next) {
+        if (strcmp(entry->filename, filename) == 0) {
+            cacheRemove(entry);
+            atomic_fetch_add(&fileCache.invalidations, 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fileCache.mutex);
+}
+
+// Détache une entrée de la liste et rend la référence du cache. Mutex du cache tenu.
+void cacheRemove(CacheEntry* entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        fileCache.head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        fileCache.tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    fileCache.used -= entry->size;
+    if (--entry->refCount == 0) {
+        free(entry->data);
+        free(entry);
+    }
+}
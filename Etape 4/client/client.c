@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,33 +8,235 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <poll.h>
 
 #define BUFFER_SIZE 516
-#define TIMEOUT_SEC 5 // Ajustez selon les besoins
+#define TIMEOUT_SEC 5 // Plafond du délai de retransmission adaptatif
 #define OP_RRQ 1
 #define OP_WRQ 2
 #define OP_DATA 3
 #define OP_ACK 4
 #define OP_ERROR 5
 #define OP_OACK 6
-#define OPTION_BIGFILE "bigfile"
+#define OPTION_ROLLOVER "rollover" // Numéro qui suit 65535 : 0 ou 1 selon les implémentations
 #define MAX_RETRIES 3
+#define OPTION_BLKSIZE "blksize"
+#define DEFAULT_BLKSIZE 512
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464 // Limite RFC 2348
+#define MAX_PACKET_SIZE (MAX_BLKSIZE + 4)
+#define OPTION_WINDOWSIZE "windowsize"
+#define MAX_WINDOWSIZE 65535 // Limite RFC 7440
+#define OPTION_TIMEOUT "timeout"
+#define MIN_TIMEOUT_OPTION 1   // RFC 2349 : timeout de 1 à 255 secondes
+#define MAX_TIMEOUT_OPTION 255
+#define OPTION_TSIZE "tsize" // Taille du fichier transféré (RFC 2349)
+#define OPTION_OFFSET "offset" // Reprise d'un transfert interrompu (extension du serveur) : "octets,mtime"
+#define OPTION_RANGE "range" // Partie du fichier lue par une session (extension du serveur) : "début,longueur"
+#define MAX_PARALLEL_SESSIONS 64
+#define DEFAULT_BATCH_JOBS 16 // Transferts simultanés du mode batch par défaut
+#define MAX_BATCH_JOBS 256    // Une socket et un fichier ouverts par transfert
+#define OPTION_MULTICAST "multicast" // Réception d'une diffusion de groupe (RFC 2090)
+#define MAX_MULTICAST_BLOCKS 65535 // Les numéros de bloc ne reviennent pas à zéro en multicast
+#define MULTICAST_IDLE_MS 30000 // Attente maximale d'un nouveau bloc avant d'abandonner
+#define INITIAL_RTO_MS 1000 // Délai de retransmission avant la première mesure (RFC 6298)
+#define MIN_RTO_MS 200 // Plancher : sur un LAN, une perte coûte 200 ms au lieu de TIMEOUT_SEC
+#define MAX_RTO_MS (TIMEOUT_SEC * 1000)
+
+// Estimation du délai de retransmission à la Jacobson/Karels (RFC 6298). Seuls les paquets
+// émis une seule fois sont mesurés (algorithme de Karn) et chaque timeout double le délai.
+// Un timeout accepté par le serveur (RFC 2349) remplace l'estimation.
+typedef struct {
+    long long srttUs;        // RTT lissé
+    long long rttvarUs;      // Variation moyenne du RTT
+    long long rtoMs;         // Délai de retransmission courant, backoff compris
+    int hasSample;
+    int fixedMs;             // Timeout négocié, 0 si le délai est adaptatif
+    int timing;              // Vrai si une mesure est en cours
+    unsigned long timedSeq;  // Numéro du paquet dont on attend la réponse
+    long long sentUs;        // Date d'émission du paquet mesuré
+} RttEstimator;
+
+// Un seul transfert par exécution : une seule estimation
+RttEstimator rtt;
+
+// Une session d'un téléchargement parallèle (option -p) : une partie du fichier, avec sa propre
+// socket (son TID), sa propre fenêtre et son propre délai de retransmission
+typedef struct {
+    int sockfd;
+    struct sockaddr_in serverTid;
+    int hasTid;
+    long long start, length;   // Partie demandée au serveur
+    int blksize;               // Taille de bloc acceptée par le serveur pour cette session
+    int windowsize;            // Fenêtre demandée, puis acceptée par le serveur
+    int receivedInWindow;      // Blocs reçus dans l'ordre depuis le dernier ACK
+    int nakPending;            // Vrai si un bloc hors séquence a déjà été signalé
+    unsigned long blockNum;    // Dernier bloc reçu, compté sans roll-over
+    int done;
+    char packet[BUFFER_SIZE];  // Dernier paquet émis (requête puis ACK), réémis au timeout
+    int packetLen;
+    RttEstimator rtt;
+    long long deadline;        // Échéance du délai de retransmission, en ms
+    long long lastProgress;
+} RangeSession;
+
+// Une ligne du manifeste du mode batch (option -b) et son résultat
+typedef struct {
+    int put;                   // 1 : put (WRQ), 0 : get (RRQ)
+    char remote[100];          // Nom du fichier sur le serveur
+    char local[256];           // Fichier local lu ou écrit
+    int status;                // 0 à faire ou en cours, 1 terminé, -1 échoué
+    long long latencyUs;       // De la requête au dernier bloc acquitté
+    unsigned long long bytes;
+} BatchEntry;
+
+// Un transfert en cours du mode batch, en lock-step comme une session de -p
+typedef struct {
+    BatchEntry *entry;
+    int sockfd;
+    int fd;                    // Fichier local
+    struct sockaddr_in serverTid;
+    int hasTid;
+    int answered;              // Vrai après la première réponse (OACK, ACK 0 ou DATA 1)
+    int blksize;
+    unsigned long blockNum;    // get : dernier bloc reçu, put : dernier bloc émis
+    int finalSent;             // put : le bloc court final est parti
+    char *packet;              // Dernier paquet émis (requête, ACK ou DATA), réémis au timeout
+    int packetLen;
+    RttEstimator rtt;
+    long long deadline;        // Échéance du délai de retransmission, en ms
+    long long lastProgress;
+    long long startUs;
+} BatchTransfer;
+
+// Numéro de bloc qui suit 65535 (option -r). Avec -r, la valeur est aussi demandée au
+// serveur par l'option rollover ; celle de son OACK fait foi.
+int rolloverBase = 0;
+int sendRollover = 0;
+
+// Paquets ignorés pendant le transfert : ACK ou DATA en double (jamais réémis en réponse,
+// RFC 1123 §4.2.3.1) et paquets venus d'une autre adresse que celle du serveur (TID)
+unsigned long duplicatesIgnored = 0;
+unsigned long strangersRejected = 0;
+
+// Option -m : les lectures demandent à rejoindre une diffusion multicast
+int multicastRequested = 0;
+
+// Option -c : les transferts demandent l'option offset pour reprendre là où une session
+// précédente s'est arrêtée
+int resumeRequested = 0;
+
+// Option -p : nombre de sessions d'un téléchargement parallèle, 0 pour une seule session
+int parallelSessions = 0;
+
+// Options -b, -j et -B : manifeste du mode batch, transferts simultanés et taille de bloc
+const char *batchManifest = NULL;
+int batchJobs = DEFAULT_BATCH_JOBS;
+int batchBlksize = DEFAULT_BLKSIZE;
 
 // Prototypes des fonctions
-void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize);
-void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize);
+void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize, int windowsize, int timeout);
+void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize, int timeout);
+void fetchRanges(int sockfd, struct sockaddr_in *serverAddr, const char *filename, int blksize, int windowsize, int timeout);
+int probeRanges(int sockfd, struct sockaddr_in *serverAddr, const char *filename, long long *tsize, long long *mtime);
+int rangeDatagram(RangeSession *range, int fd, const char *packet, int len, long long mtime, unsigned long long *received);
+const char* oackValue(const char *packet, int packetLen, const char *name);
+void receiveMulticast(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode);
+void runBatch(struct sockaddr_in *serverAddr);
+int readManifest(const char *path, BatchEntry **entries);
+int batchStart(BatchTransfer *transfer, BatchEntry *entry, struct sockaddr_in *serverAddr);
+int batchDatagram(BatchTransfer *transfer, const char *packet, int len);
+int batchSendBlock(BatchTransfer *transfer);
+void batchFinish(BatchTransfer *transfer, int status, const char *message);
+int compareLongLong(const void *a, const void *b);
+int joinGroup(struct sockaddr_in *serverAddr, const char *groupSpec, int *master);
 int waitForAck(int sockfd, struct sockaddr_in *serverAddr, unsigned int expectedBlockNum);
 int sendWithRetries(int sockfd, struct sockaddr_in *serverAddr, char *packet, int packetLen, unsigned int expectedBlockNum);
+int waitForWRQResponse(int sockfd, struct sockaddr_in *serverAddr, int *blksize, int *timeout, long long *offset, long long *mtime);
+int parseOACK(const char *packet, int packetLen, int *blksize, int *windowsize, int *timeout, int *rollover, long long *tsize, long long *offset, long long *mtime);
+int reserveSpace(int fd, long long size);
+void reportProgress(unsigned long long done, long long total);
+unsigned int wireBlockNum(unsigned long block);
+int waitReadable(int sockfd, long long timeoutMs);
+void growReceiveBuffer(int sockfd, int size);
+int sameTid(const struct sockaddr_in *a, const struct sockaddr_in *b);
+void rejectUnknownTid(int sockfd, struct sockaddr_in *fromAddr, socklen_t fromAddrLen);
+void rejectOptions(int sockfd, struct sockaddr_in *serverTid, const char *reason);
+void printIgnored(void);
+
+// Délai de retransmission
+long long nowUs(void);
+void rttInit(RttEstimator *rtt, int fixedMs);
+void rttStart(RttEstimator *rtt, unsigned long seq);
+void rttAcked(RttEstimator *rtt, unsigned long seq);
+void rttCancel(RttEstimator *rtt);
+void rttBackoff(RttEstimator *rtt);
+long long rttTimeoutMs(const RttEstimator *rtt);
+long long rttMaxMs(const RttEstimator *rtt);
 
 
 // La fonction principale
-int main() {
+int main(int argc, char *argv[]) {
     char serverIP[INET_ADDRSTRLEN];
     int serverPort;
     char filename[100];
     char mode[10];
     int operation;
     int blksize = 512; // Taille de bloc par défaut
+    int windowsize = 1; // Un ACK par bloc par défaut (RFC 1350)
+    int timeout = 0; // Délai de retransmission adaptatif par défaut
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:mcp:b:j:B:")) != -1) {
+        if (opt == 'r') {
+            rolloverBase = atoi(optarg) == 1;
+            sendRollover = 1;
+        } else if (opt == 'm') {
+            multicastRequested = 1;
+        } else if (opt == 'c') {
+            resumeRequested = 1;
+        } else if (opt == 'p' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_PARALLEL_SESSIONS) {
+            parallelSessions = atoi(optarg);
+        } else if (opt == 'b') {
+            batchManifest = optarg;
+        } else if (opt == 'j' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_BATCH_JOBS) {
+            batchJobs = atoi(optarg);
+        } else if (opt == 'B' && atoi(optarg) >= MIN_BLKSIZE && atoi(optarg) <= MAX_BLKSIZE) {
+            batchBlksize = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-r 0|1] [-m] [-c] [-p sessions]\n", argv[0]);
+            fprintf(stderr, "       %s -b manifest [-j jobs] [-B blksize] [-r 0|1] server-ip port\n", argv[0]);
+            fprintf(stderr, "  -r  block number after 65535, requested from the server with the rollover option\n");
+            fprintf(stderr, "  -m  read through a multicast group shared with other clients (512-byte blocks)\n");
+            fprintf(stderr, "  -c  continue an interrupted transfer (octet mode, server offset option)\n");
+            fprintf(stderr, "  -p  read in octet mode over 1-%d concurrent sessions, one byte range each\n", MAX_PARALLEL_SESSIONS);
+            fprintf(stderr, "  -b  run the \"get remote [local]\" and \"put local [remote]\" lines of a manifest, without prompts\n");
+            fprintf(stderr, "  -j  batch transfers in flight, 1-%d (default %d)\n", MAX_BATCH_JOBS, DEFAULT_BATCH_JOBS);
+            fprintf(stderr, "  -B  batch block size (default %d)\n", DEFAULT_BLKSIZE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Mode batch : le serveur est donné en argument, tout le reste vient du manifeste
+    if (batchManifest) {
+        struct sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        if (argc - optind != 2 || inet_pton(AF_INET, argv[optind], &serverAddr.sin_addr) != 1 ||
+            atoi(argv[optind + 1]) <= 0 || atoi(argv[optind + 1]) > 65535) {
+            fprintf(stderr, "Usage: %s -b manifest [-j jobs] [-B blksize] [-r 0|1] server-ip port\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        serverAddr.sin_port = htons(atoi(argv[optind + 1]));
+        runBatch(&serverAddr);
+        return 0;
+    }
 
     printf("Enter server IP: ");
     scanf("%s", serverIP);
@@ -45,6 +248,27 @@ int main() {
     scanf("%s", filename);
     printf("Enter mode (octet or netascii): ");
     scanf("%s", mode);
+    printf("Enter block size (%d-%d, %d for default): ", MIN_BLKSIZE, MAX_BLKSIZE, DEFAULT_BLKSIZE);
+    scanf("%d", &blksize);
+    if (blksize < MIN_BLKSIZE || blksize > MAX_BLKSIZE) {
+        printf("Invalid block size, using %d.\n", DEFAULT_BLKSIZE);
+        blksize = DEFAULT_BLKSIZE;
+    }
+    if (operation == 1) {
+        printf("Enter window size (1-%d, 1 for lock-step): ", MAX_WINDOWSIZE);
+        scanf("%d", &windowsize);
+        if (windowsize < 1 || windowsize > MAX_WINDOWSIZE) {
+            printf("Invalid window size, using 1.\n");
+            windowsize = 1;
+        }
+    }
+    printf("Enter retransmission timeout in seconds (%d-%d, 0 for adaptive): ", MIN_TIMEOUT_OPTION, MAX_TIMEOUT_OPTION);
+    scanf("%d", &timeout);
+    if (timeout != 0 && (timeout < MIN_TIMEOUT_OPTION || timeout > MAX_TIMEOUT_OPTION)) {
+        printf("Invalid timeout, using adaptive retransmission.\n");
+        timeout = 0;
+    }
+    rttInit(&rtt, 0);
 
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
@@ -58,10 +282,14 @@ int main() {
     serverAddr.sin_port = htons(serverPort);
     inet_pton(AF_INET, serverIP, &serverAddr.sin_addr);
 
-    if (operation == 1) {
-        sendRRQAndWaitForResponse(sockfd, &serverAddr, filename, mode, blksize);
+    if (operation == 1 && multicastRequested) {
+        receiveMulticast(sockfd, &serverAddr, filename, mode);
+    } else if (operation == 1 && parallelSessions > 1 && strcasecmp(mode, "octet") == 0) {
+        fetchRanges(sockfd, &serverAddr, filename, blksize, windowsize, timeout);
+    } else if (operation == 1) {
+        sendRRQAndWaitForResponse(sockfd, &serverAddr, filename, mode, blksize, windowsize, timeout);
     } else if (operation == 2) {
-        sendFile(sockfd, &serverAddr, filename, mode, blksize);
+        sendFile(sockfd, &serverAddr, filename, mode, blksize, timeout);
     } else {
         printf("Invalid operation.\n");
     }
@@ -72,59 +300,196 @@ int main() {
 
 // Implémentations des fonctions sendRRQAndWaitForResponse, sendFile, waitForAck, sendWithRetries
 
-void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize) {
-    char buffer[BUFFER_SIZE];
+// Avec windowsize > 1 (RFC 7440), seul le dernier bloc de chaque fenêtre est acquitté.
+// Sans nouvelles du serveur, la requête ou le dernier ACK est réémis au délai de retransmission.
+void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize, int windowsize, int timeout) {
+    char buffer[MAX_PACKET_SIZE];
+    char request[BUFFER_SIZE];
+    char lastAck[4] = {0, OP_ACK, 0, 0};
     int len, recvLen;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrLen = sizeof(fromAddr);
-    unsigned int blockNum = 0;  // Initial block number for ACK
+    struct sockaddr_in serverTid;  // Adresse et port de la session, fixés par la première réponse
+    unsigned long blockNum = 0;  // Dernier bloc reçu, compté sans roll-over
+    unsigned long long received = 0;
+    long long tsize = -1;        // Taille annoncée par le serveur, -1 si inconnue
+    long long offset = -1;       // Position de reprise acceptée par le serveur, -1 sans reprise
+    long long mtime = 0;         // Date de la version du fichier servie, pour une reprise ultérieure
+    int requestedBlksize = blksize;
+    int requestedWindowsize = windowsize;
+    int firstPacket = 1;
+    int receivedInWindow = 0;      // Blocs reçus en séquence depuis le dernier ACK
+    unsigned long lastNakBlock = 0; // Bloc déjà signalé manquant, pour ne l'ACKer qu'une fois
+    int nakPending = 0;
+    long long lastProgress = nowUs() / 1000;
 
-    // Construction de la requête RRQ avec l'option bigfile
-    len = sprintf(buffer, "%c%c%s%c%s%c", 0, OP_RRQ, filename, 0, mode, 0);
-    len += sprintf(buffer + len, "%s%c%d%c", OPTION_BIGFILE, 0, 1, 0); // Ajout de l'option bigfile
-
-    // Envoi de la requête RRQ
-    sendto(sockfd, buffer, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+    // Construction de la requête RRQ et de ses options
+    len = sprintf(request, "%c%c%s%c%s%c", 0, OP_RRQ, filename, 0, mode, 0);
+    if (sendRollover) {
+        len += sprintf(request + len, "%s%c%d%c", OPTION_ROLLOVER, 0, rolloverBase, 0);
+    }
+    if (requestedBlksize != DEFAULT_BLKSIZE) {
+        len += sprintf(request + len, "%s%c%d%c", OPTION_BLKSIZE, 0, requestedBlksize, 0); // RFC 2348
+    }
+    if (requestedWindowsize != 1) {
+        len += sprintf(request + len, "%s%c%d%c", OPTION_WINDOWSIZE, 0, requestedWindowsize, 0); // RFC 7440
+    }
+    if (timeout != 0) {
+        len += sprintf(request + len, "%s%c%d%c", OPTION_TIMEOUT, 0, timeout, 0); // RFC 2349
+    }
+    // Le serveur ne connaît la taille transmise qu'en mode octet
+    if (strcasecmp(mode, "octet") == 0) {
+        len += sprintf(request + len, "%s%c0%c", OPTION_TSIZE, 0, 0); // RFC 2349
+    }
 
-    // Ouverture/Création du fichier où écrire les données reçues
-    FILE *file = fopen(filename, "wb");
+    // Ouverture/Création du fichier où écrire les données reçues. Pour une reprise, il n'est
+    // tronqué qu'à la position acceptée par le serveur.
+    int resume = resumeRequested && strcasecmp(mode, "octet") == 0;
+    int fd = open(filename, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
     if (!file) {
         perror("Failed to open file for writing");
         exit(EXIT_FAILURE);
     }
+    // La partie déjà reçue et sa date, celle du fichier du serveur, demandent la reprise
+    struct stat st;
+    if (resume && fstat(fd, &st) == 0) {
+        len += sprintf(request + len, "%s%c%lld,%lld%c", OPTION_OFFSET, 0, (long long)st.st_size, (long long)st.st_mtime, 0);
+    }
+
+    // Envoi de la requête RRQ
+    sendto(sockfd, request, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+    rttStart(&rtt, 0);
 
     // Boucle de réception des données
     while (1) {
-        recvLen = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (!waitReadable(sockfd, rttTimeoutMs(&rtt))) {
+            if (nowUs() / 1000 - lastProgress >= rttMaxMs(&rtt) * MAX_RETRIES) {
+                printf("Timeout: no data from server, transfer aborted.\n");
+                break;
+            }
+            rttBackoff(&rtt);
+            if (firstPacket) {
+                sendto(sockfd, request, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+            } else {
+                sendto(sockfd, lastAck, sizeof(lastAck), 0, (struct sockaddr *)&serverTid, sizeof(serverTid));
+            }
+            continue;
+        }
+
+        fromAddrLen = sizeof(fromAddr);
+        recvLen = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
         if (recvLen < 4) {
             perror("Packet received is too short");
             continue;
         }
+        if (firstPacket) {
+            serverTid = fromAddr;
+        } else if (!sameTid(&fromAddr, &serverTid)) {
+            rejectUnknownTid(sockfd, &fromAddr, fromAddrLen);
+            continue;
+        }
 
         unsigned short opcode = buffer[1];
         unsigned short receivedBlock = ntohs(*(unsigned short *)(buffer + 2));
 
+        // Sans OACK, le serveur a ignoré nos options : blocs de 512 octets
+        if (firstPacket) {
+            firstPacket = 0;
+            if (opcode != OP_OACK) {
+                blksize = DEFAULT_BLKSIZE;
+                windowsize = 1;
+                if (resume && ftruncate(fd, 0) < 0) {
+                    perror("Failed to truncate file");
+                }
+            }
+        }
+
         // Vérification du premier paquet pour OACK
         if (opcode == OP_OACK) {
+            blksize = DEFAULT_BLKSIZE;
+            windowsize = 1;
+            int ackedTimeout = 0;
+            if (!parseOACK(buffer, recvLen, &blksize, &windowsize, &ackedTimeout, &rolloverBase, &tsize, &offset, &mtime) ||
+                blksize > requestedBlksize || windowsize > requestedWindowsize ||
+                (ackedTimeout != 0 && ackedTimeout != timeout) || (offset >= 0 && !resume)) {
+                printf("Invalid OACK received.\n");
+                break;
+            }
+            rttAcked(&rtt, 0);
+            if (ackedTimeout != 0) {
+                rttInit(&rtt, ackedTimeout * 1000);
+            }
+            // Reprise : on garde ce que le serveur ne renverra pas (tout ou rien s'il a
+            // ignoré l'option ou si son fichier a changé)
+            if (resume && blockNum == 0) {
+                if (offset < 0 || ftruncate(fd, offset) < 0 || fseeko(file, offset, SEEK_SET) < 0) {
+                    offset = 0;
+                    if (ftruncate(fd, 0) < 0) {
+                        perror("Failed to truncate file");
+                    }
+                    rewind(file);
+                }
+                received = offset;
+                if (offset > 0) {
+                    printf("Resuming at byte %lld.\n", offset);
+                }
+            }
+            // Taille connue : le fichier est réservé d'un seul tenant, et le transfert refusé
+            // s'il ne tient pas sur le disque
+            if (tsize > 0 && !reserveSpace(fileno(file), tsize)) {
+                char error[48];
+                int errorLen = sprintf(error, "%c%c%c%cDisk full or allocation exceeded", 0, OP_ERROR, 0, 3);
+                sendto(sockfd, error, errorLen + 1, 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+                printf("Not enough disk space for %lld bytes, transfer aborted.\n", tsize);
+                break;
+            }
+            // Une fenêtre entière doit tenir dans le tampon de réception, sinon les
+            // derniers blocs de chaque fenêtre sont perdus et le serveur attend son timeout
+            if (windowsize > 1) {
+                growReceiveBuffer(sockfd, windowsize * (blksize + 4) * 2);
+            }
             // Envoi d'un ACK pour OACK
-            buffer[0] = 0; buffer[1] = OP_ACK;
-            buffer[2] = 0; buffer[3] = 0;
-            sendto(sockfd, buffer, 4, 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+            sendto(sockfd, lastAck, sizeof(lastAck), 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+            rttStart(&rtt, 0);
+            lastProgress = nowUs() / 1000;
             continue;  // Attendre le premier bloc de données
         } else if (opcode == OP_DATA) {
-            if (receivedBlock == (blockNum + 1) % 65536) {
+            if (receivedBlock == wireBlockNum(blockNum + 1)) {
                 fwrite(buffer + 4, 1, recvLen - 4, file);  // Écriture des données dans le fichier
-                blockNum = receivedBlock;  // Mise à jour du numéro de bloc
+                blockNum++;
+                received += recvLen - 4;
+                reportProgress(received, tsize);
+                int lastBlock = (recvLen - 4 < blksize);
+                nakPending = 0;
+                rttAcked(&rtt, 0);
+                lastProgress = nowUs() / 1000;
 
-                // Envoi d'un ACK pour le bloc reçu
-                buffer[0] = 0; buffer[1] = OP_ACK;
-                buffer[2] = (blockNum >> 8) & 0xFF; buffer[3] = blockNum & 0xFF;
-                sendto(sockfd, buffer, 4, 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+                // Envoi d'un ACK pour le dernier bloc de la fenêtre (ou le bloc final)
+                if (++receivedInWindow >= windowsize || lastBlock) {
+                    lastAck[2] = wireBlockNum(blockNum) >> 8; lastAck[3] = wireBlockNum(blockNum) & 0xFF;
+                    sendto(sockfd, lastAck, sizeof(lastAck), 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+                    rttStart(&rtt, 0); // Mesure jusqu'au premier bloc de la fenêtre suivante
+                    receivedInWindow = 0;
+                }
 
-                if (recvLen < BUFFER_SIZE) {  // Si c'est le dernier bloc
+                if (lastBlock) {  // Si c'est le dernier bloc
                     printf("File transfer completed.\n");
                     break;
                 }
+            } else if (windowsize == 1 && blockNum > 0 && receivedBlock == wireBlockNum(blockNum)) {
+                // DATA en double : notre ACK s'est perdu, on le renvoie une fois par doublon
+                sendto(sockfd, lastAck, sizeof(lastAck), 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+                duplicatesIgnored++;
+            } else if (windowsize > 1 && (!nakPending || lastNakBlock != blockNum)) {
+                // Bloc hors séquence : on acquitte une seule fois le dernier bloc reçu
+                // dans l'ordre pour que le serveur reprenne la fenêtre à partir de là
+                lastAck[2] = wireBlockNum(blockNum) >> 8; lastAck[3] = wireBlockNum(blockNum) & 0xFF;
+                sendto(sockfd, lastAck, sizeof(lastAck), 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+                rttCancel(&rtt);
+                lastNakBlock = blockNum;
+                nakPending = 1;
+                receivedInWindow = 0;
             }
         } else if (opcode == OP_ERROR) {
             printf("Error packet received: %s\n", buffer + 4);
@@ -132,80 +497,1308 @@ void sendRRQAndWaitForResponse(int sockfd, struct sockaddr_in *serverAddr, const
         }
     }
 
+    printIgnored();
+    // Le fichier reçu, complet ou non, prend la date de celui du serveur : c'est elle que
+    // -c présentera pour reprendre
+    fflush(file);
+    if (offset >= 0 && mtime > 0) {
+        struct timespec times[2] = {{0, UTIME_NOW}, {mtime, 0}};
+        futimens(fd, times);
+    }
     fclose(file);
 }
 
-int waitForAck(int sockfd, struct sockaddr_in *serverAddr, unsigned int expectedBlockNum) {
-    char ackBuffer[4];
-    struct timeval tv;
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sockfd, &readfds);
+// Téléchargement parallèle (option -p). Une première requête lit la taille et la date du
+// fichier (tsize et une partie vide), puis le fichier est réservé et découpé en parties de
+// blocs entiers, chacune lue par sa propre session avec la fenêtre demandée : ensemble elles
+// gardent parallelSessions fenêtres en vol ; chacune écrit ses blocs avec pwrite à leur
+// place. Un serveur sans l'option range est lu par une seule session.
+void fetchRanges(int sockfd, struct sockaddr_in *serverAddr, const char *filename, int blksize, int windowsize, int timeout) {
+    long long tsize, mtime;
+    if (!probeRanges(sockfd, serverAddr, filename, &tsize, &mtime)) {
+        printf("Server does not support ranges, using one session.\n");
+        sendRRQAndWaitForResponse(sockfd, serverAddr, filename, "octet", blksize, windowsize, timeout);
+        return;
+    }
 
-    tv.tv_sec = TIMEOUT_SEC;
-    tv.tv_usec = 0;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open file for writing");
+        exit(EXIT_FAILURE);
+    }
+    if (!reserveSpace(fd, tsize)) {
+        printf("Not enough disk space for %lld bytes, transfer aborted.\n", tsize);
+        close(fd);
+        return;
+    }
 
-    if (select(sockfd + 1, &readfds, NULL, NULL, &tv) > 0) {
-        socklen_t addrLen = sizeof(struct sockaddr_in);
-        if (recvfrom(sockfd, ackBuffer, sizeof(ackBuffer), 0, (struct sockaddr *)serverAddr, &addrLen) >= 4) {
-            if (ackBuffer[1] == OP_ACK) {
-                unsigned int blockNum = ((unsigned char)ackBuffer[2] << 8) | (unsigned char)ackBuffer[3];
-                if (blockNum == expectedBlockNum) {
-                    return 1;  // ACK correct reçu
+    // Parties de même taille, en blocs entiers ; la dernière peut être plus courte
+    long long chunk = (tsize + parallelSessions - 1) / parallelSessions;
+    chunk = (chunk + blksize - 1) / blksize * blksize;
+    int count = chunk > 0 ? (int)((tsize + chunk - 1) / chunk) : 1;
+    RangeSession ranges[MAX_PARALLEL_SESSIONS];
+    memset(ranges, 0, sizeof(ranges));
+    for (int i = 0; i < count; i++) {
+        RangeSession *range = &ranges[i];
+        range->start = i * chunk;
+        range->length = tsize - range->start < chunk ? tsize - range->start : chunk;
+        range->blksize = DEFAULT_BLKSIZE;
+        range->windowsize = windowsize;
+        range->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (range->sockfd < 0) {
+            perror("Cannot create socket");
+            exit(EXIT_FAILURE);
+        }
+        range->packetLen = sprintf(range->packet, "%c%c%s%c%s%c%s%c%lld,%lld%c", 0, OP_RRQ, filename, 0, "octet", 0,
+                                   OPTION_RANGE, 0, range->start, range->length, 0);
+        if (blksize != DEFAULT_BLKSIZE) {
+            range->packetLen += sprintf(range->packet + range->packetLen, "%s%c%d%c", OPTION_BLKSIZE, 0, blksize, 0);
+        }
+        if (windowsize > 1) {
+            range->packetLen += sprintf(range->packet + range->packetLen, "%s%c%d%c", OPTION_WINDOWSIZE, 0, windowsize, 0);
+        }
+        if (timeout != 0) {
+            range->packetLen += sprintf(range->packet + range->packetLen, "%s%c%d%c", OPTION_TIMEOUT, 0, timeout, 0);
+        }
+        if (sendRollover) {
+            range->packetLen += sprintf(range->packet + range->packetLen, "%s%c%d%c", OPTION_ROLLOVER, 0, rolloverBase, 0);
+        }
+        sendto(range->sockfd, range->packet, range->packetLen, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+        rttInit(&range->rtt, 0);
+        rttStart(&range->rtt, 0);
+        range->lastProgress = nowUs() / 1000;
+        range->deadline = range->lastProgress + rttTimeoutMs(&range->rtt);
+    }
+
+    unsigned long long received = 0;
+    int active = count;
+    int failed = 0;
+    long long startUs = nowUs();
+    while (active > 0 && !failed) {
+        // Attente jusqu'à la première échéance des sessions en cours
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        int maxfd = -1;
+        long long now = nowUs() / 1000;
+        long long wait = MAX_RTO_MS;
+        for (int i = 0; i < count; i++) {
+            if (!ranges[i].done) {
+                FD_SET(ranges[i].sockfd, &readfds);
+                maxfd = ranges[i].sockfd > maxfd ? ranges[i].sockfd : maxfd;
+                wait = ranges[i].deadline - now < wait ? ranges[i].deadline - now : wait;
+            }
+        }
+        struct timeval tv;
+        tv.tv_sec = wait > 0 ? wait / 1000 : 0;
+        tv.tv_usec = wait > 0 ? (wait % 1000) * 1000 : 0;
+        int ready = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+
+        now = nowUs() / 1000;
+        for (int i = 0; i < count && !failed; i++) {
+            RangeSession *range = &ranges[i];
+            if (range->done) {
+                continue;
+            }
+            if (ready > 0 && FD_ISSET(range->sockfd, &readfds)) {
+                char buffer[MAX_PACKET_SIZE];
+                struct sockaddr_in fromAddr;
+                socklen_t fromAddrLen = sizeof(fromAddr);
+                int recvLen = recvfrom(range->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+                if (recvLen < 4) {
+                    continue;
+                }
+                if (!range->hasTid && fromAddr.sin_addr.s_addr == serverAddr->sin_addr.s_addr) {
+                    range->serverTid = fromAddr;
+                    range->hasTid = 1;
+                } else if (!range->hasTid || !sameTid(&fromAddr, &range->serverTid)) {
+                    rejectUnknownTid(range->sockfd, &fromAddr, fromAddrLen);
+                    continue;
+                }
+                if (rangeDatagram(range, fd, buffer, recvLen, mtime, &received) < 0) {
+                    failed = 1;
+                } else if (range->done) {
+                    active--;
                 }
+                reportProgress(received, tsize);
+            } else if (now >= range->deadline) {
+                // Pas de nouvelles de cette session : on réémet sa requête ou son dernier ACK
+                if (now - range->lastProgress >= rttMaxMs(&range->rtt) * MAX_RETRIES) {
+                    printf("Timeout: no data for bytes %lld-%lld, transfer aborted.\n", range->start, range->start + range->length);
+                    failed = 1;
+                    break;
+                }
+                rttBackoff(&range->rtt);
+                struct sockaddr_in *to = range->hasTid ? &range->serverTid : serverAddr;
+                sendto(range->sockfd, range->packet, range->packetLen, 0, (struct sockaddr *)to, sizeof(*to));
+                range->deadline = now + rttTimeoutMs(&range->rtt);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (failed && !ranges[i].done && ranges[i].hasTid) {
+            char error[32];
+            int errorLen = sprintf(error, "%c%c%c%cTransfer aborted", 0, OP_ERROR, 0, 0);
+            sendto(ranges[i].sockfd, error, errorLen + 1, 0, (struct sockaddr *)&ranges[i].serverTid, sizeof(ranges[i].serverTid));
+        }
+        close(ranges[i].sockfd);
+    }
+    if (!failed) {
+        double seconds = (nowUs() - startUs) / 1e6;
+        printf("File transfer completed: %lld bytes over %d sessions, %.2f MB/s.\n", tsize, count,
+               seconds > 0 ? tsize / seconds / 1e6 : 0.0);
+    }
+    printIgnored();
+    close(fd);
+}
+
+// Demande la taille (tsize) et la date du fichier par une requête d'une partie vide, puis
+// l'interrompt par une erreur dès l'OACK reçu. Retourne 0 si le serveur ignore l'une des
+// options : le fichier ne peut pas être lu par parties.
+int probeRanges(int sockfd, struct sockaddr_in *serverAddr, const char *filename, long long *tsize, long long *mtime) {
+    char request[BUFFER_SIZE];
+    char buffer[MAX_PACKET_SIZE];
+    int len = sprintf(request, "%c%c%s%c%s%c%s%c0%c%s%c0,0%c", 0, OP_RRQ, filename, 0, "octet", 0,
+                      OPTION_TSIZE, 0, 0, OPTION_RANGE, 0, 0);
+    long long start = nowUs() / 1000;
+    rttStart(&rtt, 0);
+
+    while (1) {
+        sendto(sockfd, request, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+        if (!waitReadable(sockfd, rttTimeoutMs(&rtt))) {
+            if (nowUs() / 1000 - start >= rttMaxMs(&rtt) * MAX_RETRIES) {
+                return 0;
             }
+            rttBackoff(&rtt);
+            continue;
+        }
+        struct sockaddr_in fromAddr;
+        socklen_t fromAddrLen = sizeof(fromAddr);
+        int recvLen = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (recvLen < 4) {
+            continue;
+        }
+        rttAcked(&rtt, 0);
+        // ERROR 8 : le serveur connaît l'option range mais ne peut pas servir ce fichier par
+        // parties ; il reste lisible d'une seule traite
+        if (buffer[1] == OP_ERROR && buffer[3] == 8) {
+            return 0;
+        }
+        if (buffer[1] == OP_ERROR) {
+            printf("Error packet received: %.*s\n", recvLen - 4, buffer + 4);
+            exit(EXIT_FAILURE);
+        }
+
+        // La session de la sonde est close dans tous les cas
+        char error[32];
+        int errorLen = sprintf(error, "%c%c%c%cSize probe only", 0, OP_ERROR, 0, 8);
+        sendto(sockfd, error, errorLen + 1, 0, (struct sockaddr *)&fromAddr, fromAddrLen);
+
+        const char *size = buffer[1] == OP_OACK ? oackValue(buffer, recvLen, OPTION_TSIZE) : NULL;
+        const char *range = buffer[1] == OP_OACK ? oackValue(buffer, recvLen, OPTION_RANGE) : NULL;
+        long long rangeStart, rangeLength;
+        return size && range && sscanf(size, "%lld", tsize) == 1 &&
+               sscanf(range, "%lld,%lld,%lld", &rangeStart, &rangeLength, mtime) == 3;
+    }
+}
+
+// Traite un paquet du serveur d'une session de téléchargement parallèle.
+// Retourne -1 si le transfert doit être abandonné, 1 sinon.
+int rangeDatagram(RangeSession *range, int fd, const char *packet, int len, long long mtime, unsigned long long *received) {
+    unsigned short opcode = packet[1];
+    unsigned short receivedBlock = ntohs(*(const unsigned short *)(packet + 2));
+
+    if (opcode == OP_ERROR) {
+        printf("Error packet received: %.*s\n", len - 4, packet + 4);
+        return -1;
+    }
+    if (opcode == OP_OACK && range->blockNum == 0) {
+        // La partie et la date renvoyées doivent être celles de la sonde : sinon le fichier a
+        // changé entre deux sessions et les parties ne s'assemblent pas
+        int requestedWindowsize = range->windowsize, ackedTimeout = 0, rollover = rolloverBase;
+        long long tsize, offset, fileMtime = 0, rangeStart = -1, rangeLength = -1;
+        const char *value = oackValue(packet, len, OPTION_RANGE);
+        range->blksize = DEFAULT_BLKSIZE;
+        range->windowsize = 1;
+        if (!parseOACK(packet, len, &range->blksize, &range->windowsize, &ackedTimeout, &rollover, &tsize, &offset, &fileMtime) ||
+            range->windowsize > requestedWindowsize ||
+            !value || sscanf(value, "%lld,%lld,%lld", &rangeStart, &rangeLength, &fileMtime) != 3) {
+            printf("Invalid OACK received.\n");
+            return -1;
+        }
+        if (rangeStart != range->start || rangeLength != range->length || fileMtime != mtime) {
+            printf("File changed on the server during the transfer, aborted.\n");
+            return -1;
+        }
+        rttAcked(&range->rtt, 0);
+        if (ackedTimeout != 0) {
+            rttInit(&range->rtt, ackedTimeout * 1000);
+        }
+        // Une fenêtre entière de chaque session doit tenir dans son tampon de réception
+        if (range->windowsize > 1) {
+            growReceiveBuffer(range->sockfd, range->windowsize * (range->blksize + 4) * 2);
+        }
+    } else if (opcode == OP_DATA && receivedBlock == wireBlockNum(range->blockNum + 1)) {
+        long long position = range->start + (long long)range->blockNum * range->blksize;
+        int dataLen = len - 4;
+        if (position + dataLen > range->start + range->length) {
+            printf("Server sent more than bytes %lld-%lld, aborted.\n", range->start, range->start + range->length);
+            return -1;
+        }
+        if (pwrite(fd, packet + 4, dataLen, position) != dataLen) {
+            perror("Failed to write file");
+            return -1;
+        }
+        range->blockNum++;
+        *received += dataLen;
+        rttAcked(&range->rtt, 0);
+        range->done = dataLen < range->blksize;
+        range->nakPending = 0;
+        range->lastProgress = nowUs() / 1000;
+        // Seul le dernier bloc de la fenêtre (ou le bloc final) est acquitté
+        if (++range->receivedInWindow < range->windowsize && !range->done) {
+            range->deadline = range->lastProgress + rttTimeoutMs(&range->rtt);
+            return 1;
+        }
+        range->receivedInWindow = 0;
+    } else if (opcode == OP_DATA && range->windowsize == 1 && range->blockNum > 0 && receivedBlock == wireBlockNum(range->blockNum)) {
+        // DATA en double : notre ACK s'est perdu, on le renvoie une fois par doublon
+        duplicatesIgnored++;
+        sendto(range->sockfd, range->packet, range->packetLen, 0, (struct sockaddr *)&range->serverTid, sizeof(range->serverTid));
+        return 1;
+    } else if (opcode == OP_DATA && range->windowsize > 1 && range->blockNum > 0 && !range->nakPending) {
+        // Bloc hors séquence : on acquitte une seule fois le dernier bloc reçu dans l'ordre
+        // pour que le serveur reprenne la fenêtre à partir de là
+        range->nakPending = 1;
+        range->receivedInWindow = 0;
+    } else {
+        return 1;
+    }
+
+    // ACK de l'OACK ou du bloc reçu, gardé pour être réémis au timeout
+    unsigned int ackNum = wireBlockNum(range->blockNum);
+    range->packetLen = 4;
+    range->packet[0] = 0; range->packet[1] = OP_ACK;
+    range->packet[2] = ackNum >> 8; range->packet[3] = ackNum & 0xFF;
+    sendto(range->sockfd, range->packet, range->packetLen, 0, (struct sockaddr *)&range->serverTid, sizeof(range->serverTid));
+    rttStart(&range->rtt, 0);
+    range->lastProgress = nowUs() / 1000;
+    range->deadline = range->lastProgress + rttTimeoutMs(&range->rtt);
+    return 1;
+}
+
+// Valeur d'une option dans un OACK, NULL si elle est absente
+const char* oackValue(const char *packet, int packetLen, const char *name) {
+    const char *end = packet + packetLen;
+    const char *option = packet + 2;
+    while (option < end) {
+        const char *value = memchr(option, 0, end - option);
+        if (!value || ++value >= end) {
+            return NULL;
+        }
+        const char *next = memchr(value, 0, end - value);
+        if (!next) {
+            return NULL;
+        }
+        if (strcasecmp(option, name) == 0) {
+            return value;
+        }
+        option = next + 1;
+    }
+    return NULL;
+}
+
+// Mode batch (option -b) : les lignes du manifeste sont transférées en mode octet, batchJobs
+// à la fois, chacune en lock-step sur sa propre socket, depuis une seule boucle poll. Chaque
+// fichier est affiché à la fin de son transfert avec sa latence, puis le bilan donne le débit
+// d'ensemble et les percentiles de latence.
+void runBatch(struct sockaddr_in *serverAddr) {
+    BatchEntry *entries;
+    int count = readManifest(batchManifest, &entries);
+    if (count < 0) {
+        exit(EXIT_FAILURE);
+    }
+    int jobs = batchJobs < count ? batchJobs : count;
+    BatchTransfer *transfers = calloc(jobs > 0 ? jobs : 1, sizeof(BatchTransfer));
+    struct pollfd *fds = calloc(jobs > 0 ? jobs : 1, sizeof(struct pollfd));
+    if (!transfers || !fds) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < jobs; i++) {
+        transfers[i].packet = malloc(batchBlksize + 4 > BUFFER_SIZE ? batchBlksize + 4 : BUFFER_SIZE);
+        if (!transfers[i].packet) {
+            perror("Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        transfers[i].sockfd = -1;
+    }
+
+    int next = 0;
+    int active = 0;
+    long long startUs = nowUs();
+    while (next < count || active > 0) {
+        // Les emplacements libres prennent les lignes suivantes du manifeste
+        for (int i = 0; i < jobs && next < count; i++) {
+            if (transfers[i].entry == NULL) {
+                if (batchStart(&transfers[i], &entries[next++], serverAddr)) {
+                    active++;
+                } else {
+                    i--; // Échec immédiat (fichier local absent) : l'emplacement reste libre
+                }
+            }
+        }
+        if (active == 0) {
+            continue;
+        }
+
+        long long now = nowUs() / 1000;
+        long long wait = MAX_RTO_MS;
+        for (int i = 0; i < jobs; i++) {
+            fds[i].fd = transfers[i].entry ? transfers[i].sockfd : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (transfers[i].entry && transfers[i].deadline - now < wait) {
+                wait = transfers[i].deadline - now;
+            }
+        }
+        poll(fds, jobs, wait > 0 ? (int)wait : 0);
+
+        now = nowUs() / 1000;
+        for (int i = 0; i < jobs; i++) {
+            BatchTransfer *transfer = &transfers[i];
+            if (!transfer->entry) {
+                continue;
+            }
+            if (fds[i].revents & POLLIN) {
+                char buffer[MAX_PACKET_SIZE];
+                struct sockaddr_in fromAddr;
+                socklen_t fromAddrLen = sizeof(fromAddr);
+                int recvLen = recvfrom(transfer->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+                if (recvLen < 4) {
+                    continue;
+                }
+                if (!transfer->hasTid && fromAddr.sin_addr.s_addr == serverAddr->sin_addr.s_addr) {
+                    transfer->serverTid = fromAddr;
+                    transfer->hasTid = 1;
+                } else if (!transfer->hasTid || !sameTid(&fromAddr, &transfer->serverTid)) {
+                    rejectUnknownTid(transfer->sockfd, &fromAddr, fromAddrLen);
+                    continue;
+                }
+                if (batchDatagram(transfer, buffer, recvLen) <= 0) {
+                    active--;
+                }
+            } else if (now >= transfer->deadline) {
+                if (now - transfer->lastProgress >= rttMaxMs(&transfer->rtt) * MAX_RETRIES) {
+                    batchFinish(transfer, -1, "timeout");
+                    active--;
+                    continue;
+                }
+                rttBackoff(&transfer->rtt);
+                struct sockaddr_in *to = transfer->hasTid ? &transfer->serverTid : serverAddr;
+                sendto(transfer->sockfd, transfer->packet, transfer->packetLen, 0, (struct sockaddr *)to, sizeof(*to));
+                transfer->deadline = now + rttTimeoutMs(&transfer->rtt);
+            }
+        }
+    }
+    long long elapsed = nowUs() - startUs;
+
+    // Bilan, dans la forme de bench
+    long long *latencies = malloc((count > 0 ? count : 1) * sizeof(long long));
+    unsigned long long bytes = 0;
+    int completed = 0;
+    for (int i = 0; i < count; i++) {
+        if (entries[i].status == 1) {
+            latencies[completed++] = entries[i].latencyUs;
+            bytes += entries[i].bytes;
+        }
+    }
+    qsort(latencies, completed, sizeof(long long), compareLongLong);
+    printf("completed: %d, failed: %d\n", completed, count - completed);
+    printf("elapsed: %.3f s\n", elapsed / 1e6);
+    printf("throughput: %.2f MB/s, %.1f transfers/s\n", bytes / (elapsed / 1e6) / 1e6, completed / (elapsed / 1e6));
+    if (completed > 0) {
+        printf("latency p50: %.2f ms, p99: %.2f ms, max: %.2f ms\n",
+               latencies[completed / 2] / 1e3, latencies[(completed * 99) / 100] / 1e3, latencies[completed - 1] / 1e3);
+    }
+    printIgnored();
+
+    for (int i = 0; i < jobs; i++) {
+        free(transfers[i].packet);
+    }
+    free(latencies);
+    free(transfers);
+    free(fds);
+    free(entries);
+}
+
+// Lit le manifeste : une opération par ligne, "get distant [local]" ou "put local [distant]",
+// les lignes vides et celles qui commencent par # étant ignorées. Sans second nom, le même
+// nom sert des deux côtés. Retourne le nombre de lignes, ou -1 si le manifeste est invalide.
+int readManifest(const char *path, BatchEntry **entries) {
+    FILE *manifest = fopen(path, "r");
+    if (!manifest) {
+        perror("Cannot open manifest");
+        return -1;
+    }
+
+    int count = 0, capacity = 0, lineNum = 0;
+    char line[512];
+    *entries = NULL;
+    while (fgets(line, sizeof(line), manifest)) {
+        char op[8], first[256], second[256];
+        lineNum++;
+        int fields = sscanf(line, "%7s %255s %255s", op, first, second);
+        if (fields <= 0 || op[0] == '#') {
+            continue;
+        }
+        int put = strcmp(op, "put") == 0;
+        if ((!put && strcmp(op, "get") != 0) || fields < 2) {
+            fprintf(stderr, "%s:%d: expected \"get remote [local]\" or \"put local [remote]\"\n", path, lineNum);
+            fclose(manifest);
+            free(*entries);
+            return -1;
+        }
+        const char *remote = put && fields == 3 ? second : first;
+        const char *local = !put && fields == 3 ? second : first;
+        if (strlen(remote) >= sizeof((*entries)->remote)) {
+            fprintf(stderr, "%s:%d: remote name too long\n", path, lineNum);
+            fclose(manifest);
+            free(*entries);
+            return -1;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            BatchEntry *grown = realloc(*entries, capacity * sizeof(BatchEntry));
+            if (!grown) {
+                perror("Out of memory");
+                fclose(manifest);
+                free(*entries);
+                return -1;
+            }
+            *entries = grown;
+        }
+        BatchEntry *entry = &(*entries)[count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->put = put;
+        strcpy(entry->remote, remote);
+        strcpy(entry->local, local);
+    }
+    fclose(manifest);
+    return count;
+}
+
+// Ouvre le fichier local et la socket d'un transfert, puis envoie sa requête avec blksize
+// et tsize. Retourne 0 si le transfert échoue avant d'avoir commencé.
+int batchStart(BatchTransfer *transfer, BatchEntry *entry, struct sockaddr_in *serverAddr) {
+    char *packet = transfer->packet;
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->packet = packet;
+    transfer->entry = entry;
+    transfer->blksize = DEFAULT_BLKSIZE;
+    transfer->startUs = nowUs();
+    transfer->sockfd = -1;
+
+    struct stat st;
+    transfer->fd = entry->put ? open(entry->local, O_RDONLY) : open(entry->local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (transfer->fd < 0 || (entry->put && fstat(transfer->fd, &st) < 0)) {
+        batchFinish(transfer, -1, strerror(errno));
+        return 0;
+    }
+    transfer->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (transfer->sockfd < 0) {
+        batchFinish(transfer, -1, strerror(errno));
+        return 0;
+    }
+
+    int len = sprintf(packet, "%c%c%s%c%s%c", 0, entry->put ? OP_WRQ : OP_RRQ, entry->remote, 0, "octet", 0);
+    if (sendRollover) {
+        len += sprintf(packet + len, "%s%c%d%c", OPTION_ROLLOVER, 0, rolloverBase, 0);
+    }
+    if (batchBlksize != DEFAULT_BLKSIZE) {
+        len += sprintf(packet + len, "%s%c%d%c", OPTION_BLKSIZE, 0, batchBlksize, 0); // RFC 2348
+    }
+    len += sprintf(packet + len, "%s%c%lld%c", OPTION_TSIZE, 0, entry->put ? (long long)st.st_size : 0LL, 0); // RFC 2349
+    transfer->packetLen = len;
+    sendto(transfer->sockfd, packet, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+
+    rttInit(&transfer->rtt, 0);
+    rttStart(&transfer->rtt, 0);
+    transfer->lastProgress = nowUs() / 1000;
+    transfer->deadline = transfer->lastProgress + rttTimeoutMs(&transfer->rtt);
+    return 1;
+}
+
+// Traite un paquet du serveur. Retourne 1 si le transfert continue, 0 s'il est terminé,
+// -1 s'il a échoué.
+int batchDatagram(BatchTransfer *transfer, const char *packet, int len) {
+    BatchEntry *entry = transfer->entry;
+    unsigned short opcode = packet[1];
+    unsigned short blockNum = ntohs(*(const unsigned short *)(packet + 2));
+
+    if (opcode == OP_ERROR) {
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "server error: %.*s", len - 4 > 0 ? len - 4 : 0, packet + 4);
+        batchFinish(transfer, -1, message);
+        return -1;
+    }
+
+    // Première réponse : OACK, ou ACK 0 / DATA 1 d'un serveur qui ignore les options
+    if (!transfer->answered && (opcode == OP_OACK || (entry->put && opcode == OP_ACK && blockNum == 0) ||
+                                (!entry->put && opcode == OP_DATA && blockNum == 1))) {
+        transfer->answered = 1;
+        rttAcked(&transfer->rtt, 0);
+        if (opcode == OP_OACK) {
+            int windowsize = 1, timeout = 0, rollover = rolloverBase;
+            long long tsize = -1, offset, mtime;
+            if (!parseOACK(packet, len, &transfer->blksize, &windowsize, &timeout, &rollover, &tsize, &offset, &mtime) ||
+                transfer->blksize > batchBlksize) {
+                batchFinish(transfer, -1, "invalid OACK");
+                return -1;
+            }
+            if (!entry->put && tsize > 0 && !reserveSpace(transfer->fd, tsize)) {
+                batchFinish(transfer, -1, "not enough disk space");
+                return -1;
+            }
+        }
+        if (entry->put) {
+            return batchSendBlock(transfer);
+        }
+        if (opcode == OP_OACK) {
+            transfer->packetLen = 4;
+            transfer->packet[0] = 0; transfer->packet[1] = OP_ACK;
+            transfer->packet[2] = 0; transfer->packet[3] = 0;
+            sendto(transfer->sockfd, transfer->packet, 4, 0, (struct sockaddr *)&transfer->serverTid, sizeof(transfer->serverTid));
+            rttStart(&transfer->rtt, 0);
+            transfer->deadline = nowUs() / 1000 + rttTimeoutMs(&transfer->rtt);
+            return 1;
+        }
+    }
+    if (!transfer->answered) {
+        return 1;
+    }
+
+    if (entry->put) {
+        if (opcode != OP_ACK || blockNum != wireBlockNum(transfer->blockNum)) {
+            duplicatesIgnored += opcode == OP_ACK; // ACK en double : seul le timer réémet
+            return 1;
+        }
+        rttAcked(&transfer->rtt, 0);
+        if (transfer->finalSent) {
+            batchFinish(transfer, 1, NULL);
+            return 0;
+        }
+        return batchSendBlock(transfer);
+    }
+
+    if (opcode == OP_DATA && blockNum == wireBlockNum(transfer->blockNum + 1)) {
+        int dataLen = len - 4;
+        if (pwrite(transfer->fd, packet + 4, dataLen, (off_t)transfer->blockNum * transfer->blksize) != dataLen) {
+            batchFinish(transfer, -1, strerror(errno));
+            return -1;
+        }
+        transfer->blockNum++;
+        entry->bytes += dataLen;
+        rttAcked(&transfer->rtt, 0);
+        unsigned int ackNum = wireBlockNum(transfer->blockNum);
+        transfer->packetLen = 4;
+        transfer->packet[0] = 0; transfer->packet[1] = OP_ACK;
+        transfer->packet[2] = ackNum >> 8; transfer->packet[3] = ackNum & 0xFF;
+        sendto(transfer->sockfd, transfer->packet, 4, 0, (struct sockaddr *)&transfer->serverTid, sizeof(transfer->serverTid));
+        if (dataLen < transfer->blksize) {
+            batchFinish(transfer, 1, NULL);
+            return 0;
         }
+        rttStart(&transfer->rtt, 0);
+        transfer->lastProgress = nowUs() / 1000;
+        transfer->deadline = transfer->lastProgress + rttTimeoutMs(&transfer->rtt);
+    } else if (opcode == OP_DATA && transfer->blockNum > 0 && blockNum == wireBlockNum(transfer->blockNum)) {
+        // DATA en double : notre ACK s'est perdu, on le renvoie une fois par doublon
+        duplicatesIgnored++;
+        sendto(transfer->sockfd, transfer->packet, transfer->packetLen, 0, (struct sockaddr *)&transfer->serverTid, sizeof(transfer->serverTid));
     }
-    return 0;  // Timeout ou ACK incorrect
+    return 1;
 }
 
+// put : lit et envoie le bloc qui suit le dernier acquitté. Retourne -1 sur une erreur de lecture.
+int batchSendBlock(BatchTransfer *transfer) {
+    ssize_t bytesRead = pread(transfer->fd, transfer->packet + 4, transfer->blksize, (off_t)transfer->blockNum * transfer->blksize);
+    if (bytesRead < 0) {
+        batchFinish(transfer, -1, strerror(errno));
+        return -1;
+    }
+    transfer->blockNum++;
+    unsigned int wireNum = wireBlockNum(transfer->blockNum);
+    transfer->packet[0] = 0; transfer->packet[1] = OP_DATA;
+    transfer->packet[2] = wireNum >> 8; transfer->packet[3] = wireNum & 0xFF;
+    transfer->packetLen = bytesRead + 4;
+    transfer->finalSent = bytesRead < transfer->blksize;
+    transfer->entry->bytes += bytesRead;
+    sendto(transfer->sockfd, transfer->packet, transfer->packetLen, 0, (struct sockaddr *)&transfer->serverTid, sizeof(transfer->serverTid));
+    rttStart(&transfer->rtt, 0);
+    transfer->lastProgress = nowUs() / 1000;
+    transfer->deadline = transfer->lastProgress + rttTimeoutMs(&transfer->rtt);
+    return 1;
+}
+
+// Fin d'un transfert : une ligne par fichier avec sa latence, puis l'emplacement est libéré
+void batchFinish(BatchTransfer *transfer, int status, const char *message) {
+    BatchEntry *entry = transfer->entry;
+    entry->status = status;
+    entry->latencyUs = nowUs() - transfer->startUs;
+    if (status == 1) {
+        printf("%s %s: %llu bytes, %.2f ms\n", entry->put ? "put" : "get", entry->remote, entry->bytes, entry->latencyUs / 1e3);
+    } else {
+        if (transfer->hasTid) {
+            char error[32];
+            int errorLen = sprintf(error, "%c%c%c%cTransfer aborted", 0, OP_ERROR, 0, 0);
+            sendto(transfer->sockfd, error, errorLen + 1, 0, (struct sockaddr *)&transfer->serverTid, sizeof(transfer->serverTid));
+        }
+        printf("%s %s: failed, %s\n", entry->put ? "put" : "get", entry->remote, message);
+    }
+    if (transfer->sockfd >= 0) {
+        close(transfer->sockfd);
+    }
+    if (transfer->fd >= 0) {
+        close(transfer->fd);
+    }
+    transfer->sockfd = -1;
+    transfer->fd = -1;
+    transfer->entry = NULL;
+}
+
+int compareLongLong(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Lecture multicast (RFC 2090). Le serveur diffuse chaque bloc une seule fois au groupe annoncé
+// dans son OACK ; seul le client maître (mc=1) acquitte, toujours le dernier bloc de sa partie
+// contiguë. Les autres gardent les blocs qui passent et, s'ils sont arrivés en cours de route,
+// attendent d'être désignés maîtres pour réclamer ceux du début. Un serveur qui ignore l'option
+// répond directement en unicast : le client est alors son propre maître, en lock-step.
+void receiveMulticast(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode) {
+    char buffer[BUFFER_SIZE + 1]; // Un DATA complet et le zéro final ajouté pour ERROR et OACK
+    char request[BUFFER_SIZE];
+    char ack[4] = {0, OP_ACK, 0, 0};
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrLen;
+    struct sockaddr_in serverTid;
+    int hasTid = 0;
+    int master = 0;
+    int groupfd = -1;
+    unsigned char *received = calloc(MAX_MULTICAST_BLOCKS + 1, 1); // Blocs déjà écrits
+    unsigned long contiguous = 0; // Tous les blocs jusqu'à celui-ci sont écrits
+    unsigned long lastBlock = 0;  // Bloc court final, 0 tant qu'il n'est pas reçu
+    unsigned long long bytes = 0;
+    long long lastProgress = nowUs() / 1000;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !received) {
+        perror("Failed to open file for writing");
+        exit(EXIT_FAILURE);
+    }
+
+    int len = sprintf(request, "%c%c%s%c%s%c%s%c%c", 0, OP_RRQ, filename, 0, mode, 0, OPTION_MULTICAST, 0, 0);
+    sendto(sockfd, request, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+    rttStart(&rtt, 0);
+
+    while (1) {
+        fd_set readfds;
+        struct timeval tv;
+        long long timeoutMs = rttTimeoutMs(&rtt);
+        FD_ZERO(&readfds);
+        FD_SET(sockfd, &readfds);
+        if (groupfd >= 0) {
+            FD_SET(groupfd, &readfds);
+        }
+        tv.tv_sec = timeoutMs / 1000;
+        tv.tv_usec = (timeoutMs % 1000) * 1000;
+        if (select((groupfd > sockfd ? groupfd : sockfd) + 1, &readfds, NULL, NULL, &tv) <= 0) {
+            if (nowUs() / 1000 - lastProgress >= MULTICAST_IDLE_MS) {
+                printf("Timeout: no data from server, transfer aborted.\n");
+                break;
+            }
+            // Sans réponse on réémet la requête ; le maître réémet son ACK
+            rttBackoff(&rtt);
+            if (!hasTid) {
+                sendto(sockfd, request, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+            } else if (master) {
+                sendto(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&serverTid, sizeof(serverTid));
+            }
+            continue;
+        }
+
+        int fromGroup = groupfd >= 0 && FD_ISSET(groupfd, &readfds);
+        fromAddrLen = sizeof(fromAddr);
+        int recvLen = recvfrom(fromGroup ? groupfd : sockfd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (recvLen < 4) {
+            continue;
+        }
+        buffer[recvLen] = '\0';
+        if (!hasTid && !fromGroup) {
+            serverTid = fromAddr;
+            hasTid = 1;
+        } else if (!hasTid || !sameTid(&fromAddr, &serverTid)) {
+            // Le groupe peut porter la diffusion d'un autre serveur : on l'écoute sans répondre
+            if (fromGroup) {
+                strangersRejected++;
+            } else {
+                rejectUnknownTid(sockfd, &fromAddr, fromAddrLen);
+            }
+            continue;
+        }
+
+        unsigned short opcode = buffer[1];
+        if (opcode == OP_ERROR) {
+            printf("Error packet received: %s\n", buffer + 4);
+            break;
+        }
+        if (opcode == OP_OACK) {
+            // Premier OACK : on rejoint le groupe ; les suivants nous désignent maître
+            int wasMaster = master;
+            const char *value = buffer + 2 + strlen(buffer + 2) + 1;
+            if (strcasecmp(buffer + 2, OPTION_MULTICAST) != 0 || value >= buffer + recvLen) {
+                printf("Invalid OACK received.\n");
+                break;
+            }
+            if (groupfd < 0) {
+                groupfd = joinGroup(serverAddr, value, &master);
+                if (groupfd < 0) {
+                    break;
+                }
+            } else {
+                joinGroup(NULL, value, &master);
+            }
+            rttAcked(&rtt, 0);
+            lastProgress = nowUs() / 1000;
+            if (master) {
+                if (!wasMaster) {
+                    printf("Master client from block %lu.\n", contiguous + 1);
+                }
+                ack[2] = contiguous >> 8; ack[3] = contiguous & 0xFF;
+                sendto(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&serverTid, sizeof(serverTid));
+                rttStart(&rtt, 0);
+            }
+            continue;
+        }
+        if (opcode != OP_DATA) {
+            continue;
+        }
+        if (!fromGroup && groupfd < 0) {
+            master = 1; // Réponse unicast : le serveur n'a pas accepté l'option
+        }
+
+        unsigned long block = ntohs(*(unsigned short *)(buffer + 2));
+        if (block == 0 || (lastBlock != 0 && block > lastBlock)) {
+            continue;
+        }
+        if (received[block]) {
+            duplicatesIgnored++;
+        } else {
+            if (pwrite(fd, buffer + 4, recvLen - 4, (off_t)(block - 1) * DEFAULT_BLKSIZE) != recvLen - 4) {
+                perror("Failed to write file");
+                break;
+            }
+            received[block] = 1;
+            bytes += recvLen - 4;
+            if (recvLen - 4 < DEFAULT_BLKSIZE) {
+                lastBlock = block;
+            }
+            while (contiguous < MAX_MULTICAST_BLOCKS && received[contiguous + 1]) {
+                contiguous++;
+            }
+            lastProgress = nowUs() / 1000;
+        }
+        if (contiguous == MAX_MULTICAST_BLOCKS && lastBlock == 0) {
+            printf("File larger than %d blocks, read it without -m.\n", MAX_MULTICAST_BLOCKS);
+            break;
+        }
+
+        // Le maître acquitte sa partie contiguë, doublons compris (son ACK a pu se perdre) ;
+        // tout client complet envoie l'ACK final pour quitter la session
+        int complete = lastBlock != 0 && contiguous == lastBlock;
+        if (master || complete) {
+            rttAcked(&rtt, 0);
+            ack[2] = contiguous >> 8; ack[3] = contiguous & 0xFF;
+            sendto(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&serverTid, sizeof(serverTid));
+            rttStart(&rtt, 0);
+        }
+        if (complete) {
+            printf("File transfer completed: %llu bytes.\n", bytes);
+            break;
+        }
+    }
+
+    printIgnored();
+    if (groupfd >= 0) {
+        close(groupfd);
+    }
+    free(received);
+    close(fd);
+}
+
+// Lit la valeur "adresse,port,mc" d'un OACK multicast. Avec serverAddr, ouvre aussi une socket
+// liée au port du groupe et inscrite au groupe sur l'interface qui mène au serveur, celle par
+// laquelle il diffuse. Retourne cette socket, ou -1 en cas d'échec.
+int joinGroup(struct sockaddr_in *serverAddr, const char *groupSpec, int *master) {
+    char address[INET_ADDRSTRLEN];
+    int port, mc;
+    struct ip_mreq mreq;
+    if (sscanf(groupSpec, "%15[^,],%d,%d", address, &port, &mc) != 3 ||
+        inet_pton(AF_INET, address, &mreq.imr_multiaddr) != 1 || port <= 0 || port > 65535) {
+        printf("Invalid multicast group \"%s\".\n", groupSpec);
+        return -1;
+    }
+    *master = mc == 1;
+    if (!serverAddr) {
+        return 0;
+    }
+
+    // Adresse locale vers le serveur : une socket connectée la fait choisir par le noyau
+    struct sockaddr_in local;
+    socklen_t localLen = sizeof(local);
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe < 0 || connect(probe, (struct sockaddr *)serverAddr, sizeof(*serverAddr)) != 0 ||
+        getsockname(probe, (struct sockaddr *)&local, &localLen) != 0) {
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
+    mreq.imr_interface = local.sin_addr;
+
+    // Plusieurs clients de la même machine écoutent le même port de groupe
+    int groupfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int reuse = 1;
+    struct sockaddr_in groupAddr;
+    memset(&groupAddr, 0, sizeof(groupAddr));
+    groupAddr.sin_family = AF_INET;
+    groupAddr.sin_port = htons(port);
+    groupAddr.sin_addr = mreq.imr_multiaddr;
+    if (groupfd < 0 || setsockopt(groupfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(groupfd, (struct sockaddr *)&groupAddr, sizeof(groupAddr)) != 0 ||
+        setsockopt(groupfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+        perror("Cannot join multicast group");
+        if (groupfd >= 0) {
+            close(groupfd);
+        }
+        return -1;
+    }
+    return groupfd;
+}
+
+// Attend l'ACK d'un bloc jusqu'à l'expiration du délai de retransmission. Un ACK en double
+// ou un paquet d'un autre TID est ignoré sans écourter l'attente : réémettre le DATA à chaque
+// doublon ferait doubler le trafic à chaque perte (syndrome de l'apprenti sorcier).
+// Retourne 1 si l'ACK est reçu, 0 à l'expiration du délai, -1 sur un paquet ERROR.
+int waitForAck(int sockfd, struct sockaddr_in *serverAddr, unsigned int expectedBlockNum) {
+    char ackBuffer[BUFFER_SIZE];
+    long long deadline = nowUs() / 1000 + rttTimeoutMs(&rtt);
+
+    while (1) {
+        long long remaining = deadline - nowUs() / 1000;
+        if (remaining <= 0 || !waitReadable(sockfd, remaining)) {
+            return 0;
+        }
+        struct sockaddr_in fromAddr;
+        socklen_t fromAddrLen = sizeof(fromAddr);
+        int recvLen = recvfrom(sockfd, ackBuffer, sizeof(ackBuffer) - 1, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        if (recvLen < 4) {
+            continue;
+        }
+        if (!sameTid(&fromAddr, serverAddr)) {
+            rejectUnknownTid(sockfd, &fromAddr, fromAddrLen);
+            continue;
+        }
+        if (ackBuffer[1] == OP_ERROR) {
+            ackBuffer[recvLen] = '\0';
+            printf("Error packet received: %s\n", ackBuffer + 4);
+            return -1;
+        }
+        if (ackBuffer[1] == OP_ACK) {
+            unsigned int blockNum = ((unsigned char)ackBuffer[2] << 8) | (unsigned char)ackBuffer[3];
+            if (blockNum == expectedBlockNum) {
+                return 1;  // ACK correct reçu
+            }
+            duplicatesIgnored++;
+        }
+    }
+}
+
+// Les réémissions s'espacent (backoff) ; abandon après MAX_RETRIES délais maximaux sans ACK
 int sendWithRetries(int sockfd, struct sockaddr_in *serverAddr, char *packet, int packetLen, unsigned int expectedBlockNum) {
-    int retries = 0;
-    while (retries < MAX_RETRIES) {
+    long long start = nowUs() / 1000;
+    rttCancel(&rtt);
+    rttStart(&rtt, expectedBlockNum);
+    while (1) {
         sendto(sockfd, packet, packetLen, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
-        if (waitForAck(sockfd, serverAddr, expectedBlockNum)) {
+        int acked = waitForAck(sockfd, serverAddr, expectedBlockNum);
+        if (acked > 0) {
+            rttAcked(&rtt, expectedBlockNum);
             return 1;  // ACK reçu
         }
-        retries++;
+        if (acked < 0 || nowUs() / 1000 - start >= rttMaxMs(&rtt) * MAX_RETRIES) {
+            return 0;  // Échec après les tentatives
+        }
+        rttBackoff(&rtt);
     }
-    return 0;  // Échec après les tentatives
 }
 
-void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize) {
+void sendFile(int sockfd, struct sockaddr_in *serverAddr, const char *filename, const char *mode, int blksize, int timeout) {
     FILE *file = fopen(filename, "rb");
     if (!file) {
         perror("Could not open file for reading");
         exit(EXIT_FAILURE);
     }
 
-    // Envoi de la requête WRQ avec l'option bigfile si nécessaire
-    char buffer[BUFFER_SIZE];
-    int len = sprintf(buffer, "%c%c%s%c%s%c%s%c%d%c", 0, OP_WRQ, filename, 0, mode, 0, OPTION_BIGFILE, 0, 1, 0);
-    sendto(sockfd, buffer, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+    // Envoi de la requête WRQ et de ses options
+    char buffer[MAX_PACKET_SIZE];
+    int len = sprintf(buffer, "%c%c%s%c%s%c", 0, OP_WRQ, filename, 0, mode, 0);
+    if (sendRollover) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_ROLLOVER, 0, rolloverBase, 0);
+    }
+    if (blksize != DEFAULT_BLKSIZE) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_BLKSIZE, 0, blksize, 0); // RFC 2348
+    }
+    if (timeout != 0) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_TIMEOUT, 0, timeout, 0); // RFC 2349
+    }
+    // La taille annoncée permet au serveur de réserver le fichier ou de le refuser d'emblée
+    long long tsize = -1;
+    struct stat st;
+    if (strcasecmp(mode, "octet") == 0 && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+        tsize = st.st_size;
+        len += sprintf(buffer + len, "%s%c%lld%c", OPTION_TSIZE, 0, tsize, 0); // RFC 2349
+        // Reprise : le serveur garde la partie reçue d'une source de même date et répond par
+        // la position où reprendre
+        if (resumeRequested) {
+            len += sprintf(buffer + len, "%s%c0,%lld%c", OPTION_OFFSET, 0, (long long)st.st_mtime, 0);
+        }
+    }
 
     // Attente de l'ACK pour la requête WRQ ou de l'OACK
-    if (!waitForAck(sockfd, serverAddr, 0)) {
+    int requestedBlksize = blksize;
+    int ackedTimeout = 0;
+    long long offset = -1;
+    long long mtime = 0;
+    int answered = 0;
+    long long start = nowUs() / 1000;
+    rttStart(&rtt, 0);
+    while (1) {
+        sendto(sockfd, buffer, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+        answered = waitForWRQResponse(sockfd, serverAddr, &blksize, &ackedTimeout, &offset, &mtime);
+        if (answered != 0 || nowUs() / 1000 - start >= rttMaxMs(&rtt) * MAX_RETRIES) {
+            break;
+        }
+        rttBackoff(&rtt);
+    }
+    if (answered == 0) {
         printf("Timeout or no ACK for WRQ.\n");
         fclose(file);
         return;
     }
+    if (answered < 0) {
+        fclose(file); // Erreur du serveur ou OACK illisible : la session est déjà close
+        return;
+    }
+    rttAcked(&rtt, 0);
+    if (ackedTimeout != 0) {
+        rttInit(&rtt, ackedTimeout * 1000);
+    }
+    // Une réponse que l'on ne peut pas suivre laisse le serveur attendre le bloc 1 : on la
+    // refuse explicitement (RFC 2347 : erreur 8), serverAddr désignant désormais son TID
+    const char *refused = NULL;
+    if (blksize > requestedBlksize) {
+        refused = "Server raised blksize";
+    } else if (ackedTimeout != 0 && ackedTimeout != timeout) {
+        refused = "Server changed timeout";
+    } else if (offset >= 0 && (tsize < 0 || !resumeRequested)) {
+        refused = "Server sent an unrequested offset";
+    } else if (offset > tsize) {
+        refused = "Server resume offset beyond end of file";
+    }
+    if (refused) {
+        rejectOptions(sockfd, serverAddr, refused);
+        fclose(file);
+        return;
+    }
+    if (offset > 0) {
+        if (fseeko(file, offset, SEEK_SET) < 0) {
+            perror("Cannot seek to resume position");
+            fclose(file);
+            return;
+        }
+        printf("Resuming at byte %lld.\n", offset);
+    }
 
-    // Envoi du fichier en blocs
-    unsigned int blockNum = 1;
+    // Envoi du fichier en blocs ; un bloc plus court que blksize (éventuellement vide) termine le transfert
+    unsigned long blockNum = 1; // Compté sans roll-over, seul le paquet porte le numéro sur 16 bits
+    unsigned long long sent = offset > 0 ? offset : 0;
     size_t bytesRead;
-    while ((bytesRead = fread(buffer + 4, 1, blksize, file)) > 0) {
+    do {
+        unsigned int wireNum = wireBlockNum(blockNum);
+        bytesRead = fread(buffer + 4, 1, blksize, file);
         buffer[0] = 0; buffer[1] = OP_DATA;
-        buffer[2] = (blockNum >> 8) & 0xFF; buffer[3] = blockNum & 0xFF;
+        buffer[2] = (wireNum >> 8) & 0xFF; buffer[3] = wireNum & 0xFF;
 
-        if (!sendWithRetries(sockfd, serverAddr, buffer, bytesRead + 4, blockNum)) {
-            printf("Failed to send block %u.\n", blockNum);
+        if (!sendWithRetries(sockfd, serverAddr, buffer, bytesRead + 4, wireNum)) {
+            printf("Failed to send block %lu.\n", blockNum);
             break;
         }
 
-        blockNum = (blockNum + 1) % 65536; // Gestion du roll-over de numéro de bloc
-    }
+        blockNum++;
+        sent += bytesRead;
+        reportProgress(sent, tsize);
+    } while (bytesRead == (size_t)blksize);
 
+    printIgnored();
     fclose(file);
 }
 
+// Attend la réponse à un WRQ : un ACK du bloc 0 (options ignorées, blocs de 512 octets)
+// ou un OACK dont on retient la taille de bloc acceptée par le serveur. Retourne 1 si le
+// serveur a répondu, 0 sans réponse, -1 si le serveur a clos la session par une erreur ou si
+// son OACK illisible a été refusé.
+int waitForWRQResponse(int sockfd, struct sockaddr_in *serverAddr, int *blksize, int *timeout, long long *offset, long long *mtime) {
+    char buffer[BUFFER_SIZE];
+    int windowsize = 1; // Le WRQ n'est pas fenêtré
+    long long tsize;    // Écho de la taille annoncée
+
+    if (waitReadable(sockfd, rttTimeoutMs(&rtt))) {
+        socklen_t addrLen = sizeof(struct sockaddr_in);
+        int recvLen = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)serverAddr, &addrLen);
+        if (recvLen >= 4 && buffer[1] == OP_ACK && buffer[2] == 0 && buffer[3] == 0) {
+            *blksize = DEFAULT_BLKSIZE;
+            return 1;
+        }
+        if (recvLen >= 2 && buffer[1] == OP_OACK) {
+            *blksize = DEFAULT_BLKSIZE;
+            if (!parseOACK(buffer, recvLen, blksize, &windowsize, timeout, &rolloverBase, &tsize, offset, mtime)) {
+                rejectOptions(sockfd, serverAddr, "Invalid OACK received");
+                return -1;
+            }
+            return 1;
+        }
+        if (recvLen >= 4 && buffer[1] == OP_ERROR) {
+            printf("Error packet received: %.*s\n", recvLen - 4, buffer + 4);
+            return -1;
+        }
+    }
+    return 0;  // Timeout ou réponse incorrecte
+}
+
+// Extrait les options acceptées d'un paquet OACK. Retourne 0 si une valeur est invalide.
+int parseOACK(const char *packet, int packetLen, int *blksize, int *windowsize, int *timeout, int *rollover, long long *tsize, long long *offset, long long *mtime) {
+    const char *end = packet + packetLen;
+    const char *name = packet + 2;
+
+    while (name < end) {
+        const char *value = memchr(name, 0, end - name);
+        if (!value || ++value >= end) {
+            break;
+        }
+        const char *next = memchr(value, 0, end - value);
+        if (!next) {
+            break;
+        }
+
+        if (strcasecmp(name, OPTION_BLKSIZE) == 0) {
+            int acked = atoi(value);
+            if (acked < MIN_BLKSIZE || acked > MAX_BLKSIZE) {
+                return 0;
+            }
+            *blksize = acked;
+        } else if (strcasecmp(name, OPTION_WINDOWSIZE) == 0) {
+            int acked = atoi(value);
+            if (acked < 1 || acked > MAX_WINDOWSIZE) {
+                return 0;
+            }
+            *windowsize = acked;
+        } else if (strcasecmp(name, OPTION_TIMEOUT) == 0) {
+            int acked = atoi(value);
+            if (acked < MIN_TIMEOUT_OPTION || acked > MAX_TIMEOUT_OPTION) {
+                return 0;
+            }
+            *timeout = acked;
+        } else if (strcasecmp(name, OPTION_ROLLOVER) == 0) {
+            if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                return 0;
+            }
+            *rollover = value[0] - '0';
+        } else if (strcasecmp(name, OPTION_TSIZE) == 0) {
+            char *endptr;
+            long long acked = strtoll(value, &endptr, 10);
+            if (*value == '\0' || *endptr != '\0' || acked < 0) {
+                return 0;
+            }
+            *tsize = acked;
+        } else if (strcasecmp(name, OPTION_OFFSET) == 0) {
+            // "octets,mtime" : position de reprise et date du fichier côté serveur
+            char *endptr;
+            long long acked = strtoll(value, &endptr, 10);
+            if (*value == '\0' || *endptr != ',' || acked < 0) {
+                return 0;
+            }
+            *mtime = strtoll(endptr + 1, &endptr, 10);
+            if (*endptr != '\0') {
+                return 0;
+            }
+            *offset = acked;
+        }
+
+        name = next + 1;
+    }
+    return 1;
+}
+
+// Réserve size octets pour le fichier reçu. FALLOC_FL_KEEP_SIZE laisse la taille du fichier
+// suivre les écritures : un transfert interrompu ne laisse pas de zéros en fin de fichier.
+// Sans fallocate, on vérifie seulement la place libre. Retourne 0 si la place manque.
+int reserveSpace(int fd, long long size) {
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+        return 1;
+    }
+    if (errno == ENOSPC || errno == EFBIG) {
+        return 0;
+    }
+    struct statvfs vfs;
+    return fstatvfs(fd, &vfs) != 0 || (unsigned long long)vfs.f_bavail * vfs.f_frsize >= (unsigned long long)size;
+}
+
+// Affiche l'avancement, par pas de 1 %, quand la taille totale est connue
+void reportProgress(unsigned long long done, long long total) {
+    static int lastPercent = -1;
+    if (total <= 0) {
+        return;
+    }
+    int percent = done >= (unsigned long long)total ? 100 : (int)(done * 100 / total);
+    if (percent != lastPercent) {
+        lastPercent = percent;
+        printf("\r%llu / %lld bytes (%d%%)%s", done, total, percent, percent == 100 ? "\n" : "");
+        fflush(stdout);
+    }
+}
+
+// Numéro de bloc sur 16 bits d'un bloc absolu : après 65535 on repart à rolloverBase
+unsigned int wireBlockNum(unsigned long block) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rolloverBase ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
+}
+
+// Vrai si deux adresses désignent la même extrémité (adresse IP et port), le TID de la RFC 1350
+int sameTid(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Réponse à un paquet étranger au transfert (RFC 1350 : erreur 5, sans interrompre le transfert)
+void rejectUnknownTid(int sockfd, struct sockaddr_in *fromAddr, socklen_t fromAddrLen) {
+    char buffer[32];
+    int len = sprintf(buffer, "%c%c%c%cUnknown transfer ID", 0, OP_ERROR, 0, 5);
+    sendto(sockfd, buffer, len + 1, 0, (struct sockaddr *)fromAddr, fromAddrLen);
+    strangersRejected++;
+}
+
+// Refus des options confirmées par le serveur (RFC 2347 : erreur 8), qui clôt sa session
+void rejectOptions(int sockfd, struct sockaddr_in *serverTid, const char *reason) {
+    char buffer[BUFFER_SIZE];
+    int len = sprintf(buffer, "%c%c%c%c%s", 0, OP_ERROR, 0, 8, reason);
+    sendto(sockfd, buffer, len + 1, 0, (struct sockaddr *)serverTid, sizeof(*serverTid));
+    printf("%s, transfer aborted.\n", reason);
+}
+
+void printIgnored(void) {
+    if (duplicatesIgnored > 0 || strangersRejected > 0) {
+        printf("%lu duplicate packets ignored, %lu packets from unknown TIDs rejected\n", duplicatesIgnored, strangersRejected);
+    }
+}
+
+// Agrandit le tampon de réception de la socket à size octets au moins. Il n'est jamais
+// réduit : pour de petits blocs, le tampon par défaut contient déjà bien plus qu'une fenêtre,
+// et le noyau ramènerait une petite valeur à son minimum de quelques Ko.
+void growReceiveBuffer(int sockfd, int size) {
+    int current = 0;
+    socklen_t optLen = sizeof(current);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &current, &optLen) == 0 && current >= size) {
+        return;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+// Attend qu'un paquet soit lisible sur la socket. Retourne 0 à l'expiration du délai.
+int waitReadable(int sockfd, long long timeoutMs) {
+    struct timeval tv;
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sockfd, &readfds);
 
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    return select(sockfd + 1, &readfds, NULL, NULL, &tv) > 0;
+}
+
+long long nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rttInit(RttEstimator *rtt, int fixedMs) {
+    memset(rtt, 0, sizeof(*rtt));
+    rtt->fixedMs = fixedMs;
+    rtt->rtoMs = fixedMs ? fixedMs : INITIAL_RTO_MS;
+}
+
+// Début de mesure à l'émission d'un paquet qui attend la réponse seq ; une seule à la fois
+void rttStart(RttEstimator *rtt, unsigned long seq) {
+    if (!rtt->timing) {
+        rtt->timing = 1;
+        rtt->timedSeq = seq;
+        rtt->sentUs = nowUs();
+    }
+}
+
+// Réponse seq reçue : nouvel échantillon si elle correspond au paquet mesuré
+void rttAcked(RttEstimator *rtt, unsigned long seq) {
+    if (!rtt->timing || seq < rtt->timedSeq) {
+        return;
+    }
+    rtt->timing = 0;
+
+    long long sample = nowUs() - rtt->sentUs;
+    if (!rtt->hasSample) {
+        rtt->srttUs = sample;
+        rtt->rttvarUs = sample / 2;
+        rtt->hasSample = 1;
+    } else {
+        long long delta = rtt->srttUs > sample ? rtt->srttUs - sample : sample - rtt->srttUs;
+        rtt->rttvarUs = (3 * rtt->rttvarUs + delta) / 4;
+        rtt->srttUs = (7 * rtt->srttUs + sample) / 8;
+    }
+
+    long long rto = (rtt->srttUs + 4 * rtt->rttvarUs) / 1000;
+    rtt->rtoMs = rto < MIN_RTO_MS ? MIN_RTO_MS : (rto > MAX_RTO_MS ? MAX_RTO_MS : rto);
+}
+
+// Le paquet mesuré va être réémis : sa réponse serait ambiguë (Karn)
+void rttCancel(RttEstimator *rtt) {
+    rtt->timing = 0;
+}
+
+// Timeout : le délai double jusqu'au plafond, jusqu'à la prochaine mesure valide
+void rttBackoff(RttEstimator *rtt) {
+    rtt->timing = 0;
+    rtt->rtoMs = rtt->rtoMs * 2 > MAX_RTO_MS ? MAX_RTO_MS : rtt->rtoMs * 2;
+}
+
+long long rttTimeoutMs(const RttEstimator *rtt) {
+    return rtt->fixedMs ? rtt->fixedMs : rtt->rtoMs;
+}
+
+// Délai maximal entre deux retransmissions, qui fixe aussi l'abandon
+long long rttMaxMs(const RttEstimator *rtt) {
+    return rtt->fixedMs ? rtt->fixedMs : MAX_RTO_MS;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg, pthread_setaffinity_np
+// Le moteur io_uring (option -U) est compilé par défaut ; -DNO_IO_URING ne garde que epoll
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,7 +7,31 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/un.h>
+#include <sys/statvfs.h>
+#include <sys/file.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifndef NO_IO_URING
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define BUFFER_SIZE 516
 #define OP_RRQ 1
@@ -14,272 +40,2911 @@
 #define OP_ACK 4
 #define OP_ERROR 5
 #define TFTP_PORT 66
-#define TIMEOUT_SEC 5
+#define TIMEOUT_SEC 5 // Plafond du délai de retransmission adaptatif
 #define OP_OACK 6 // Ajoutez cette ligne si OP_OACK n'est pas déjà défini
 #define OPTION_BIGFILE "bigfile"
 #define MAX_RETRIES 5
+#define OPTION_BLKSIZE "blksize"
+#define DEFAULT_BLKSIZE 512
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464 // Limite RFC 2348
+#define MAX_PACKET_SIZE (MAX_BLKSIZE + 4)
+#define IP_UDP_HEADERS 28 // En-têtes IPv4 (20) + UDP (8)
+#define OPTION_WINDOWSIZE "windowsize"
+#define MAX_WINDOWSIZE 64 // Blocs en vol au plus par session (RFC 7440 autorise 65535)
+#define MAX_EVENTS 256 // Événements traités par appel à epoll_wait
+#define MAX_ENGINES 256 // Moteurs au plus avec -t
+#define OPTION_TIMEOUT "timeout"
+#define OPTION_ROLLOVER "rollover" // Numéro qui suit 65535 : 0 ou 1 selon les implémentations
+#define OPTION_TSIZE "tsize" // Taille du fichier transféré (RFC 2349)
+#define OPTION_OFFSET "offset" // Reprise d'un transfert interrompu (extension locale) : "octets,mtime"
+#define OPTION_RANGE "range" // Lecture d'une partie du fichier (extension locale) : "début,longueur"
+#define PARTIAL_SUFFIX ".part" // Téléversement repris : fichier partiel conservé entre deux sessions
+#define MIN_TIMEOUT_OPTION 1   // RFC 2349 : timeout de 1 à 255 secondes
+#define MAX_TIMEOUT_OPTION 255
+#define INITIAL_RTO_MS 1000 // Délai de retransmission avant la première mesure (RFC 6298)
+#define MIN_RTO_MS 200 // Plancher : sur un LAN, une perte coûte 200 ms au lieu de TIMEOUT_SEC
+#define MAX_RTO_MS (TIMEOUT_SEC * 1000)
+#define SEND_BATCH MAX_WINDOWSIZE // Paquets DATA envoyés au plus par appel à sendmmsg
+#define RECV_BATCH 32 // Datagrammes lus au plus par appel à recvmmsg
+#define LISTEN_RCVBUF (1024 * 1024) // Tampon de réception de la socket d'écoute (limité par rmem_max)
+#define GSO_MAX_SEGMENTS 64 // Segments par envoi UDP_SEGMENT (limite des noyaux avant 6.9)
+#define GSO_MAX_BYTES (65535 - IP_UDP_HEADERS) // Charge utile UDP maximale d'un envoi segmenté
+#define WB_BUFFER_SIZE (256 * 1024) // Tampon d'écriture différée, multiple de WB_ALIGN
+#define WB_BUFFERS 4 // Tampons par téléversement : un en remplissage, les autres en écriture
+#define WB_ALIGN 4096 // Alignement des tampons et des écritures exigé par O_DIRECT
+#define POOL_MIN_SHIFT 6 // Plus petite classe des pools : 64 octets
+#define POOL_CLASSES 18 // Classes de 64 o à 8 Mo, de quoi loger l'anneau d'une fenêtre maximale
+#define POOL_ALIGN 64 // Alignement des blocs, WB_ALIGN à partir de 4 Ko pour O_DIRECT
+#define HIST_BUCKETS 13 // Seuils d'un histogramme au plus, le seau +Inf en plus
+#define METRICS_BODY_SIZE 8192 // Corps de la réponse de l'endpoint des métriques
+
+#ifndef NO_IO_URING
+#define URING_ENTRIES 1024 // Taille de la file de soumission (puissance de 2)
+#define URING_SMALL_BUFFERS 1024 // Tampons fournis pour les requêtes et les ACK
+#define URING_SMALL_SIZE 1024
+#define URING_LARGE_BUFFERS 64 // Tampons fournis pour les DATA des téléversements
+#define URING_LARGE_SIZE (MAX_PACKET_SIZE + 64) // Paquet maximal, en-tête io_uring_recvmsg_out et adresse
+#define URING_READAHEAD (1024 * 1024) // Lecture anticipée demandée au noyau par pas d'1 Mo
+
+// Valeurs de user_data qui ne sont pas des sessions
+#define URING_IGNORE 1   // Envois, annulations, lectures anticipées : seuls les échecs produisent un CQE
+#define URING_LISTEN 2   // Réception multishot sur la socket d'écoute
+#define URING_WRITTEN 3  // Eventfd du thread d'écriture différée
+
+#define URING_SMALL_GROUP 0
+#define URING_LARGE_GROUP 1
+#endif
+
+// Options négociées pour un transfert (RFC 2347)
+typedef struct {
+    int blksize;        // Taille de bloc utilisée pour les paquets DATA
+    int hasBlksize;     // Vrai si l'option blksize doit apparaître dans l'OACK
+    int windowsize;     // Nombre de blocs envoyés avant d'attendre un ACK (RFC 7440)
+    int hasWindowsize;  // Vrai si l'option windowsize doit apparaître dans l'OACK
+    int timeout;        // Délai de retransmission imposé par le client, en secondes (RFC 2349)
+    int hasTimeout;     // Vrai si l'option timeout doit apparaître dans l'OACK
+    int rollover;       // Numéro de bloc qui suit 65535 (0 ou 1)
+    int hasRollover;    // Vrai si l'option rollover doit apparaître dans l'OACK
+    long long tsize;    // RRQ : taille du fichier envoyé, WRQ : taille annoncée par le client
+    int hasTsize;       // Vrai si l'option tsize doit apparaître dans l'OACK
+    long long offset;   // Position du premier octet transféré (reprise)
+    long long mtime;    // Date de modification du fichier repris, en secondes, 0 si inconnue
+    int hasOffset;      // Vrai si l'option offset doit apparaître dans l'OACK
+    long long rangeStart;  // RRQ : partie demandée du fichier, pour un téléchargement parallèle
+    long long rangeLength;
+    int hasRange;       // Vrai si l'option range doit apparaître dans l'OACK
+} TftpOptions;
+
+// Estimation du délai de retransmission à la Jacobson/Karels (RFC 6298). Seuls les paquets
+// émis une seule fois sont mesurés (algorithme de Karn) et chaque timeout double le délai.
+// Un timeout négocié (RFC 2349) remplace l'estimation.
+typedef struct {
+    long long srttUs;        // RTT lissé
+    long long rttvarUs;      // Variation moyenne du RTT
+    long long rtoMs;         // Délai de retransmission courant, backoff compris
+    int hasSample;
+    int fixedMs;             // Timeout négocié, 0 si le délai est adaptatif
+    int timing;              // Vrai si une mesure est en cours
+    unsigned long timedSeq;  // Numéro absolu du bloc dont on attend l'ACK (ou le DATA)
+    long long sentUs;        // Date d'émission du paquet mesuré
+} RttEstimator;
+
+// Conversion netascii en flux (RFC 764) : LF devient CR LF et CR devient CR NUL, et
+// inversement pour un WRQ. Une paire peut être coupée entre deux blocs ; l'état la reprend.
+typedef struct {
+    int hasPending;    // RRQ : second octet d'une paire qui n'a pas tenu dans le bloc précédent
+    char pending;
+    int sawCR;         // WRQ : le bloc précédent finissait par un CR
+} NetasciiState;
+
+// États d'une session de transfert
+typedef enum {
+    STATE_OACK_SENT,  // RRQ : OACK envoyé, attente de l'ACK du bloc 0
+    STATE_SENDING,    // RRQ : envoi de la fenêtre de blocs DATA
+    STATE_RECEIVING,  // WRQ : réception des blocs DATA
+    STATE_FLUSHING,   // WRQ : ACK retenu le temps que le disque libère un tampon ou termine le fsync
+    STATE_DALLYING    // WRQ : dernier ACK envoyé, on réacquitte un éventuel doublon du dernier bloc
+} SessionState;
+
+struct WriteStream;
+
+// Un tampon d'écriture différée, soumis au thread d'E/S puis rendu à la boucle événementielle
+typedef struct WriteJob {
+    struct WriteJob *next;        // Chaînage dans la file d'attente ou dans la liste des terminés
+    struct WriteStream *stream;
+    char *data;                   // WB_BUFFER_SIZE octets alignés sur WB_ALIGN
+    size_t len;
+    off_t offset;
+    int final;                    // Dernier tampon du fichier : fsync avant de le rendre
+    int busy;                     // Soumis et pas encore rendu à la boucle
+    int error;                    // errno de l'écriture, 0 si elle a réussi
+} WriteJob;
+
+// Un transfert en cours. Chaque session a sa propre socket éphémère, qui sert de TID
+// côté serveur (RFC 1350), et avance uniquement sur réception d'un paquet ou d'un timeout.
+typedef struct {
+    int sockfd;
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen;
+    int opcode;            // OP_RRQ ou OP_WRQ
+    SessionState state;
+    TftpOptions opts;
+    int fileFd;            // RRQ : fichier lu, -1 sinon
+    int netascii;
+    NetasciiState ascii;
+
+    // RRQ netascii : le texte est converti depuis la projection, ou depuis readBuffer
+    // (blksize octets lus avec read) pour un fichier qui ne peut pas être projeté
+    int mapped;
+    size_t inputLen, inputPos;
+    char *readBuffer;
+
+    // RRQ en mode octet : le fichier est projeté en mémoire et chaque bloc part directement
+    // de la projection (en-tête et données en deux iovec), sans copie ni anneau ; une
+    // retransmission ne coûte qu'un sendmsg et les pages sont partagées entre les sessions.
+    int zeroCopy;
+    const char *map;
+    size_t fileSize;
+    size_t resumeOffset;   // Position du bloc 1 dans le fichier, non nulle pour une reprise
+    size_t rangeEnd;       // Fin de la partie envoyée : fileSize, ou la fin de l'option range
+
+    // WRQ : le fichier est écrit sous un nom temporaire puis renommé une fois complet,
+    // pour qu'une session qui lit l'ancienne version projetée ne le voie jamais tronqué.
+    // Les blocs reçus passent par le flux d'écriture différée. Avec l'option offset, le
+    // nom temporaire est fixe (PARTIAL_SUFFIX) et le fichier partiel survit à un échec.
+    char *filename;
+    char *tempName;
+    struct WriteStream *wb;
+    int finalReceived;     // WRQ : le bloc court final est reçu, son ACK attend le fsync
+
+    // Moteur io_uring : la réception multishot garde une référence sur la session, libérée
+    // seulement au dernier CQE de cette réception
+    int recvArmed;
+    int released;          // Session détruite dont on attend le dernier CQE
+    off_t readahead;       // RRQ : fin de la zone du fichier déjà demandée en lecture anticipée
+
+    // RRQ : anneau des blocs de la fenêtre, le bloc n occupe l'emplacement n % windowsize.
+    // Numéros absolus (sans roll-over) : firstUnacked..lastRead sont dans l'anneau,
+    // nextToSend est le prochain bloc à émettre, lastBlock le bloc court final une fois lu,
+    // highestSent le dernier bloc émis au moins une fois.
+    char *window;
+    size_t *packetLens;
+    unsigned long firstUnacked, nextToSend, lastRead, lastBlock, highestSent;
+    int rewoundOnDuplicate;
+
+    // WRQ : dernier bloc reçu et acquitté
+    unsigned long blockNum;
+
+    RttEstimator rtt;
+    long long lastProgress; // Date du dernier bloc acquitté ou reçu, en ms
+    long long deadline;    // Échéance du timer en ms (horloge monotone)
+    int timerIndex;        // Position dans le tas des timers, -1 si désarmé
+    int tableIndex;        // Position dans la table des sessions
+
+    long long startUs;     // Date de la requête, pour le débit du transfert
+    unsigned long long transferred; // Octets de données émis ou reçus une première fois
+} Session;
+
+// Écriture différée d'un téléversement : les blocs DATA sont recopiés dans de grands tampons
+// alignés que le thread d'E/S écrit pendant que la boucle continue d'acquitter. Les tampons
+// sont utilisés à tour de rôle et rendus dans l'ordre ; quand aucun n'est libre, la fin du
+// bloc reçu attend dans pending et son ACK est retenu jusqu'au retour d'un tampon.
+typedef struct WriteStream {
+    Session *session;
+    int fd;
+    int direct;                   // Fichier ouvert en O_DIRECT
+    WriteJob jobs[WB_BUFFERS];
+    int fill;                     // Tampon en remplissage, -1 si tous sont en écriture
+    size_t used;                  // Octets déjà copiés dans le tampon en remplissage
+    off_t offset;                 // Position dans le fichier du tampon en remplissage
+    struct WriteQueue *queue;     // File du moteur de la session
+    int queued;                   // Tampons pas encore écrits (protégé par queue->lock)
+    int finalSubmitted;           // Le dernier tampon est parti, plus rien ne sera copié
+    char *pending;                // Fin d'un bloc reçu alors qu'aucun tampon n'était libre
+    size_t pendingLen;
+    size_t pendingSize;           // Taille allouée de pending (blksize négocié)
+} WriteStream;
+
+// File partagée entre la boucle d'un moteur et son thread d'E/S. Les tampons écrits reviennent dans
+// l'ordre par la liste des terminés, et l'eventfd réveille epoll_wait.
+typedef struct WriteQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;          // Du travail attend le thread d'E/S
+    pthread_cond_t written;       // Un tampon vient d'être écrit
+    WriteJob *head, *tail;
+    WriteJob *doneHead, *doneTail;
+    int eventfd;
+} WriteQueue;
+
+// Lot de paquets DATA d'une session, émis en un seul sendmmsg. Chaque message a un
+// ou deux iovec : le paquet de l'anneau, ou un en-tête du lot suivi d'une tranche projetée.
+typedef struct {
+    int count;
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH][2];
+    char headers[SEND_BATCH][4];
+    struct iovec gsoIov[SEND_BATCH * 2]; // Paquets consécutifs concaténés pour un envoi segmenté
+} SendBatch;
+
+// Datagrammes reçus en un seul recvmmsg ; chaque tampon a la taille d'un paquet maximal
+typedef struct {
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    struct sockaddr_in addrs[RECV_BATCH];
+    char *buffers;
+} RecvBatch;
+
+#ifndef NO_IO_URING
+// Tampons fournis au noyau pour les réceptions multishot : il en prend un par datagramme,
+// que la boucle lui rend une fois le paquet traité
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    char *buffers;
+    unsigned entries;
+    size_t size;
+    unsigned short tail;
+} BufferRing;
+
+// Anneaux io_uring partagés avec le noyau, utilisés sans liburing. Les envois d'une
+// itération sont préparés en SQE et partent avec l'attente suivante, en un seul appel.
+typedef struct {
+    int fd;
+    unsigned sqEntries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail;         // SQE préparés ; *sqTail est publié à la soumission
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    struct msghdr recvTemplate;   // Gabarit des réceptions multishot : seule la taille de l'adresse compte
+    BufferRing small, large;
+
+    // Copies des messages à envoyer, valides jusqu'à la prochaine soumission
+    int staged;
+    struct msghdr msgs[URING_ENTRIES];
+    struct iovec iov[URING_ENTRIES][2];
+    char headers[URING_ENTRIES][4];
+} Uring;
+#endif
+
+// Bloc libre d'un pool, chaîné dans la liste de sa classe
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+// Pool d'un moteur : les blocs sont regroupés par classes de tailles en puissances de 2 et
+// jamais rendus au système. Une fois le pic de sessions atteint, sessions, anneaux de fenêtre
+// et tampons d'écriture sont tous repris des listes libres, sans passer par malloc.
+typedef struct {
+    PoolBlock *freeLists[POOL_CLASSES];
+    unsigned long heapAllocs;     // Blocs obtenus du tas depuis le démarrage
+    size_t heapBytes;
+    unsigned long reused;         // Blocs repris d'une liste libre
+    unsigned long inUse;
+} Pool;
+
+// Histogramme au format Prometheus : buckets[i] compte les valeurs <= bounds[i], le dernier
+// seau les valeurs au-delà du dernier seuil ; les seaux sont cumulés à l'affichage
+typedef struct {
+    unsigned long buckets[HIST_BUCKETS + 1];
+    unsigned long count;
+    unsigned long sum;
+} Histogram;
+
+// Compteurs d'un moteur. Seul le thread du moteur les écrit, par des stores atomiques relâchés
+// sans instruction verrouillée ; le thread de l'endpoint (-M) les lit et les additionne à chaque
+// requête. Les octets et paquets sont ceux des DATA, en-tête de 4 octets exclu pour les octets.
+typedef struct {
+    unsigned long sessionsActive;
+    unsigned long requests[2];    // RRQ et WRQ acceptés
+    unsigned long completed;      // Transferts arrivés au bout
+    unsigned long failed;         // Transferts abandonnés (erreur, client muet, fichier absent...)
+    unsigned long bytesSent, bytesReceived;
+    unsigned long packetsSent, packetsReceived;
+    unsigned long retransmits;    // DATA, ACK ou OACK réémis
+    unsigned long timeouts;       // Timers échus sans réponse du client
+    unsigned long duplicateAcks;  // ACK en double ignorés sans réémission (RFC 1123 §4.2.3.1)
+    unsigned long unknownTids;    // Paquets d'une autre adresse que celle du client, rejetés (erreur 5)
+    Histogram rtt;                // Échantillons du RTT des ACK et des DATA, en µs
+    Histogram throughput;         // Débit de chaque transfert réussi, en octets par seconde
+} Metrics;
+
+// Moteur événementiel : un seul thread sert toutes les sessions via epoll. Avec -t, chaque
+// thread a son moteur et sa socket d'écoute SO_REUSEPORT ; le noyau répartit les requêtes
+// entre elles et une session reste sur le moteur qui l'a acceptée, sans état partagé.
+// Les timers des sessions sont rangés dans un tas binaire trié par échéance.
+typedef struct {
+    int epollfd;
+    int listenfd;
+    struct sockaddr_in bindAddr;  // Adresse locale des sockets de session (port éphémère)
+    Session **sessions;
+    int sessionCount;
+    Session **timers;
+    int timerCount;
+    int capacity;                 // Taille allouée de sessions[] et timers[]
+    SendBatch sendBatch;
+    RecvBatch recvBatch;
+    char convertBuffer[MAX_BLKSIZE + 2]; // Bloc netascii reçu, une fois décodé
+    WriteQueue writeQueue;        // Écriture différée des téléversements de ce moteur
+    Pool pool;                    // Mémoire des sessions de ce moteur, sans verrou
+    int id;
+    long long nextStats;          // Échéance du prochain rapport (option -s), en ms
+    Metrics metrics;
+    int cpu;                      // Rang du processeur sur lequel épingler le thread, -1 sinon
+#ifndef NO_IO_URING
+    Uring ring;
+#endif
+} Engine;
+
+// Vrai si la taille de bloc doit être limitée au MTU du chemin (option -m)
+int clampToPathMtu = 0;
+
+// Vrai si les paquets sont lus et émis par lots (recvmmsg/sendmmsg) ; désactivé par -B
+// pour comparer avec le chemin un appel système par paquet
+int batchIo = 1;
+
+// Vrai si les blocs d'une fenêtre partent en un seul envoi segmenté par la pile (UDP GSO,
+// option -G) ; remis à 0 si le noyau ou l'interface ne le permettent pas
+int gsoMode = 0;
+
+// Vrai si les téléversements sont écrits par le thread d'E/S ; avec -W les tampons sont
+// écrits depuis la boucle, qui attend alors le disque
+int writeBehind = 1;
+
+// Vrai si les fichiers téléversés sont ouverts en O_DIRECT (option -D)
+int directIo = 0;
+
+// Vrai si la boucle passe par io_uring au lieu d'epoll (option -U) ; remis à 0 si le noyau
+// ne fournit pas les fonctions nécessaires
+int uringMode = 0;
+
+// Numéro de bloc qui suit 65535 quand le client ne le précise pas (option -r) ; un fichier
+// de plus de 65535 blocs fait reboucler le compteur de 16 bits
+int rolloverBase = 0;
+
+// Secondes entre deux rapports des pools de chaque moteur, 0 pour les désactiver (option -s)
+int statsInterval = 0;
+
+// Endpoint des métriques (option -M) : un port TCP sur 127.0.0.1, ou le chemin d'une socket Unix
+const char *metricsAddress = NULL;
+
+// Seuils des histogrammes : RTT en µs, débit en octets par seconde
+const unsigned long rttBounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000};
+const unsigned long throughputBounds[] = {65536, 262144, 1048576, 4194304, 16777216, 67108864, 268435456, 1073741824};
+#define RTT_BOUNDS (int)(sizeof(rttBounds) / sizeof(rttBounds[0]))
+#define THROUGHPUT_BOUNDS (int)(sizeof(throughputBounds) / sizeof(throughputBounds[0]))
+
+// Endpoint des métriques et moteurs dont il additionne les compteurs
+typedef struct {
+    int listenfd;
+    Engine *engines;
+    int engineCount;
+} MetricsEndpoint;
+
+// Boucle événementielle
+int openListener(struct sockaddr_in *serverAddr, int reusePort);
+void engineInit(Engine *engine, int listenfd, struct sockaddr_in *bindAddr);
+void engineRun(Engine *engine);
+long long engineWaitMs(Engine *engine);
+void engineStats(Engine *engine);
+void *engineThread(void *arg);
+void pinToCpu(int index);
+void acceptRequests(Engine *engine);
+void acceptRequest(Engine *engine, char *buffer, int receivedBytes, struct sockaddr_in *clientAddr, socklen_t clientAddrLen);
+Session* createSession(Engine *engine, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, int opcode, const TftpOptions *opts);
+void destroySession(Engine *engine, Session *session);
+void sessionReadable(Engine *engine, Session *session);
+int sessionDatagram(Engine *engine, Session *session, const char *packet, ssize_t len, struct sockaddr_in *fromAddr);
+int sessionPacket(Engine *engine, Session *session, const char *packet, ssize_t len);
+void sessionTimeout(Engine *engine, Session *session);
+
+// Pools de mémoire par moteur
+int poolClass(size_t size);
+void* poolAlloc(Pool *pool, size_t size);
+void* poolCalloc(Pool *pool, size_t size);
+void poolFree(Pool *pool, void *ptr, size_t size);
+
+// Métriques
+void metricAdd(unsigned long *counter, unsigned long n);
+void metricSet(unsigned long *counter, unsigned long value);
+unsigned long metricRead(const unsigned long *counter);
+void metricObserve(Histogram *hist, const unsigned long *bounds, int boundCount, long long value);
+int openMetricsListener(const char *address);
+void *metricsThread(void *arg);
+void serveMetrics(MetricsEndpoint *endpoint, int fd, char *response);
+size_t renderMetrics(MetricsEndpoint *endpoint, char *out, size_t size);
+size_t renderHistogram(char *out, size_t size, const char *name, const char *help, const Histogram *hist,
+                       const unsigned long *bounds, int boundCount, double scale);
+
+// Timers et délai de retransmission
+long long nowMs(void);
+long long nowUs(void);
+void rttInit(RttEstimator *rtt, int fixedMs);
+void rttStart(RttEstimator *rtt, unsigned long seq);
+long long rttAcked(RttEstimator *rtt, unsigned long seq);
+void rttCancel(RttEstimator *rtt);
+void rttBackoff(RttEstimator *rtt);
+long long rttTimeoutMs(const RttEstimator *rtt);
+long long rttMaxMs(const RttEstimator *rtt);
+void armTimer(Engine *engine, Session *session, long long deadline);
+void cancelTimer(Engine *engine, Session *session);
+void timerSiftUp(Engine *engine, int index);
+void timerSiftDown(Engine *engine, int index);
 
 // Prototypes for functions that handle RRQ and WRQ
-void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode);
+int handleRRQ(Engine *engine, Session *session, const char *filename, const char *mode);
 // Correction dans la définition de la fonction handleWRQ
-void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char* filename, const char* mode);
+int handleWRQ(Engine *engine, Session *session, const char* filename, const char* mode);
+int reserveUpload(Session *session, int fd);
+int openPartial(Engine *engine, Session *session);
+int rrqAck(Engine *engine, Session *session, unsigned int ackNum);
+void wrqData(Engine *engine, Session *session, const char *packet, ssize_t len);
+void fillWindow(Engine *engine, Session *session);
+void resumeDownload(Session *session);
+int rangeDownload(Session *session);
+int mapFile(Session *session);
+void queueMappedBlock(Engine *engine, Session *session, unsigned long block);
+
+// Entrées/sorties par lots
+int receiveBatch(Engine *engine, int sockfd, size_t maxLen);
+void queuePacket(Engine *engine, Session *session, const void *head, size_t headLen, const void *data, size_t dataLen);
+void flushPackets(Engine *engine, Session *session);
+int sendSegmented(Engine *engine, Session *session, int first);
+int gsoSupported(void);
+
+// Écriture différée des téléversements
+void writeBehindInit(WriteQueue *queue);
+void *writeThread(void *arg);
+void performWrite(WriteJob *job);
+void pushWritten(WriteQueue *queue, WriteJob *job);
+WriteStream* wbOpen(WriteQueue *queue, Pool *pool, Session *session, int fd);
+int wbAppend(WriteStream *wb, const char *data, size_t len);
+void wbSubmit(WriteStream *wb, int final);
+void wbClose(WriteStream *wb, Pool *pool);
+void writeCompletions(Engine *engine);
+void wrqWritten(Engine *engine, Session *session, WriteJob *job);
+
+#ifndef NO_IO_URING
+// Moteur io_uring
+int uringInit(Engine *engine);
+int bufferRingInit(Uring *ring, BufferRing *br, int group, unsigned entries, size_t size);
+void bufferRingRecycle(BufferRing *br, unsigned bid);
+struct io_uring_sqe* uringSqe(Uring *ring);
+void uringSubmit(Uring *ring, int wait, long long timeoutMs);
+void uringRun(Engine *engine);
+void uringComplete(Engine *engine, const struct io_uring_cqe *cqe);
+char* uringPayload(Uring *ring, BufferRing *br, const struct io_uring_cqe *cqe, int *len, struct sockaddr_in **addr);
+void uringRecv(Engine *engine, int fd, unsigned long long userData, int group);
+void uringPollWritten(Engine *engine);
+void uringQueueSends(Engine *engine, Session *session);
+void uringReadahead(Engine *engine, Session *session);
+#endif
+
+void parseOptions(int opcode, const char *options, const char *end, struct sockaddr_in *clientAddr, TftpOptions *opts);
+int pathMtuBlksize(struct sockaddr_in *clientAddr);
+void sendOACK(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const TftpOptions *opts);
+int hasOptions(const TftpOptions *opts);
+size_t readBlock(Session *session, char *data, size_t blksize);
+size_t findLineBreak(const char *p, size_t len);
+size_t netasciiEncode(NetasciiState *state, const char *in, size_t inLen, size_t *consumed, char *out, size_t outLen);
+size_t netasciiDecode(NetasciiState *state, const char *in, size_t inLen, char *out);
+unsigned int wireBlockNum(unsigned long block, int rollover);
+
+void sendError(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, int errorCode, const char *errorMsg);
+// Déclaration de sendACK (ajoutez-la au début du fichier ou dans un fichier d'en-tête inclus)
+void sendACK(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, unsigned int blockNum);
+
+
+
+int main(int argc, char *argv[]) {
+     int sockfd;
+    struct sockaddr_in serverAddr;
+    char serverIP[INET_ADDRSTRLEN];  // Buffer for the IP address
+    int serverPort;                  // Variable for the server port
+    int opt;
+    int engineCount = 1;
+
+    while ((opt = getopt(argc, argv, "mBGWDUt:s:r:M:")) != -1) {
+        switch (opt) {
+            case 'm':
+                clampToPathMtu = 1;
+                break;
+            case 'B':
+                batchIo = 0;
+                break;
+            case 'G':
+                gsoMode = 1;
+                break;
+            case 'W':
+                writeBehind = 0;
+                break;
+            case 'D':
+                directIo = 1;
+                break;
+            case 't':
+                engineCount = atoi(optarg);
+                if (engineCount <= 0) {
+                    engineCount = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (engineCount > MAX_ENGINES) {
+                    engineCount = MAX_ENGINES;
+                }
+                break;
+            case 's':
+                statsInterval = atoi(optarg);
+                break;
+            case 'r':
+                rolloverBase = atoi(optarg) == 1;
+                break;
+            case 'M':
+                metricsAddress = optarg;
+                break;
+#ifndef NO_IO_URING
+            case 'U':
+                uringMode = 1;
+                break;
+#endif
+            default:
+                fprintf(stderr, "Usage: %s [-m] [-B] [-G] [-W] [-D] [-U] [-t threads] [-s seconds] [-r 0|1] [-M port|path]\n", argv[0]);
+                fprintf(stderr, "  -m  clamp negotiated blksize to the path MTU\n");
+                fprintf(stderr, "  -B  one syscall per packet instead of recvmmsg/sendmmsg batches\n");
+                fprintf(stderr, "  -G  send each window of DATA as one UDP GSO buffer when supported\n");
+                fprintf(stderr, "  -W  write uploads from the event loop instead of the I/O thread\n");
+                fprintf(stderr, "  -D  open uploaded files with O_DIRECT\n");
+                fprintf(stderr, "  -U  io_uring engine instead of epoll (unless built with -DNO_IO_URING)\n");
+                fprintf(stderr, "  -t  engine threads, each with its own SO_REUSEPORT socket and CPU (0: one per CPU)\n");
+                fprintf(stderr, "  -s  print each engine's allocator counters every N seconds\n");
+                fprintf(stderr, "  -r  block number after 65535 when the client sends no rollover option (default 0)\n");
+                fprintf(stderr, "  -M  serve Prometheus metrics on 127.0.0.1:port, or on a Unix socket when given a path\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Ask for server IP and port from the user
+    printf("Enter server IP address: ");
+    scanf("%s", serverIP);
+    printf("Enter server port (default is %d): ", TFTP_PORT);
+    scanf("%d", &serverPort);
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(serverPort);
+    if (inet_pton(AF_INET, serverIP, &serverAddr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address/ Address not supported \n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Chaque session consomme une socket et un fichier : on relève la limite de descripteurs
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Les moteurs sont tous initialisés ici, avant le démarrage des threads
+    Engine *engines = calloc(engineCount, sizeof(Engine));
+    if (!engines) {
+        perror("Failed to allocate engines");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < engineCount; i++) {
+        sockfd = openListener(&serverAddr, engineCount > 1);
+        engineInit(&engines[i], sockfd, &serverAddr);
+        engines[i].id = i;
+        engines[i].cpu = engineCount > 1 ? i : -1;
+    }
+
+    printf("TFTP Server started on %s:%d...\n", serverIP, serverPort);
+    if (engineCount > 1) {
+        printf("%d engine threads sharing the port with SO_REUSEPORT\n", engineCount);
+    }
+    fflush(stdout);
+
+    // L'endpoint des métriques lit les compteurs de tous les moteurs depuis son propre thread
+    if (metricsAddress) {
+        MetricsEndpoint *endpoint = malloc(sizeof(MetricsEndpoint));
+        pthread_t metricsTid;
+        if (!endpoint) {
+            perror("Failed to allocate metrics endpoint");
+            exit(EXIT_FAILURE);
+        }
+        endpoint->listenfd = openMetricsListener(metricsAddress);
+        endpoint->engines = engines;
+        endpoint->engineCount = engineCount;
+        if (pthread_create(&metricsTid, NULL, metricsThread, endpoint) != 0) {
+            perror("Failed to create metrics thread");
+            exit(EXIT_FAILURE);
+        }
+        printf("Metrics served on %s%s\n", strchr(metricsAddress, '/') ? "" : "127.0.0.1:", metricsAddress);
+        fflush(stdout);
+    }
+
+    pthread_t threads[MAX_ENGINES];
+    for (int i = 1; i < engineCount; i++) {
+        if (pthread_create(&threads[i], NULL, engineThread, &engines[i]) != 0) {
+            perror("Failed to create engine thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    engineThread(&engines[0]); // Le premier moteur tourne dans le thread principal
+
+    close(sockfd);
+    return 0;
+}
+
+// Crée la socket d'écoute d'un moteur. Avec reusePort, plusieurs sockets partagent le port
+// et le noyau répartit les requêtes entre elles selon l'adresse du client.
+int openListener(struct sockaddr_in *serverAddr, int reusePort) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int one = 1;
+    if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(sockfd, (struct sockaddr *)serverAddr, sizeof(*serverAddr)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+void *engineThread(void *arg) {
+    Engine *engine = arg;
+    if (engine->cpu >= 0) {
+        pinToCpu(engine->cpu);
+    }
+    engineRun(engine);
+    return NULL;
+}
+
+// Épingle le thread courant sur le index-ième processeur autorisé au processus
+void pinToCpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    index %= CPU_COUNT(&allowed);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                fprintf(stderr, "Failed to pin engine thread to CPU %d\n", cpu);
+            }
+            return;
+        }
+    }
+}
+
+void engineInit(Engine *engine, int listenfd, struct sockaddr_in *bindAddr) {
+    memset(engine, 0, sizeof(*engine));
+    engine->listenfd = listenfd;
+    engine->bindAddr = *bindAddr;
+    engine->bindAddr.sin_port = 0;
+    if (statsInterval > 0) {
+        engine->nextStats = nowMs() + statsInterval * 1000LL;
+    }
+
+    if (gsoMode && !gsoSupported()) {
+        fprintf(stderr, "UDP GSO not supported by this kernel, using regular sends\n");
+        gsoMode = 0;
+    }
+
+    engine->recvBatch.buffers = malloc(RECV_BATCH * (MAX_PACKET_SIZE + 1));
+    if (!engine->recvBatch.buffers) {
+        perror("Failed to allocate receive buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    engine->epollfd = epoll_create1(0);
+    if (engine->epollfd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // La socket d'écoute est repérée par un pointeur nul dans les événements. Son tampon
+    // de réception est agrandi pour absorber une rafale de requêtes entre deux lectures.
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    int rcvbuf = LISTEN_RCVBUF;
+    setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Les tampons écrits sont signalés par l'eventfd, repéré par l'adresse de la file
+    writeBehindInit(&engine->writeQueue);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &engine->writeQueue;
+    if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, engine->writeQueue.eventfd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+#ifndef NO_IO_URING
+    if (uringMode && !uringInit(engine)) {
+        fprintf(stderr, "io_uring not usable on this kernel, using epoll\n");
+        uringMode = 0;
+    }
+#endif
+}
+
+void engineRun(Engine *engine) {
+    struct epoll_event events[MAX_EVENTS];
+
+#ifndef NO_IO_URING
+    if (uringMode) {
+        uringRun(engine);
+        return;
+    }
+#endif
+
+    while (1) {
+        // On dort jusqu'au prochain paquet ou jusqu'à l'échéance du timer le plus proche
+        int n = epoll_wait(engine->epollfd, events, MAX_EVENTS, (int)engineWaitMs(engine));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(4);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptRequests(engine);
+            } else if (events[i].data.ptr == &engine->writeQueue) {
+                writeCompletions(engine);
+            } else {
+                sessionReadable(engine, events[i].data.ptr);
+            }
+        }
+
+        // Expiration des timers échus
+        long long now = nowMs();
+        while (engine->timerCount > 0 && engine->timers[0]->deadline <= now) {
+            Session *session = engine->timers[0];
+            cancelTimer(engine, session);
+            sessionTimeout(engine, session);
+        }
+        engineStats(engine);
+    }
+}
+
+// Attente maximale avant le prochain timer ou le prochain rapport, -1 s'il n'y en a aucun
+long long engineWaitMs(Engine *engine) {
+    long long deadline = engine->nextStats > 0 ? engine->nextStats : -1;
+    if (engine->timerCount > 0 && (deadline < 0 || engine->timers[0]->deadline < deadline)) {
+        deadline = engine->timers[0]->deadline;
+    }
+    if (deadline < 0) {
+        return -1;
+    }
+    long long delay = deadline - nowMs();
+    return delay > 0 ? delay : 0;
+}
+
+// Rapport périodique des compteurs du pool : en régime établi, heap ne bouge plus
+void engineStats(Engine *engine) {
+    if (engine->nextStats == 0 || nowMs() < engine->nextStats) {
+        return;
+    }
+    engine->nextStats = nowMs() + statsInterval * 1000LL;
+    Pool *pool = &engine->pool;
+    printf("engine %d: %d sessions, pool heap %lu blocks (%zu bytes), reused %lu, in use %lu\n",
+           engine->id, engine->sessionCount, pool->heapAllocs, pool->heapBytes, pool->reused, pool->inUse);
+    fflush(stdout);
+}
+
+// Classe d'une taille : la plus petite puissance de 2 qui la contient, à partir de 2^POOL_MIN_SHIFT
+int poolClass(size_t size) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && ((size_t)1 << (cls + POOL_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+// Bloc d'au moins size octets, repris de la liste libre de sa classe ou obtenu du tas
+void* poolAlloc(Pool *pool, size_t size) {
+    int cls = poolClass(size);
+    if (cls == POOL_CLASSES) {
+        return NULL;
+    }
+
+    void *ptr = pool->freeLists[cls];
+    if (ptr) {
+        pool->freeLists[cls] = pool->freeLists[cls]->next;
+        pool->reused++;
+    } else {
+        size_t blockSize = (size_t)1 << (cls + POOL_MIN_SHIFT);
+        if (posix_memalign(&ptr, blockSize >= WB_ALIGN ? WB_ALIGN : POOL_ALIGN, blockSize) != 0) {
+            return NULL;
+        }
+        pool->heapAllocs++;
+        pool->heapBytes += blockSize;
+    }
+    pool->inUse++;
+    return ptr;
+}
+
+void* poolCalloc(Pool *pool, size_t size) {
+    void *ptr = poolAlloc(pool, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// Rend un bloc à sa classe ; size est la taille demandée à l'allocation
+void poolFree(Pool *pool, void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    PoolBlock *block = ptr;
+    int cls = poolClass(size);
+    block->next = pool->freeLists[cls];
+    pool->freeLists[cls] = block;
+    pool->inUse--;
+}
+
+// Ajoute n à un compteur du moteur courant. Le moteur est le seul à l'écrire : lecture et
+// store ne peuvent pas être entrelacés avec une autre écriture, et le store atomique garantit
+// au thread des métriques une valeur entière.
+void metricAdd(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void metricSet(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+unsigned long metricRead(const unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Range une valeur dans le premier seau dont le seuil la contient ; négative, elle est ignorée
+void metricObserve(Histogram *hist, const unsigned long *bounds, int boundCount, long long value) {
+    if (value < 0) {
+        return;
+    }
+    int i = 0;
+    while (i < boundCount && (unsigned long)value > bounds[i]) {
+        i++;
+    }
+    metricAdd(&hist->buckets[i], 1);
+    metricAdd(&hist->count, 1);
+    metricAdd(&hist->sum, value);
+}
+
+// Socket d'écoute de l'endpoint : un chemin (contenant '/') donne une socket Unix,
+// sinon c'est un port TCP sur la boucle locale, jamais exposé au réseau
+int openMetricsListener(const char *address) {
+    int sockfd;
+    if (strchr(address, '/')) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long\n");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, address);
+        unlink(address); // Socket laissée par une exécution précédente
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0 || bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("Metrics socket bind failed");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        if (sockfd >= 0) {
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (sockfd < 0 || bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("Metrics socket bind failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (listen(sockfd, 16) < 0) {
+        perror("Metrics socket listen failed");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+// Thread de l'endpoint : une connexion à la fois, une requête par connexion. Les moteurs ne
+// sont jamais interrompus, la réponse est calculée à partir de leurs compteurs au moment de la requête.
+void *metricsThread(void *arg) {
+    MetricsEndpoint *endpoint = arg;
+    char *response = malloc(METRICS_BODY_SIZE);
+    if (!response) {
+        perror("Failed to allocate metrics buffer");
+        return NULL;
+    }
+
+    while (1) {
+        int fd = accept(endpoint->listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("Metrics accept failed");
+            }
+            continue;
+        }
+        serveMetrics(endpoint, fd, response);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Répond à une requête HTTP : GET /metrics renvoie les compteurs au format texte de Prometheus
+void serveMetrics(MetricsEndpoint *endpoint, int fd, char *response) {
+    char request[1024];
+    struct timeval tv = {1, 0}; // Un client muet ne doit pas bloquer l'endpoint
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+    if (len <= 0) {
+        return;
+    }
+    request[len] = '\0';
+
+    // En-tête et corps partent ensemble ; sur une socket bloquante, sendmsg envoie tout
+    char header[128];
+    size_t bodyLen = 0;
+    int headerLen;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        bodyLen = renderMetrics(endpoint, response, METRICS_BODY_SIZE);
+        headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLen);
+    } else {
+        headerLen = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    }
+
+    struct iovec iov[2] = {{header, headerLen}, {response, bodyLen}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+// Additionne les compteurs de tous les moteurs et les écrit au format texte de Prometheus.
+// Retourne la longueur écrite, au plus size - 1 : une sortie trop longue est tronquée.
+size_t renderMetrics(MetricsEndpoint *endpoint, char *out, size_t size) {
+    Metrics sum;
+    memset(&sum, 0, sizeof(sum));
+    for (int e = 0; e < endpoint->engineCount; e++) {
+        Metrics *m = &endpoint->engines[e].metrics;
+        sum.sessionsActive += metricRead(&m->sessionsActive);
+        sum.requests[0] += metricRead(&m->requests[0]);
+        sum.requests[1] += metricRead(&m->requests[1]);
+        sum.completed += metricRead(&m->completed);
+        sum.failed += metricRead(&m->failed);
+        sum.bytesSent += metricRead(&m->bytesSent);
+        sum.bytesReceived += metricRead(&m->bytesReceived);
+        sum.packetsSent += metricRead(&m->packetsSent);
+        sum.packetsReceived += metricRead(&m->packetsReceived);
+        sum.retransmits += metricRead(&m->retransmits);
+        sum.timeouts += metricRead(&m->timeouts);
+        sum.duplicateAcks += metricRead(&m->duplicateAcks);
+        sum.unknownTids += metricRead(&m->unknownTids);
+        for (int i = 0; i <= HIST_BUCKETS; i++) {
+            sum.rtt.buckets[i] += metricRead(&m->rtt.buckets[i]);
+            sum.throughput.buckets[i] += metricRead(&m->throughput.buckets[i]);
+        }
+        sum.rtt.count += metricRead(&m->rtt.count);
+        sum.rtt.sum += metricRead(&m->rtt.sum);
+        sum.throughput.count += metricRead(&m->throughput.count);
+        sum.throughput.sum += metricRead(&m->throughput.sum);
+    }
+
+    size_t len = snprintf(out, size,
+        "# HELP tftp_sessions_active Transfers in progress.\n"
+        "# TYPE tftp_sessions_active gauge\n"
+        "tftp_sessions_active %lu\n"
+        "# HELP tftp_requests_total Requests accepted, by type.\n"
+        "# TYPE tftp_requests_total counter\n"
+        "tftp_requests_total{type=\"rrq\"} %lu\n"
+        "tftp_requests_total{type=\"wrq\"} %lu\n"
+        "# HELP tftp_transfers_total Finished transfers, by outcome.\n"
+        "# TYPE tftp_transfers_total counter\n"
+        "tftp_transfers_total{result=\"completed\"} %lu\n"
+        "tftp_transfers_total{result=\"failed\"} %lu\n"
+        "# HELP tftp_data_bytes_sent_total DATA payload bytes sent, retransmissions included.\n"
+        "# TYPE tftp_data_bytes_sent_total counter\n"
+        "tftp_data_bytes_sent_total %lu\n"
+        "# HELP tftp_data_bytes_received_total DATA payload bytes received, duplicates included.\n"
+        "# TYPE tftp_data_bytes_received_total counter\n"
+        "tftp_data_bytes_received_total %lu\n"
+        "# HELP tftp_data_packets_sent_total DATA packets sent.\n"
+        "# TYPE tftp_data_packets_sent_total counter\n"
+        "tftp_data_packets_sent_total %lu\n"
+        "# HELP tftp_data_packets_received_total DATA packets received.\n"
+        "# TYPE tftp_data_packets_received_total counter\n"
+        "tftp_data_packets_received_total %lu\n"
+        "# HELP tftp_retransmits_total DATA, ACK and OACK packets sent again.\n"
+        "# TYPE tftp_retransmits_total counter\n"
+        "tftp_retransmits_total %lu\n"
+        "# HELP tftp_timeouts_total Retransmission timers that expired without an answer.\n"
+        "# TYPE tftp_timeouts_total counter\n"
+        "tftp_timeouts_total %lu\n"
+        "# HELP tftp_duplicate_acks_ignored_total Duplicate ACKs that did not trigger a retransmission.\n"
+        "# TYPE tftp_duplicate_acks_ignored_total counter\n"
+        "tftp_duplicate_acks_ignored_total %lu\n"
+        "# HELP tftp_unknown_tid_packets_total Packets from another address than the session's client, rejected.\n"
+        "# TYPE tftp_unknown_tid_packets_total counter\n"
+        "tftp_unknown_tid_packets_total %lu\n",
+        sum.sessionsActive, sum.requests[0], sum.requests[1], sum.completed, sum.failed,
+        sum.bytesSent, sum.bytesReceived, sum.packetsSent, sum.packetsReceived,
+        sum.retransmits, sum.timeouts, sum.duplicateAcks, sum.unknownTids);
+    if (len >= size) {
+        return size - 1;
+    }
+    len += renderHistogram(out + len, size - len, "tftp_ack_rtt_seconds",
+                           "Round-trip time from a DATA to its ACK, or from an ACK to the next DATA.",
+                           &sum.rtt, rttBounds, RTT_BOUNDS, 1e-6);
+    len += renderHistogram(out + len, size - len, "tftp_transfer_throughput_bytes_per_second",
+                           "Average throughput of each completed transfer.",
+                           &sum.throughput, throughputBounds, THROUGHPUT_BOUNDS, 1);
+    return len;
+}
+
+// Écrit un histogramme : seaux cumulés, somme et nombre d'observations, multipliés par scale.
+// Comme renderMetrics, s'arrête à size - 1 octets si la place manque.
+size_t renderHistogram(char *out, size_t size, const char *name, const char *help, const Histogram *hist,
+                       const unsigned long *bounds, int boundCount, double scale) {
+    size_t len = snprintf(out, size, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long cumulated = 0;
+    for (int i = 0; i < boundCount && len < size; i++) {
+        cumulated += hist->buckets[i];
+        len += snprintf(out + len, size - len, "%s_bucket{le=\"%.10g\"} %lu\n", name, bounds[i] * scale, cumulated);
+    }
+    if (len >= size) {
+        return size - 1;
+    }
+    cumulated += hist->buckets[boundCount];
+    len += snprintf(out + len, size - len, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.10g\n%s_count %lu\n",
+                    name, cumulated, name, hist->sum * scale, name, hist->count);
+    return len < size ? len : size - 1;
+}
+
+// Lit toutes les requêtes en attente sur la socket d'écoute et ouvre une session pour chacune
+void acceptRequests(Engine *engine) {
+    RecvBatch *batch = &engine->recvBatch;
+    int count;
+
+    while ((count = receiveBatch(engine, engine->listenfd, BUFFER_SIZE)) > 0) {
+        for (int i = 0; i < count; i++) {
+            acceptRequest(engine, batch->iov[i].iov_base, batch->msgs[i].msg_len,
+                          &batch->addrs[i], batch->msgs[i].msg_hdr.msg_namelen);
+        }
+    }
+}
+
+// Traite une requête reçue sur la socket d'écoute ; le tampon a un octet libre pour le '\0' final
+void acceptRequest(Engine *engine, char *buffer, int receivedBytes, struct sockaddr_in *clientAddr, socklen_t clientAddrLen) {
+    if (receivedBytes < 4) {
+        return;
+    }
+    buffer[receivedBytes] = '\0';
+
+    // Traitement des requêtes
+    int opcode = buffer[1];
+    char *filename = buffer + 2;
+    char *mode = filename + strlen(filename) + 1;
+    char *end = buffer + receivedBytes;
+    if (mode >= end) {
+        sendError(engine->listenfd, clientAddr, clientAddrLen, 4, "Malformed request");
+        return;
+    }
+    if (opcode != OP_RRQ && opcode != OP_WRQ) {
+        fprintf(stderr, "Unsupported request. Only RRQ and WRQ are supported.\n");
+        return;
+    }
+
+    // Les options éventuelles suivent le mode (RFC 2347)
+    TftpOptions opts;
+    parseOptions(opcode, mode + strlen(mode) + 1, end, clientAddr, &opts);
+
+    Session *session = createSession(engine, clientAddr, clientAddrLen, opcode, &opts);
+    if (!session) {
+        sendError(engine->listenfd, clientAddr, clientAddrLen, 0, "Server busy");
+        return;
+    }
+
+    metricAdd(&engine->metrics.requests[opcode == OP_RRQ ? 0 : 1], 1);
+    int started = (opcode == OP_RRQ) ? handleRRQ(engine, session, filename, mode)
+                                     : handleWRQ(engine, session, filename, mode);
+    if (!started) {
+        destroySession(engine, session);
+    }
+}
+
+// Crée une session avec sa socket éphémère et l'enregistre dans epoll et dans la table
+Session* createSession(Engine *engine, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, int opcode, const TftpOptions *opts) {
+    if (engine->sessionCount == engine->capacity) {
+        int capacity = engine->capacity ? engine->capacity * 2 : 64;
+        Session **sessions = realloc(engine->sessions, capacity * sizeof(Session *));
+        if (!sessions) {
+            return NULL;
+        }
+        engine->sessions = sessions;
+        Session **timers = realloc(engine->timers, capacity * sizeof(Session *));
+        if (!timers) {
+            return NULL;
+        }
+        engine->timers = timers;
+        engine->capacity = capacity;
+    }
+
+    Session *session = poolCalloc(&engine->pool, sizeof(Session));
+    if (!session) {
+        return NULL;
+    }
+    session->fileFd = -1;
+
+    session->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (session->sockfd < 0) {
+        perror("Failed to create socket for client session");
+        poolFree(&engine->pool, session, sizeof(Session));
+        return NULL;
+    }
+    if (bind(session->sockfd, (struct sockaddr *)&engine->bindAddr, sizeof(engine->bindAddr)) < 0) {
+        perror("Bind of session socket failed");
+        close(session->sockfd);
+        poolFree(&engine->pool, session, sizeof(Session));
+        return NULL;
+    }
+
+    session->opcode = opcode;
+#ifndef NO_IO_URING
+    if (uringMode) {
+        // Les DATA d'un téléversement ont besoin des grands tampons, les ACK tiennent dans les petits
+        uringRecv(engine, session->sockfd, (unsigned long long)(uintptr_t)session,
+                  opcode == OP_WRQ ? URING_LARGE_GROUP : URING_SMALL_GROUP);
+        session->recvArmed = 1;
+    } else
+#endif
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = session;
+        if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, session->sockfd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(session->sockfd);
+            poolFree(&engine->pool, session, sizeof(Session));
+            return NULL;
+        }
+    }
+
+    session->clientAddr = *clientAddr;
+    session->clientAddrLen = clientAddrLen;
+    session->opts = *opts;
+    rttInit(&session->rtt, opts->hasTimeout ? opts->timeout * 1000 : 0);
+    session->lastProgress = nowMs();
+    session->timerIndex = -1;
+    session->tableIndex = engine->sessionCount;
+    session->startUs = nowUs();
+    engine->sessions[engine->sessionCount++] = session;
+    metricSet(&engine->metrics.sessionsActive, engine->sessionCount);
+    return session;
+}
+
+void destroySession(Engine *engine, Session *session) {
+    cancelTimer(engine, session);
+#ifndef NO_IO_URING
+    if (uringMode) {
+        // Les envois préparés pointent dans la session et dans ses fichiers : ils partent d'abord
+        uringSubmit(&engine->ring, 0, -1);
+    }
+#endif
+
+    // Retrait de la table : la dernière session prend la place libérée
+    Session *last = engine->sessions[--engine->sessionCount];
+    engine->sessions[session->tableIndex] = last;
+    last->tableIndex = session->tableIndex;
+
+    // Un RRQ a réussi si le dernier bloc est acquitté, un WRQ si le fichier est renommé
+    Metrics *metrics = &engine->metrics;
+    int completed = session->opcode == OP_RRQ ? session->lastBlock != 0 && session->firstUnacked > session->lastBlock
+                                              : session->state == STATE_DALLYING;
+    metricSet(&metrics->sessionsActive, engine->sessionCount);
+    if (completed) {
+        unsigned long long bytes = session->zeroCopy ? session->rangeEnd - session->resumeOffset : session->transferred;
+        long long elapsedUs = nowUs() - session->startUs;
+        metricAdd(&metrics->completed, 1);
+        metricObserve(&metrics->throughput, throughputBounds, THROUGHPUT_BOUNDS,
+                      (long long)(bytes * 1000000.0 / (elapsedUs > 0 ? elapsedUs : 1)));
+    } else {
+        metricAdd(&metrics->failed, 1);
+    }
+
+    if (!uringMode) {
+        epoll_ctl(engine->epollfd, EPOLL_CTL_DEL, session->sockfd, NULL);
+    }
+    close(session->sockfd);
+    if (session->fileFd >= 0) {
+        close(session->fileFd);
+    }
+    if (session->wb) {
+        wbClose(session->wb, &engine->pool); // Attend les écritures en cours avant de libérer les tampons
+    }
+    if (session->tempName && session->opts.hasOffset) {
+        // Téléversement repris plus tard : le fichier partiel garde la date de la source,
+        // que le client présentera à la reprise
+        struct timespec times[2] = {{0, UTIME_NOW}, {session->opts.mtime, 0}};
+        utimensat(AT_FDCWD, session->tempName, times, 0);
+    } else if (session->tempName) {
+        unlink(session->tempName); // Téléversement interrompu : on jette le fichier partiel
+    }
+    if (session->map) {
+        munmap((void *)session->map, session->fileSize);
+    }
+    if (session->filename) {
+        poolFree(&engine->pool, session->filename, strlen(session->filename) + 1);
+    }
+    if (session->tempName) {
+        poolFree(&engine->pool, session->tempName, strlen(session->tempName) + 1);
+    }
+    poolFree(&engine->pool, session->window, session->opts.windowsize * (session->opts.blksize + 4));
+    poolFree(&engine->pool, session->packetLens, session->opts.windowsize * sizeof(size_t));
+    poolFree(&engine->pool, session->readBuffer, session->opts.blksize);
+#ifndef NO_IO_URING
+    if (session->recvArmed) {
+        // La réception multishot tient encore la socket : on l'annule, son dernier CQE libérera la session
+        struct io_uring_sqe *sqe = uringSqe(&engine->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long long)(uintptr_t)session;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = URING_IGNORE;
+        session->released = 1;
+        return;
+    }
+#endif
+    poolFree(&engine->pool, session, sizeof(Session));
+}
+
+// Vide la socket de la session ; la session peut être détruite par l'un des paquets
+void sessionReadable(Engine *engine, Session *session) {
+    RecvBatch *batch = &engine->recvBatch;
+    int count;
+
+    while ((count = receiveBatch(engine, session->sockfd, MAX_PACKET_SIZE)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (!sessionDatagram(engine, session, batch->iov[i].iov_base, batch->msgs[i].msg_len, &batch->addrs[i])) {
+                return; // Transfert terminé, la session n'existe plus
+            }
+        }
+    }
+}
+
+// Un datagramme reçu sur la socket de la session. Retourne 0 si la session a été détruite.
+// Les sockets de session ne sont pas connectées : un paquet d'une autre adresse ou d'un autre
+// port que le client reçoit une erreur 5 et n'a aucun effet sur le transfert (RFC 1350).
+int sessionDatagram(Engine *engine, Session *session, const char *packet, ssize_t len, struct sockaddr_in *fromAddr) {
+    if (fromAddr->sin_addr.s_addr != session->clientAddr.sin_addr.s_addr ||
+        fromAddr->sin_port != session->clientAddr.sin_port) {
+        sendError(session->sockfd, fromAddr, sizeof(*fromAddr), 5, "Unknown transfer ID");
+        metricAdd(&engine->metrics.unknownTids, 1);
+        return 1;
+    }
+    if (len < 4) {
+        return 1;
+    }
+
+    int opcode = packet[1];
+    if (opcode == OP_ERROR) {
+        fprintf(stderr, "Error packet received\n");
+        destroySession(engine, session);
+        return 0;
+    }
+    return sessionPacket(engine, session, packet, len);
+}
+
+// Traite un paquet reçu sur la socket de la session. Retourne 0 si la session a été détruite.
+int sessionPacket(Engine *engine, Session *session, const char *packet, ssize_t len) {
+    int opcode = packet[1];
+    unsigned int blockNum = ((unsigned char)packet[2] << 8) | (unsigned char)packet[3];
+
+    if (session->opcode == OP_RRQ) {
+        if (opcode != OP_ACK) {
+            return 1;
+        }
+        if (session->state == STATE_OACK_SENT) {
+            // L'ACK du bloc 0 confirme l'OACK : début de l'envoi des données
+            if (blockNum == 0) {
+                session->state = STATE_SENDING;
+                metricObserve(&engine->metrics.rtt, rttBounds, RTT_BOUNDS, rttAcked(&session->rtt, 0));
+                session->lastProgress = nowMs();
+                fillWindow(engine, session);
+                armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
+            }
+            return 1;
+        }
+        return rrqAck(engine, session, blockNum);
+    } else if (opcode == OP_DATA) {
+        wrqData(engine, session, packet, len);
+    }
+    return 1;
+}
+
+void sessionTimeout(Engine *engine, Session *session) {
+    if (session->state == STATE_DALLYING) {
+        destroySession(engine, session); // Le client n'a pas réclamé le dernier ACK
+        return;
+    }
+    if (session->state == STATE_FLUSHING && nowMs() - session->lastProgress < rttMaxMs(&session->rtt) * MAX_RETRIES) {
+        // ACK retenu par le disque : le client réémettra, on patiente sans rien envoyer
+        armTimer(engine, session, nowMs() + rttMaxMs(&session->rtt));
+        return;
+    }
+
+    metricAdd(&engine->metrics.timeouts, 1);
+
+    // Les retransmissions s'espacent ; on abandonne quand MAX_RETRIES délais maximaux
+    // se sont écoulés sans progression, comme avec l'ancien timeout fixe
+    if (nowMs() - session->lastProgress >= rttMaxMs(&session->rtt) * MAX_RETRIES) {
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Max retries reached, transfer aborted");
+        destroySession(engine, session);
+        return;
+    }
+    rttBackoff(&session->rtt);
+
+    switch (session->state) {
+        case STATE_OACK_SENT:
+            sendOACK(session->sockfd, &session->clientAddr, session->clientAddrLen, &session->opts);
+            metricAdd(&engine->metrics.retransmits, 1);
+            break;
+        case STATE_SENDING:
+            // Timeout : on rembobine jusqu'au premier bloc non acquitté
+            session->nextToSend = session->firstUnacked;
+            fillWindow(engine, session);
+            break;
+        case STATE_RECEIVING:
+            printf("Timeout waiting for block %u\n", wireBlockNum(session->blockNum + 1, session->opts.rollover));
+            if (session->blockNum == 0 && hasOptions(&session->opts)) {
+                sendOACK(session->sockfd, &session->clientAddr, session->clientAddrLen, &session->opts);
+            } else {
+                sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, wireBlockNum(session->blockNum, session->opts.rollover));
+            }
+            metricAdd(&engine->metrics.retransmits, 1);
+            break;
+        default:
+            break;
+    }
+    armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
+}
+
+// Implement the handleRRQ function to handle read requests
+// Implement the handleRRQ function to handle read requests with bigfile support
+// Jusqu'à windowsize blocs sont en vol (RFC 7440) ; ils restent dans un anneau de la
+// taille de la fenêtre tant qu'ils ne sont pas acquittés, pour pouvoir les réémettre.
+// Retourne 0 si la session doit être détruite.
+int handleRRQ(Engine *engine, Session *session, const char *filename, const char *mode) {
+    size_t blksize = session->opts.blksize;
+    unsigned long windowsize = session->opts.windowsize;
+
+    session->fileFd = open(filename, O_RDONLY);
+    if (session->fileFd < 0) {
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 1, "File not found");
+        return 0;
+    }
+
+    // Traitement selon le mode de transfert
+    session->netascii = (strcmp(mode, "netascii") == 0);
+
+    // En mode octet on envoie depuis une projection du fichier ; sinon (netascii, fichier
+    // spécial) les blocs sont lus et convertis dans l'anneau de la fenêtre
+    if (!mapFile(session) || session->netascii) {
+        session->window = poolAlloc(&engine->pool, windowsize * (blksize + 4));
+        session->packetLens = poolAlloc(&engine->pool, windowsize * sizeof(size_t));
+        if (session->netascii && !session->mapped) {
+            session->readBuffer = poolAlloc(&engine->pool, blksize);
+        }
+        if (!session->window || !session->packetLens || (session->netascii && !session->mapped && !session->readBuffer)) {
+            sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Out of memory");
+            return 0;
+        }
+    }
+    session->firstUnacked = 1;
+    session->nextToSend = 1;
+
+    // tsize : taille exacte d'un fichier régulier en mode octet. En netascii la taille
+    // transmise dépend de la conversion, l'option n'est pas confirmée (RFC 2349).
+    if (session->opts.hasTsize) {
+        if (session->mapped && !session->netascii) {
+            session->opts.tsize = session->fileSize;
+        } else {
+            session->opts.hasTsize = 0;
+        }
+    }
+    // Une partie a sa propre position de départ : offset, qui n'est alors pas appliqué,
+    // n'est pas non plus confirmé. Une partie impossible à servir est refusée plutôt que
+    // remplacée par le fichier entier, que le client écrirait à la place de sa partie.
+    if (session->opts.hasRange) {
+        session->opts.hasOffset = 0;
+        if (!rangeDownload(session)) {
+            sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 8, "Range not satisfiable");
+            return 0;
+        }
+    } else if (session->opts.hasOffset) {
+        resumeDownload(session);
+    }
+
+    // Les options acceptées sont confirmées par un OACK, acquitté par l'ACK du bloc 0
+    if (hasOptions(&session->opts)) {
+        session->state = STATE_OACK_SENT;
+        sendOACK(session->sockfd, &session->clientAddr, session->clientAddrLen, &session->opts);
+        rttStart(&session->rtt, 0);
+    } else {
+        session->state = STATE_SENDING;
+        fillWindow(engine, session);
+    }
+
+    armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
+    return 1;
+}
+
+// offset d'un RRQ : le client a déjà les offset premiers octets d'une version du fichier
+// datée de mtime. La reprise n'est possible qu'en mode octet sur un fichier projeté, où une
+// position dans le flux est une position dans le fichier ; sinon l'option est ignorée. Si le
+// fichier a changé depuis, ou est plus court, l'OACK annonce la position 0 avec la nouvelle
+// date : le client recommence depuis le début.
+void resumeDownload(Session *session) {
+    struct stat st;
+    if (!session->zeroCopy || fstat(session->fileFd, &st) < 0) {
+        session->opts.hasOffset = 0;
+        return;
+    }
+    if (session->opts.offset > (long long)session->fileSize || session->opts.mtime != (long long)st.st_mtime) {
+        session->opts.offset = 0;
+    }
+    session->opts.mtime = st.st_mtime;
+    session->resumeOffset = session->opts.offset;
+    session->lastBlock = (session->fileSize - session->resumeOffset) / session->opts.blksize + 1;
+    session->readahead = session->resumeOffset;
+}
+
+// range d'un RRQ : seule la partie [début, début + longueur[ est envoyée, comme un fichier à
+// part entière terminé par un bloc court. Plusieurs sessions d'un même client se partagent
+// ainsi un gros fichier. La longueur est ramenée à la fin du fichier ; l'OACK renvoie la
+// partie retenue et la date du fichier, que le client compare entre ses sessions pour ne pas
+// assembler deux versions. Comme pour offset, seul un fichier projeté en mode octet s'y prête.
+// Retourne 0 si la partie ne peut pas être servie.
+int rangeDownload(Session *session) {
+    struct stat st;
+    if (!session->zeroCopy || session->opts.rangeStart > (long long)session->fileSize || fstat(session->fileFd, &st) < 0) {
+        return 0;
+    }
+    if (session->opts.rangeLength > (long long)session->fileSize - session->opts.rangeStart) {
+        session->opts.rangeLength = session->fileSize - session->opts.rangeStart;
+    }
+    session->opts.mtime = st.st_mtime;
+    session->resumeOffset = session->opts.rangeStart;
+    session->rangeEnd = session->resumeOffset + session->opts.rangeLength;
+    session->lastBlock = session->opts.rangeLength / session->opts.blksize + 1;
+    session->readahead = session->resumeOffset;
+    return 1;
+}
+
+// Remplissage de la fenêtre : lecture et envoi des blocs jusqu'à windowsize en vol
+void fillWindow(Engine *engine, Session *session) {
+    size_t blksize = session->opts.blksize;
+    unsigned long windowsize = session->opts.windowsize;
+
+    while (session->nextToSend < session->firstUnacked + windowsize &&
+           (session->lastBlock == 0 || session->nextToSend <= session->lastBlock)) {
+        unsigned long block = session->nextToSend;
+        if (block > session->highestSent) {
+            session->highestSent = block;
+            rttStart(&session->rtt, block); // Première émission : mesurable
+        } else {
+            metricAdd(&engine->metrics.retransmits, 1);
+        }
+        if (session->zeroCopy) {
+            queueMappedBlock(engine, session, block);
+            session->nextToSend++;
+            continue;
+        }
+
+        char *packet = session->window + (block % windowsize) * (blksize + 4);
+        if (block > session->lastRead) {
+            size_t bytesRead = readBlock(session, packet + 4, blksize);
+            unsigned int blockNum = wireBlockNum(block, session->opts.rollover);
+
+            // Préparation du paquet DATA
+            packet[0] = 0;
+            packet[1] = OP_DATA;
+            packet[2] = (blockNum >> 8) & 0xFF;
+            packet[3] = blockNum & 0xFF;
+            session->packetLens[block % windowsize] = bytesRead + 4;
+            session->lastRead = block;
+            session->transferred += bytesRead;
+
+            if (bytesRead < blksize) { // Dernier bloc
+                session->lastBlock = block;
+            }
+        }
+        queuePacket(engine, session, packet, session->packetLens[block % windowsize], NULL, 0);
+        session->nextToSend++;
+    }
+#ifndef NO_IO_URING
+    if (uringMode) {
+        uringReadahead(engine, session);
+    }
+#endif
+    flushPackets(engine, session);
+}
+
+// Projette le fichier d'un RRQ en mémoire. Retourne 0 si ce n'est pas possible
+// (fichier spécial, échec de mmap), auquel cas les blocs sont lus avec read.
+// En netascii la projection sert de source au convertisseur, sans envoi direct.
+int mapFile(Session *session) {
+    struct stat st;
+    int fd = session->fileFd;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    // Un fichier vide n'a rien à projeter : un seul bloc DATA vide sera envoyé
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            return 0;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        session->map = map;
+    }
+    session->fileSize = st.st_size;
+    session->rangeEnd = st.st_size;
+    session->mapped = 1;
+    session->inputLen = st.st_size;
+    if (!session->netascii) {
+        session->zeroCopy = 1;
+        // Le dernier bloc est toujours plus court que blksize, éventuellement vide
+        session->lastBlock = st.st_size / session->opts.blksize + 1;
+    }
+    return 1;
+}
+
+// Ajoute au lot un bloc DATA pris dans la projection : seul l'en-tête de 4 octets est construit
+void queueMappedBlock(Engine *engine, Session *session, unsigned long block) {
+    size_t blksize = session->opts.blksize;
+    size_t offset = session->resumeOffset + (block - 1) * blksize;
+    size_t len = offset < session->rangeEnd ? session->rangeEnd - offset : 0;
+    if (len > blksize) {
+        len = blksize;
+    }
+
+    unsigned int blockNum = wireBlockNum(block, session->opts.rollover);
+    char header[4];
+    header[0] = 0;
+    header[1] = OP_DATA;
+    header[2] = (blockNum >> 8) & 0xFF;
+    header[3] = blockNum & 0xFF;
+    queuePacket(engine, session, header, sizeof(header), session->map + offset, len);
+}
+
+// Lit les datagrammes en attente sur une socket non bloquante dans le lot de réception.
+// Retourne le nombre de datagrammes lus, 0 ou -1 quand il n'y a plus rien à lire.
+// Sans -B un seul recvmmsg remplace jusqu'à RECV_BATCH appels à recvfrom.
+int receiveBatch(Engine *engine, int sockfd, size_t maxLen) {
+    RecvBatch *batch = &engine->recvBatch;
+    int slots = batchIo ? RECV_BATCH : 1;
+
+    for (int i = 0; i < slots; i++) {
+        batch->iov[i].iov_base = batch->buffers + i * (MAX_PACKET_SIZE + 1);
+        batch->iov[i].iov_len = maxLen;
+        memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (batchIo) {
+        int count = recvmmsg(sockfd, batch->msgs, RECV_BATCH, 0, NULL);
+        if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvmmsg failed");
+        }
+        return count;
+    }
+
+    ssize_t len = recvmsg(sockfd, &batch->msgs[0].msg_hdr, 0);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvmsg failed");
+        }
+        return -1;
+    }
+    batch->msgs[0].msg_len = len;
+    return 1;
+}
+
+// Ajoute un paquet au lot d'envoi de la session : head (en-tête ou paquet complet), suivi
+// éventuellement de data. Les deux zones doivent rester valides jusqu'à flushPackets,
+// sauf un en-tête de 4 octets qui est recopié dans le lot. Avec -B le paquet part aussitôt.
+void queuePacket(Engine *engine, Session *session, const void *head, size_t headLen, const void *data, size_t dataLen) {
+    SendBatch *batch = &engine->sendBatch;
+    if (batch->count == SEND_BATCH) {
+        flushPackets(engine, session);
+    }
+    metricAdd(&engine->metrics.packetsSent, 1);
+    metricAdd(&engine->metrics.bytesSent, headLen + dataLen - 4);
+
+    int i = batch->count++;
+    struct iovec *iov = batch->iov[i];
+    if (headLen == sizeof(batch->headers[i])) {
+        memcpy(batch->headers[i], head, headLen);
+        head = batch->headers[i];
+    }
+    iov[0].iov_base = (void *)head;
+    iov[0].iov_len = headLen;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = dataLen;
+
+    struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &session->clientAddr;
+    msg->msg_namelen = session->clientAddrLen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = dataLen > 0 ? 2 : 1;
+
+    if (!batchIo) {
+        flushPackets(engine, session);
+    }
+}
+
+// Émet le lot d'envoi sur la socket de la session. Si le tampon d'émission est plein,
+// le reste du lot est abandonné comme une perte réseau : le timer de la session le réémettra.
+void flushPackets(Engine *engine, Session *session) {
+    SendBatch *batch = &engine->sendBatch;
+    int sent = 0;
+
+#ifndef NO_IO_URING
+    if (uringMode && !gsoMode) {
+        uringQueueSends(engine, session);
+        batch->count = 0;
+        return;
+    }
+#endif
+
+    while (sent < batch->count) {
+        int n;
+        if (gsoMode) {
+            n = sendSegmented(engine, session, sent);
+        } else if (batchIo) {
+            n = sendmmsg(session->sockfd, batch->msgs + sent, batch->count - sent, 0);
+        } else {
+            n = sendmsg(session->sockfd, &batch->msgs[sent].msg_hdr, 0) < 0 ? -1 : 1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sent += n;
+    }
+    batch->count = 0;
+}
+
+// Envoie en un seul sendmsg UDP_SEGMENT la plus longue suite de paquets du lot qui commence
+// à first et dont tous les paquets sauf le dernier ont la même taille : la pile découpe le
+// tampon en datagrammes de cette taille, chacun commençant par son propre en-tête TFTP.
+// Retourne le nombre de paquets envoyés, 0 si GSO vient d'être désactivé, -1 en cas d'erreur.
+int sendSegmented(Engine *engine, Session *session, int first) {
+    SendBatch *batch = &engine->sendBatch;
+    size_t segmentSize = batch->iov[first][0].iov_len + batch->iov[first][1].iov_len;
+    size_t total = 0;
+    int count = 0, iovCount = 0;
+
+    for (int i = first; i < batch->count && count < GSO_MAX_SEGMENTS; i++) {
+        size_t len = batch->iov[i][0].iov_len + batch->iov[i][1].iov_len;
+        if (len > segmentSize || total + len > GSO_MAX_BYTES) {
+            break;
+        }
+        for (size_t j = 0; j < batch->msgs[i].msg_hdr.msg_iovlen; j++) {
+            batch->gsoIov[iovCount++] = batch->iov[i][j];
+        }
+        total += len;
+        count++;
+        if (len < segmentSize) {
+            break; // Seul le dernier segment peut être plus court
+        }
+    }
+
+    // Un paquet isolé part normalement
+    if (count == 1) {
+        return sendmsg(session->sockfd, &batch->msgs[first].msg_hdr, 0) < 0 ? -1 : 1;
+    }
+
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &session->clientAddr;
+    msg.msg_namelen = session->clientAddrLen;
+    msg.msg_iov = batch->gsoIov;
+    msg.msg_iovlen = iovCount;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gsoSize = segmentSize;
+    memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+
+    if (sendmsg(session->sockfd, &msg, 0) < 0) {
+        // L'interface de sortie ne sait pas segmenter (pas de somme de contrôle matérielle) :
+        // on repasse aux envois classiques pour toutes les sessions
+        if (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP) {
+            perror("UDP GSO send failed, falling back to regular sends");
+            gsoMode = 0;
+            return 0;
+        }
+        return -1;
+    }
+    return count;
+}
+
+// Vrai si le noyau accepte l'option UDP_SEGMENT (Linux 4.18 et suivants)
+int gsoSupported(void) {
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe < 0) {
+        return 0;
+    }
+    int size = DEFAULT_BLKSIZE + 4;
+    int supported = setsockopt(probe, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+    close(probe);
+    return supported;
+}
+
+#ifndef NO_IO_URING
+// Crée l'anneau et les deux groupes de tampons fournis, puis arme la réception multishot de
+// la socket d'écoute et l'attente de l'eventfd d'écriture. Retourne 0 si le noyau est trop
+// ancien (il faut Linux 6.0 pour la réception multishot) ou si io_uring est désactivé.
+int uringInit(Engine *engine) {
+    Uring *ring = &engine->ring;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        perror("io_uring_setup failed");
+        return 0;
+    }
+
+    // Anneaux SQ et CQ dans une seule projection, timeout dans io_uring_enter, CQE omis sur succès
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_CQE_SKIP;
+    if ((params.features & needed) != needed) {
+        close(ring->fd);
+        return 0;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("io_uring mmap failed");
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sqEntries = params.sq_entries;
+    ring->sqHead = (unsigned *)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(rings + params.sq_off.array);
+    ring->sqes = sqes;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned *)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    // L'entrée i de la file pointe toujours sur le SQE i
+    for (unsigned i = 0; i < ring->sqEntries; i++) {
+        ring->sqArray[i] = i;
+    }
+
+    memset(&ring->recvTemplate, 0, sizeof(ring->recvTemplate));
+    ring->recvTemplate.msg_namelen = sizeof(struct sockaddr_in);
+    if (!bufferRingInit(ring, &ring->small, URING_SMALL_GROUP, URING_SMALL_BUFFERS, URING_SMALL_SIZE) ||
+        !bufferRingInit(ring, &ring->large, URING_LARGE_GROUP, URING_LARGE_BUFFERS, URING_LARGE_SIZE)) {
+        close(ring->fd);
+        return 0;
+    }
+
+    uringRecv(engine, engine->listenfd, URING_LISTEN, URING_SMALL_GROUP);
+    uringPollWritten(engine);
+    return 1;
+}
+
+// Enregistre un groupe de tampons fournis (Linux 5.19) et les confie tous au noyau
+int bufferRingInit(Uring *ring, BufferRing *br, int group, unsigned entries, size_t size) {
+    br->ring = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    br->buffers = malloc(entries * size);
+    if (br->ring == MAP_FAILED || !br->buffers) {
+        perror("Failed to allocate io_uring buffers");
+        return 0;
+    }
+    br->entries = entries;
+    br->size = size;
+    br->tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)br->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("IORING_REGISTER_PBUF_RING failed");
+        return 0;
+    }
+    for (unsigned i = 0; i < entries; i++) {
+        bufferRingRecycle(br, i);
+    }
+    return 1;
+}
+
+// Rend au noyau le tampon bid ; un octet reste libre pour terminer une requête par '\0'
+void bufferRingRecycle(BufferRing *br, unsigned bid) {
+    struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+    buf->addr = (unsigned long long)(uintptr_t)(br->buffers + bid * br->size);
+    buf->len = br->size - 1;
+    buf->bid = bid;
+    br->tail++;
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+// Prochain SQE libre, mis à zéro ; la file pleine est soumise d'abord
+struct io_uring_sqe* uringSqe(Uring *ring) {
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        uringSubmit(ring, 0, -1);
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+// Publie les SQE préparés et, si wait, attend au moins un CQE ou timeoutMs (-1 : sans limite).
+// Le noyau a recopié les messages à la soumission : les copies préparées sont réutilisables.
+void uringSubmit(Uring *ring, int wait, long long timeoutMs) {
+    unsigned toSubmit = ring->sqLocalTail - *ring->sqTail;
+    if (toSubmit == 0 && !wait) {
+        return;
+    }
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned flags = 0, minComplete = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argSize = 0;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        minComplete = 1;
+        if (timeoutMs >= 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argSize = sizeof(arg);
+        }
+    }
+
+    if (syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, flags, argp, argSize) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter failed");
+    }
+    ring->staged = 0;
+}
+
+// Boucle du moteur io_uring : une seule entrée dans le noyau soumet les envois de l'itération
+// précédente et attend les réceptions suivantes ou l'échéance du premier timer
+void uringRun(Engine *engine) {
+    Uring *ring = &engine->ring;
+
+    while (1) {
+        uringSubmit(ring, 1, engineWaitMs(engine));
+
+        // Chaque CQE est recopié et son emplacement libéré avant traitement, qui peut soumettre
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ring->cqes[head & *ring->cqMask];
+            head++;
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            uringComplete(engine, &cqe);
+        }
+
+        // Expiration des timers échus
+        long long now = nowMs();
+        while (engine->timerCount > 0 && engine->timers[0]->deadline <= now) {
+            Session *session = engine->timers[0];
+            cancelTimer(engine, session);
+            sessionTimeout(engine, session);
+        }
+        engineStats(engine);
+    }
+}
+
+void uringComplete(Engine *engine, const struct io_uring_cqe *cqe) {
+    Uring *ring = &engine->ring;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int len;
+    struct sockaddr_in *addr;
+
+    if (cqe->user_data == URING_IGNORE) {
+        return;
+    }
+    if (cqe->user_data == URING_WRITTEN) {
+        writeCompletions(engine);
+        if (!more) {
+            uringPollWritten(engine);
+        }
+        return;
+    }
+    if (cqe->user_data == URING_LISTEN) {
+        char *packet = uringPayload(ring, &ring->small, cqe, &len, &addr);
+        if (packet) {
+            acceptRequest(engine, packet, len, addr, sizeof(*addr));
+            bufferRingRecycle(&ring->small, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (!more) {
+            uringRecv(engine, engine->listenfd, URING_LISTEN, URING_SMALL_GROUP);
+        }
+        return;
+    }
+
+    Session *session = (Session *)(uintptr_t)cqe->user_data;
+    BufferRing *br = session->opcode == OP_WRQ ? &ring->large : &ring->small;
+    char *packet = uringPayload(ring, br, cqe, &len, &addr);
+    if (!more) {
+        session->recvArmed = 0;
+    }
+
+    if (session->released) {
+        if (packet) {
+            bufferRingRecycle(br, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (!more) {
+            poolFree(&engine->pool, session, sizeof(Session));
+        }
+        return;
+    }
+
+    int alive = 1;
+    if (packet) {
+        alive = sessionDatagram(engine, session, packet, len, addr);
+        bufferRingRecycle(br, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    // Réception interrompue (plus de tampons libres, par exemple) : on la réarme
+    if (alive && !more) {
+        uringRecv(engine, session->sockfd, cqe->user_data, br == &ring->large ? URING_LARGE_GROUP : URING_SMALL_GROUP);
+        session->recvArmed = 1;
+    }
+}
+
+// Datagramme d'un CQE de réception multishot : le tampon commence par io_uring_recvmsg_out,
+// suivi de l'adresse source puis des données. Retourne NULL si le CQE n'en porte pas.
+char* uringPayload(Uring *ring, BufferRing *br, const struct io_uring_cqe *cqe, int *len, struct sockaddr_in **addr) {
+    if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            fprintf(stderr, "io_uring receive failed: %s\n", strerror(-cqe->res));
+        }
+        return NULL;
+    }
+
+    char *buffer = br->buffers + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * br->size;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+    size_t offset = sizeof(*out) + ring->recvTemplate.msg_namelen + ring->recvTemplate.msg_controllen;
+    size_t room = (size_t)cqe->res - offset; // Octets du datagramme réellement copiés
+    *addr = (struct sockaddr_in *)(buffer + sizeof(*out));
+    *len = out->payloadlen < room ? out->payloadlen : room;
+    return buffer + offset;
+}
+
+// Arme une réception multishot : chaque datagramme produit un CQE et consomme un tampon du groupe
+void uringRecv(Engine *engine, int fd, unsigned long long userData, int group) {
+    struct io_uring_sqe *sqe = uringSqe(&engine->ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)&engine->ring.recvTemplate;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = userData;
+}
+
+void uringPollWritten(Engine *engine) {
+    struct io_uring_sqe *sqe = uringSqe(&engine->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = engine->writeQueue.eventfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_WRITTEN;
+}
+
+// Le lot d'envoi de la session devient une suite de SQE SENDMSG. Avec MSG_DONTWAIT un tampon
+// d'émission plein fait échouer l'envoi comme avec sendmmsg, et un envoi réussi ne produit
+// pas de CQE.
+void uringQueueSends(Engine *engine, Session *session) {
+    Uring *ring = &engine->ring;
+    SendBatch *batch = &engine->sendBatch;
+
+    for (int i = 0; i < batch->count; i++) {
+        if (ring->staged == URING_ENTRIES) {
+            uringSubmit(ring, 0, -1);
+        }
+        struct io_uring_sqe *sqe = uringSqe(ring); // Peut soumettre : on prend l'emplacement après
+        int slot = ring->staged++;
+
+        struct iovec *iov = ring->iov[slot];
+        iov[0] = batch->iov[i][0];
+        iov[1] = batch->iov[i][1];
+        if (iov[0].iov_base == batch->headers[i]) {
+            memcpy(ring->headers[slot], batch->headers[i], sizeof(ring->headers[slot]));
+            iov[0].iov_base = ring->headers[slot];
+        }
+        ring->msgs[slot] = batch->msgs[i].msg_hdr;
+        ring->msgs[slot].msg_iov = iov;
 
-void sendError(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, int errorCode, const char *errorMsg);
-int waitForAck(int sockfd, struct sockaddr_in *clientAddr, socklen_t *clientAddrLen, unsigned int expectedBlockNum);
-// Déclaration de sendACK (ajoutez-la au début du fichier ou dans un fichier d'en-tête inclus)
-void sendACK(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, unsigned int blockNum);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = session->sockfd;
+        sqe->addr = (unsigned long long)(uintptr_t)&ring->msgs[slot];
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = URING_IGNORE;
+    }
 
+    // Les paquets lus par fread vivent dans l'anneau de la fenêtre, réécrit dès le prochain
+    // ACK : ils partent tout de suite. Les tranches projetées attendent la fin de l'itération.
+    if (!session->zeroCopy) {
+        uringSubmit(ring, 0, -1);
+    }
+}
 
+// Demande au noyau de lire d'avance la suite du fichier (POSIX_FADV_WILLNEED) par pas de
+// URING_READAHEAD, pour que les prochaines fenêtres ne bloquent pas la boucle sur le disque
+void uringReadahead(Engine *engine, Session *session) {
+    off_t position = session->resumeOffset + (off_t)session->nextToSend * session->opts.blksize;
+    if (position + URING_READAHEAD / 2 < session->readahead ||
+        (session->zeroCopy && session->readahead >= (off_t)session->rangeEnd)) {
+        return;
+    }
 
-int main() {
-     int sockfd;
-    struct sockaddr_in serverAddr, clientAddr;
-    char buffer[BUFFER_SIZE];
-    char serverIP[INET_ADDRSTRLEN];  // Buffer for the IP address
-    int serverPort;                  // Variable for the server port
-    socklen_t clientAddrLen = sizeof(clientAddr);
+    struct io_uring_sqe *sqe = uringSqe(&engine->ring);
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = session->fileFd;
+    sqe->off = session->readahead;
+    sqe->len = URING_READAHEAD;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_IGNORE;
+    session->readahead += URING_READAHEAD;
+}
+#endif
 
-    // Ask for server IP and port from the user
-    printf("Enter server IP address: ");
-    scanf("%s", serverIP);
-    printf("Enter server port (default is %d): ", TFTP_PORT);
-    scanf("%d", &serverPort);
+// Traitement d'un ACK pendant l'envoi d'un fichier. Retourne 0 si le transfert est terminé.
+int rrqAck(Engine *engine, Session *session, unsigned int ackNum) {
+    // L'ACK est cumulatif : on cherche le bloc en vol (ou le précédent) qui lui correspond
+    unsigned long acked = session->firstUnacked - 1;
+    int matched = 0;
+    for (unsigned long block = session->firstUnacked - 1; block < session->nextToSend; block++) {
+        if (wireBlockNum(block, session->opts.rollover) == ackNum) {
+            acked = block;
+            matched = 1;
+        }
+    }
+    if (!matched) {
+        metricAdd(&engine->metrics.duplicateAcks, 1);
+        return 1; // ACK périmé ou hors fenêtre
+    }
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    if (acked >= session->firstUnacked) {
+        session->firstUnacked = acked + 1;
+        session->lastProgress = nowMs();
+        session->rewoundOnDuplicate = 0;
+        metricObserve(&engine->metrics.rtt, rttBounds, RTT_BOUNDS, rttAcked(&session->rtt, acked));
+        if (session->lastBlock != 0 && session->firstUnacked > session->lastBlock) {
+            destroySession(engine, session); // Dernier bloc acquitté
+            return 0;
+        }
+        // Un ACK au milieu de la fenêtre signale une perte : la fenêtre suivante
+        // repart du bloc qui suit (RFC 7440)
+        if (session->nextToSend != session->firstUnacked) {
+            rttCancel(&session->rtt); // Le bloc mesuré peut être réémis
+        }
+        session->nextToSend = session->firstUnacked;
+    } else if (session->opts.windowsize > 1 && !session->rewoundOnDuplicate) {
+        // ACK du bloc déjà acquitté : le client a perdu le premier bloc de la fenêtre.
+        // Un seul rembobinage par doublon, pour ne pas dupliquer les rafales.
+        session->nextToSend = session->firstUnacked;
+        session->rewoundOnDuplicate = 1;
+        rttCancel(&session->rtt);
+    } else {
+        // Sans fenêtre, un ACK en double vient d'un DATA retardé ou réémis : y répondre
+        // doublerait chaque bloc jusqu'à la fin du transfert (apprenti sorcier), seul le
+        // timer réémet
+        metricAdd(&engine->metrics.duplicateAcks, 1);
+        return 1;
     }
 
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(serverPort);
-    if (inet_pton(AF_INET, serverIP, &serverAddr.sin_addr) <= 0) {
-        fprintf(stderr, "Invalid address/ Address not supported \n");
-        exit(EXIT_FAILURE);
+    fillWindow(engine, session);
+    armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
+    return 1;
+}
+
+
+int handleWRQ(Engine *engine, Session *session, const char* filename, const char* mode) {
+    session->netascii = (strcmp(mode, "netascii") == 0);
+    session->filename = poolAlloc(&engine->pool, strlen(filename) + 1);
+    session->tempName = poolAlloc(&engine->pool, strlen(filename) + sizeof(".XXXXXX"));
+    if (!session->filename || !session->tempName) {
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Out of memory");
+        return 0;
     }
 
-    if (bind(sockfd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+    // Écriture dans un fichier temporaire du même répertoire, renommé à la fin
+    strcpy(session->filename, filename);
+    int fd = session->opts.hasOffset ? openPartial(engine, session) : -1;
+    if (fd == -2) {
+        // Une session précédente, pas encore expirée, écrit toujours le fichier partiel :
+        // repartir de 0 à côté laisserait ce fichier en place pour de bon
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Server busy");
+        return 0;
+    }
+    if (fd < 0) {
+        sprintf(session->tempName, "%s.XXXXXX", filename);
+        fd = mkstemp(session->tempName);
+    }
+    if (fd < 0) {
+        poolFree(&engine->pool, session->tempName, strlen(session->tempName) + 1);
+        session->tempName = NULL;
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 2, "Cannot open file for writing");
+        return 0;
+    }
+    fchmod(fd, 0644);
+    if (session->opts.hasTsize && !reserveUpload(session, fd)) {
+        close(fd);
+        return 0; // destroySession supprime le fichier temporaire
     }
+    session->wb = wbOpen(&engine->writeQueue, &engine->pool, session, fd);
+    if (!session->wb) {
+        close(fd);
+        sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Out of memory");
+        return 0; // destroySession supprime le fichier temporaire
+    }
+    session->wb->offset = session->opts.offset; // Reprise : les blocs suivent la partie déjà reçue
 
-    printf("TFTP Server started on %s:%d...\n", serverIP, serverPort);
+    session->state = STATE_RECEIVING;
+    session->blockNum = 0;
+    // Un OACK remplace l'ACK du bloc 0 lorsque des options sont acceptées
+    if (hasOptions(&session->opts)) {
+        sendOACK(session->sockfd, &session->clientAddr, session->clientAddrLen, &session->opts);
+    } else {
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, 0);
+    }
+    rttStart(&session->rtt, 1);
 
-     // Configuration de select()
-    fd_set master_fds, read_fds;
-    FD_ZERO(&master_fds);
-    FD_SET(sockfd, &master_fds);
-    int fdmax = sockfd;
+    armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
+    return 1;
+}
 
-    while (1) {
-        read_fds = master_fds;
-        if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
-            perror("select");
-            exit(4);
+// offset d'un WRQ : le client annonce la date de sa source, le serveur répond par la
+// position où reprendre. Le fichier partiel d'un téléversement précédent de la même source
+// (même date) est repris à sa taille, arrondie à WB_ALIGN pour les écritures O_DIRECT ;
+// sinon il est vidé et le transfert part de 0. Un verrou exclusif empêche deux sessions
+// d'écrire le même fichier partiel. Retourne le descripteur, -2 si le fichier partiel est
+// verrouillé par une autre session (le client réessaiera), ou -1 si la reprise est
+// impossible (netascii, date inconnue) : l'option est alors ignorée.
+int openPartial(Engine *engine, Session *session) {
+    if (session->netascii || session->opts.mtime <= 0) {
+        session->opts.hasOffset = 0;
+        return -1;
+    }
+    char *partName = poolAlloc(&engine->pool, strlen(session->filename) + sizeof(PARTIAL_SUFFIX));
+    if (!partName) {
+        session->opts.hasOffset = 0;
+        return -1;
+    }
+    sprintf(partName, "%s%s", session->filename, PARTIAL_SUFFIX);
+    int fd = open(partName, O_WRONLY | O_CREAT, 0644);
+    int locked = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (fd >= 0 && !locked && errno == EWOULDBLOCK) {
+        close(fd);
+        poolFree(&engine->pool, partName, strlen(partName) + 1);
+        return -2;
+    }
+    struct stat st;
+    if (locked && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // La partie au-delà de la position annoncée est tronquée : le client la renverra
+        session->opts.offset = st.st_mtime == session->opts.mtime ? st.st_size / WB_ALIGN * WB_ALIGN : 0;
+        if (ftruncate(fd, session->opts.offset) == 0) {
+            poolFree(&engine->pool, session->tempName, strlen(session->filename) + sizeof(".XXXXXX"));
+            session->tempName = partName;
+            return fd;
         }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    poolFree(&engine->pool, partName, strlen(partName) + 1);
+    session->opts.hasOffset = 0;
+    return -1;
+}
 
-        if (FD_ISSET(sockfd, &read_fds)) {
-            int receivedBytes = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                                         (struct sockaddr *)&clientAddr, &clientAddrLen);
-            if (receivedBytes < 0) {
-                perror("recvfrom failed");
-                continue;
-            }
+// Réserve sur le disque la taille annoncée par tsize avant d'acquitter le WRQ : le fichier
+// est alloué d'un seul tenant au lieu de grandir bloc par bloc, et un téléversement qui ne
+// tiendrait pas est refusé avant tout transfert. FALLOC_FL_KEEP_SIZE laisse la taille du
+// fichier à zéro : un client qui envoie moins que prévu n'y laisse pas de zéros.
+// Retourne 0 (erreur envoyée) si la place manque.
+int reserveUpload(Session *session, int fd) {
+    long long tsize = session->opts.tsize;
+    if (tsize == 0) {
+        return 1;
+    }
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, tsize) == 0) {
+        return 1;
+    }
+    if (errno != ENOSPC && errno != EFBIG) {
+        // Système de fichiers sans fallocate : on se contente de vérifier la place libre
+        struct statvfs vfs;
+        if (fstatvfs(fd, &vfs) != 0 || (unsigned long long)vfs.f_bavail * vfs.f_frsize >= (unsigned long long)tsize) {
+            return 1;
+        }
+    }
+    sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 3, "Disk full or allocation exceeded");
+    return 0;
+}
 
-            // Traitement des requêtes
-            int opcode = buffer[1];
-            char *filename = buffer + 2;
-            char *mode = filename + strlen(filename) + 1;
-
-            switch (opcode) {
-                case OP_RRQ:
-                    handleRRQ(sockfd, &clientAddr, clientAddrLen, filename, mode);
-                    break;
-                case OP_WRQ:
-                    handleWRQ(sockfd, &clientAddr, clientAddrLen, filename, mode);
-                    break;
-                default:
-                    fprintf(stderr, "Unsupported request. Only RRQ and WRQ are supported.\n");
-                    break;
+// Traitement d'un paquet DATA pendant la réception d'un fichier
+void wrqData(Engine *engine, Session *session, const char *packet, ssize_t len) {
+    unsigned int receivedBlockNum = ((unsigned char)packet[2] << 8) | (unsigned char)packet[3];
+    metricAdd(&engine->metrics.packetsReceived, 1);
+    metricAdd(&engine->metrics.bytesReceived, len - 4);
+
+    if (session->state == STATE_RECEIVING && receivedBlockNum == wireBlockNum(session->blockNum + 1, session->opts.rollover)) {
+        session->blockNum++;
+        session->lastProgress = nowMs();
+        session->finalReceived = (len - 4 < session->opts.blksize);
+        metricObserve(&engine->metrics.rtt, rttBounds, RTT_BOUNDS, rttAcked(&session->rtt, session->blockNum));
+
+        const char *data = packet + 4;
+        size_t dataLen = len - 4;
+        session->transferred += dataLen;
+        if (session->netascii) {
+            dataLen = netasciiDecode(&session->ascii, data, dataLen, engine->convertBuffer);
+            if (session->finalReceived && session->ascii.sawCR) {
+                engine->convertBuffer[dataLen++] = '\r'; // CR isolé en fin de fichier
             }
+            data = engine->convertBuffer;
+        }
+        if (!wbAppend(session->wb, data, dataLen)) {
+            // Tous les tampons sont en écriture : l'ACK attend que le disque rattrape le réseau
+            session->state = STATE_FLUSHING;
+            armTimer(engine, session, nowMs() + rttMaxMs(&session->rtt));
+            return;
+        }
+        if (session->finalReceived) {
+            // Dernier bloc : l'ACK final ne part qu'une fois le fichier écrit et synchronisé
+            wbSubmit(session->wb, 1);
+            session->state = STATE_FLUSHING;
+            armTimer(engine, session, nowMs() + rttMaxMs(&session->rtt));
+            return;
         }
-    }
 
-    close(sockfd);
-    return 0;
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, receivedBlockNum);
+        rttStart(&session->rtt, session->blockNum + 1);
+        armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
+    } else if (session->state != STATE_FLUSHING && session->blockNum > 0 &&
+               receivedBlockNum == wireBlockNum(session->blockNum, session->opts.rollover)) {
+        // Doublon du bloc précédent : notre ACK s'est perdu, on le renvoie
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, receivedBlockNum);
+        metricAdd(&engine->metrics.retransmits, 1);
+        rttCancel(&session->rtt);
+    }
 }
 
-// Implement the handleRRQ function to handle read requests
-// Implement the handleRRQ function to handle read requests with bigfile support
-void handleRRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char *filename, const char *mode) {
-    FILE *file;
-    char buffer[BUFFER_SIZE];
-    unsigned int blockNum = 1; // Commence à 1
-    size_t bytesRead = 0;
+// Tampon rendu par le thread d'E/S : il redevient disponible, ce qui débloque un ACK
+// retenu ; après le fsync du dernier tampon le fichier remplace l'ancien et le dernier ACK part
+void wrqWritten(Engine *engine, Session *session, WriteJob *job) {
+    WriteStream *wb = session->wb;
+    job->busy = 0;
 
-    file = fopen(filename, "rb");
-    if (!file) {
-        sendError(sockfd, clientAddr, clientAddrLen, 1, "File not found");
+    if (job->error) {
+        fprintf(stderr, "Write failed: %s\n", strerror(job->error));
+        if (job->error == ENOSPC) {
+            sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 3, "Disk full or allocation exceeded");
+        } else {
+            sendError(session->sockfd, &session->clientAddr, session->clientAddrLen, 0, "Write failed");
+        }
+        destroySession(engine, session);
         return;
     }
-    // Avant la boucle d'envoi du fichier
-if (strcmp(mode, "netascii") == 0) {
-    // Conversion de '\n' à '\r\n' pour l'envoi
-    int c;
-    bytesRead = 0;
-    while (bytesRead < 512 && (c = fgetc(file)) != EOF) {
-        if (c == '\n') {
-            if (bytesRead < 511) { // Assurez-vous d'avoir de l'espace pour 2 caractères
-                buffer[4 + bytesRead++] = '\r';
-            }
-            buffer[4 + bytesRead++] = '\n';
+    session->lastProgress = nowMs();
+
+    if (job->final) {
+        close(wb->fd);
+        wb->fd = -1;
+        if (rename(session->tempName, session->filename) < 0) {
+            perror("rename failed");
         } else {
-            buffer[4 + bytesRead++] = c;
+            poolFree(&engine->pool, session->tempName, strlen(session->tempName) + 1);
+            session->tempName = NULL;
+        }
+        // On attend ensuite un éventuel doublon, au délai maximal de retransmission du client
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, wireBlockNum(session->blockNum, session->opts.rollover));
+        session->state = STATE_DALLYING;
+        armTimer(engine, session, nowMs() + rttMaxMs(&session->rtt));
+        return;
+    }
+
+    if (wb->fill < 0 && !wb->finalSubmitted) {
+        // Les tampons sont rendus dans l'ordre de soumission : celui-ci est le prochain à remplir
+        wb->fill = job - wb->jobs;
+        size_t pendingLen = wb->pendingLen;
+        wb->pendingLen = 0;
+        if (!wbAppend(wb, wb->pending, pendingLen)) {
+            return; // Le bloc en attente remplit encore le tampon : on attend le suivant
+        }
+
+        if (session->finalReceived) {
+            wbSubmit(wb, 1);
+            return;
         }
+        session->state = STATE_RECEIVING;
+        sendACK(session->sockfd, &session->clientAddr, session->clientAddrLen, wireBlockNum(session->blockNum, session->opts.rollover));
+        rttStart(&session->rtt, session->blockNum + 1);
+        armTimer(engine, session, nowMs() + rttTimeoutMs(&session->rtt));
     }
-} else {
-    // Mode octet, lecture directe
-    bytesRead = fread(buffer + 4, 1, 512, file);
 }
 
-    // Traitement selon le mode de transfert
-    int netascii = (strcmp(mode, "netascii") == 0);
+// Démarre le thread d'E/S ; avec -W seul l'eventfd sert, pour rendre les tampons par le même chemin
+void writeBehindInit(WriteQueue *queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    pthread_cond_init(&queue->written, NULL);
+    queue->eventfd = eventfd(0, EFD_NONBLOCK);
+    if (queue->eventfd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    if (writeBehind) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writeThread, queue) != 0) {
+            perror("Failed to create I/O thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
 
+// Thread d'E/S d'un moteur : écrit les tampons dans l'ordre de soumission, toutes sessions confondues
+void *writeThread(void *arg) {
+    WriteQueue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
     while (1) {
-        if (netascii) {
-            int c, prevC = EOF;
-            bytesRead = 0;
-            while (bytesRead < 512) {
-                c = fgetc(file);
-                if (c == '\n' && prevC != '\r') {
-                    buffer[4 + bytesRead++] = '\r';
-                }
-                if (c == EOF) break;
-                buffer[4 + bytesRead++] = c;
-                prevC = c;
+        while (!queue->head) {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+        WriteJob *job = queue->head;
+        queue->head = job->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        performWrite(job);
+
+        pthread_mutex_lock(&queue->lock);
+        job->stream->queued--;
+        pushWritten(queue, job);
+        pthread_cond_broadcast(&queue->written);
+    }
+    return NULL;
+}
+
+void performWrite(WriteJob *job) {
+    int fd = job->stream->fd;
+
+    // O_DIRECT exige une longueur alignée : le dernier tampon, incomplet, passe par le cache
+    if (job->final && job->stream->direct && job->len % WB_ALIGN != 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    }
+
+    size_t written = 0;
+    while (written < job->len) {
+        ssize_t n = pwrite(fd, job->data + written, job->len - written, job->offset + written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            job->error = errno;
+            return;
+        }
+        written += n;
+    }
+    if (job->final && fsync(fd) < 0) {
+        job->error = errno;
+    }
+}
+
+// Range un tampon écrit dans la liste des terminés et réveille la boucle ; verrou tenu
+void pushWritten(WriteQueue *queue, WriteJob *job) {
+    job->next = NULL;
+    if (queue->doneTail) {
+        queue->doneTail->next = job;
+    } else {
+        queue->doneHead = job;
+    }
+    queue->doneTail = job;
+
+    uint64_t one = 1;
+    if (write(queue->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write failed");
+    }
+}
+
+// Les tampons viennent du pool du moteur : leur classe de 256 Ko est alignée sur WB_ALIGN
+WriteStream* wbOpen(WriteQueue *queue, Pool *pool, Session *session, int fd) {
+    WriteStream *wb = poolCalloc(pool, sizeof(WriteStream));
+    if (!wb) {
+        return NULL;
+    }
+    wb->queue = queue;
+    wb->session = session;
+    wb->fd = fd;
+    wb->pendingSize = session->opts.blksize + 2; // Un bloc netascii décodé peut gagner un CR
+    wb->pending = poolAlloc(pool, wb->pendingSize);
+    for (int i = 0; i < WB_BUFFERS; i++) {
+        wb->jobs[i].stream = wb;
+        wb->jobs[i].data = poolAlloc(pool, WB_BUFFER_SIZE);
+        if (!wb->jobs[i].data) {
+            break;
+        }
+    }
+    if (!wb->pending || !wb->jobs[WB_BUFFERS - 1].data) {
+        wb->fd = -1; // Le descripteur reste à l'appelant
+        wbClose(wb, pool);
+        return NULL;
+    }
+
+    // Les tampons pleins sont alignés en adresse, en taille et en position : seul le dernier
+    // tampon doit repasser par le cache de pages
+    if (directIo) {
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) < 0) {
+            perror("O_DIRECT not supported here, using buffered writes");
         } else {
-            bytesRead = fread(buffer + 4, 1, 512, file);
+            wb->direct = 1;
+        }
+    }
+    return wb;
+}
+
+// Copie des données reçues dans les tampons, en soumettant chaque tampon plein.
+// Retourne 0 s'il ne reste aucun tampon libre pour la suite ; une partie des données
+// peut alors attendre dans pending.
+int wbAppend(WriteStream *wb, const char *data, size_t len) {
+    while (len > 0) {
+        if (wb->fill < 0) {
+            memmove(wb->pending + wb->pendingLen, data, len); // data peut pointer dans pending
+            wb->pendingLen += len;
+            return 0;
+        }
+        size_t room = WB_BUFFER_SIZE - wb->used;
+        size_t chunk = len < room ? len : room;
+        memcpy(wb->jobs[wb->fill].data + wb->used, data, chunk);
+        wb->used += chunk;
+        data += chunk;
+        len -= chunk;
+        if (wb->used == WB_BUFFER_SIZE) {
+            wbSubmit(wb, 0);
         }
+    }
+    return wb->fill >= 0;
+}
+
+// Soumet le tampon en remplissage ; le suivant prend le relais s'il est libre
+void wbSubmit(WriteStream *wb, int final) {
+    WriteQueue *queue = wb->queue;
+    WriteJob *job = &wb->jobs[wb->fill];
+    job->len = wb->used;
+    job->offset = wb->offset;
+    job->final = final;
+    job->busy = 1;
+    job->error = 0;
+    job->next = NULL;
+    wb->finalSubmitted = final;
+
+    wb->offset += wb->used;
+    wb->used = 0;
+    int next = (wb->fill + 1) % WB_BUFFERS;
+    wb->fill = wb->jobs[next].busy ? -1 : next;
 
-        // Préparation du paquet DATA
-        buffer[0] = 0;
-        buffer[1] = OP_DATA;
-        buffer[2] = (blockNum >> 8) & 0xFF;
-        buffer[3] = blockNum & 0xFF;
+    if (!writeBehind) {
+        performWrite(job); // -W : la boucle écrit elle-même, le tampon revient par la même file
+    }
 
-        // Envoi du paquet DATA et attente d'ACK
-        int ackReceived = 0, retries = 0;
-        while (!ackReceived && retries < MAX_RETRIES) {
-            sendto(sockfd, buffer, bytesRead + 4, 0, (struct sockaddr *)clientAddr, clientAddrLen);
-            ackReceived = waitForAck(sockfd, clientAddr, &clientAddrLen, blockNum);
-            retries++;
+    pthread_mutex_lock(&queue->lock);
+    if (writeBehind) {
+        if (queue->tail) {
+            queue->tail->next = job;
+        } else {
+            queue->head = job;
         }
+        queue->tail = job;
+        wb->queued++;
+        pthread_cond_signal(&queue->wake);
+    } else {
+        pushWritten(queue, job);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
 
-        if (!ackReceived) {
-            sendError(sockfd, clientAddr, clientAddrLen, 0, "Max retries reached, transfer aborted");
-            break;
+// Attend les écritures en cours du flux, oublie ses tampons déjà rendus mais pas encore
+// traités par la boucle, puis libère le tout
+void wbClose(WriteStream *wb, Pool *pool) {
+    WriteQueue *queue = wb->queue;
+    pthread_mutex_lock(&queue->lock);
+    while (wb->queued > 0) {
+        pthread_cond_wait(&queue->written, &queue->lock);
+    }
+    WriteJob **link = &queue->doneHead;
+    WriteJob *last = NULL;
+    while (*link) {
+        if ((*link)->stream == wb) {
+            *link = (*link)->next;
+        } else {
+            last = *link;
+            link = &last->next;
         }
+    }
+    queue->doneTail = last;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (wb->fd >= 0) {
+        close(wb->fd);
+    }
+    for (int i = 0; i < WB_BUFFERS; i++) {
+        poolFree(pool, wb->jobs[i].data, WB_BUFFER_SIZE);
+    }
+    poolFree(pool, wb->pending, wb->pendingSize);
+    poolFree(pool, wb, sizeof(WriteStream));
+}
 
-        if (bytesRead < 512) { // Dernier bloc
+// Traite les tampons rendus ; chacun est retiré de la liste un par un, car une session
+// détruite en cours de route retire elle-même ses tampons restants
+void writeCompletions(Engine *engine) {
+    WriteQueue *queue = &engine->writeQueue;
+    uint64_t count;
+    if (read(queue->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
+    }
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        WriteJob *job = queue->doneHead;
+        if (job) {
+            queue->doneHead = job->next;
+            if (!queue->doneHead) {
+                queue->doneTail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (!job) {
             break;
         }
+        wrqWritten(engine, job->stream->session, job);
+    }
+}
+
+long long nowMs(void) {
+    return nowUs() / 1000;
+}
+
+long long nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rttInit(RttEstimator *rtt, int fixedMs) {
+    memset(rtt, 0, sizeof(*rtt));
+    rtt->fixedMs = fixedMs;
+    rtt->rtoMs = fixedMs ? fixedMs : INITIAL_RTO_MS;
+}
+
+// Début de mesure à l'émission d'un paquet qui attend la réponse seq ; une seule à la fois
+void rttStart(RttEstimator *rtt, unsigned long seq) {
+    if (!rtt->timing) {
+        rtt->timing = 1;
+        rtt->timedSeq = seq;
+        rtt->sentUs = nowUs();
+    }
+}
 
-        blockNum = (blockNum == 65535) ? 1 : blockNum + 1; // Gestion du roll-over
+// Réponse seq reçue (cumulative) : nouvel échantillon si elle couvre le paquet mesuré.
+// Retourne l'échantillon en µs, -1 s'il n'y en a pas.
+long long rttAcked(RttEstimator *rtt, unsigned long seq) {
+    if (!rtt->timing || seq < rtt->timedSeq) {
+        return -1;
     }
+    rtt->timing = 0;
+
+    long long sample = nowUs() - rtt->sentUs;
+    if (!rtt->hasSample) {
+        rtt->srttUs = sample;
+        rtt->rttvarUs = sample / 2;
+        rtt->hasSample = 1;
+    } else {
+        long long delta = rtt->srttUs > sample ? rtt->srttUs - sample : sample - rtt->srttUs;
+        rtt->rttvarUs = (3 * rtt->rttvarUs + delta) / 4;
+        rtt->srttUs = (7 * rtt->srttUs + sample) / 8;
+    }
+
+    long long rto = (rtt->srttUs + 4 * rtt->rttvarUs) / 1000;
+    rtt->rtoMs = rto < MIN_RTO_MS ? MIN_RTO_MS : (rto > MAX_RTO_MS ? MAX_RTO_MS : rto);
+    return sample;
+}
+
+// Le paquet mesuré va être réémis : sa réponse serait ambiguë (Karn)
+void rttCancel(RttEstimator *rtt) {
+    rtt->timing = 0;
+}
+
+// Timeout : le délai double jusqu'au plafond, jusqu'à la prochaine mesure valide
+void rttBackoff(RttEstimator *rtt) {
+    rtt->timing = 0;
+    rtt->rtoMs = rtt->rtoMs * 2 > MAX_RTO_MS ? MAX_RTO_MS : rtt->rtoMs * 2;
+}
 
-    fclose(file);
+long long rttTimeoutMs(const RttEstimator *rtt) {
+    return rtt->fixedMs ? rtt->fixedMs : rtt->rtoMs;
 }
 
+// Délai maximal entre deux retransmissions, qui fixe aussi l'abandon et l'attente finale
+long long rttMaxMs(const RttEstimator *rtt) {
+    return rtt->fixedMs ? rtt->fixedMs : MAX_RTO_MS;
+}
 
-void handleWRQ(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const char* filename, const char* mode) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        sendError(sockfd, clientAddr, clientAddrLen, 2, "Cannot open file for writing");
+// (Ré)arme le timer d'une session dans le tas
+void armTimer(Engine *engine, Session *session, long long deadline) {
+    if (session->timerIndex < 0) {
+        session->timerIndex = engine->timerCount;
+        engine->timers[engine->timerCount++] = session;
+        session->deadline = deadline;
+        timerSiftUp(engine, session->timerIndex);
         return;
     }
 
-    unsigned int blockNum = 0;
-    sendACK(sockfd, clientAddr, clientAddrLen, blockNum);
+    long long previous = session->deadline;
+    session->deadline = deadline;
+    if (deadline < previous) {
+        timerSiftUp(engine, session->timerIndex);
+    } else {
+        timerSiftDown(engine, session->timerIndex);
+    }
+}
 
-    char buffer[BUFFER_SIZE];
-    int lastPacketSize = 0;
+void cancelTimer(Engine *engine, Session *session) {
+    int index = session->timerIndex;
+    if (index < 0) {
+        return;
+    }
 
-    while (1) {
-        struct sockaddr_in fromAddr;
-        socklen_t fromAddrLen = sizeof(fromAddr);
-        fd_set readfds;
-        struct timeval tv;
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-        tv.tv_sec = TIMEOUT_SEC;
-        tv.tv_usec = 0;
-
-        int retval = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-        if (retval > 0) {
-            ssize_t receivedBytes = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
-            if (receivedBytes < 0) {
-                perror("recvfrom failed");
-                break;
-            }
+    session->timerIndex = -1;
+    Session *last = engine->timers[--engine->timerCount];
+    if (index == engine->timerCount) {
+        return;
+    }
+    engine->timers[index] = last;
+    last->timerIndex = index;
+    timerSiftUp(engine, index);
+    timerSiftDown(engine, last->timerIndex);
+}
 
-            if (buffer[1] == OP_DATA) {
-                unsigned int receivedBlockNum = ((unsigned char)buffer[2] << 8) + (unsigned char)buffer[3];
-                if (receivedBlockNum == (blockNum + 1)) {
-                    fwrite(buffer + 4, 1, receivedBytes - 4, file);
-                    blockNum = receivedBlockNum;
-                    sendACK(sockfd, clientAddr, clientAddrLen, blockNum);
+void timerSiftUp(Engine *engine, int index) {
+    Session **timers = engine->timers;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (timers[parent]->deadline <= timers[index]->deadline) {
+            break;
+        }
+        Session *tmp = timers[parent];
+        timers[parent] = timers[index];
+        timers[index] = tmp;
+        timers[parent]->timerIndex = parent;
+        timers[index]->timerIndex = index;
+        index = parent;
+    }
+}
 
-                    if (receivedBytes < BUFFER_SIZE) {
-                        lastPacketSize = 1;
-                        break;
-                    }
-                }
-            } else if (buffer[1] == OP_ERROR) {
-                fprintf(stderr, "Error packet received\n");
-                break;
-            }
-        } else if (retval == 0) {
-            printf("Timeout waiting for block %u\n", blockNum + 1);
-            sendACK(sockfd, clientAddr, clientAddrLen, blockNum);
-        } else {
-            perror("Select error");
+void timerSiftDown(Engine *engine, int index) {
+    Session **timers = engine->timers;
+    while (1) {
+        int smallest = index;
+        int left = 2 * index + 1, right = left + 1;
+        if (left < engine->timerCount && timers[left]->deadline < timers[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < engine->timerCount && timers[right]->deadline < timers[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == index) {
             break;
         }
+        Session *tmp = timers[smallest];
+        timers[smallest] = timers[index];
+        timers[index] = tmp;
+        timers[smallest]->timerIndex = smallest;
+        timers[index]->timerIndex = index;
+        index = smallest;
+    }
+}
+
+// Lit le prochain bloc du fichier, converti en netascii si besoin. Retourne sa taille.
+size_t readBlock(Session *session, char *data, size_t blksize) {
+    size_t len = 0;
+    ssize_t n;
+
+    if (!session->netascii) {
+        // Fichier spécial en mode octet : lecture directe dans le paquet
+        while (len < blksize && (n = read(session->fileFd, data + len, blksize - len)) > 0) {
+            len += n;
+        }
+        return len;
+    }
+
+    while (len < blksize) {
+        if (!session->mapped && session->inputPos == session->inputLen &&
+            (n = read(session->fileFd, session->readBuffer, blksize)) > 0) {
+            session->inputLen = n;
+            session->inputPos = 0;
+        }
+        const char *input = session->mapped ? session->map : session->readBuffer;
+        size_t consumed;
+        size_t written = netasciiEncode(&session->ascii, input + session->inputPos,
+                                        session->inputLen - session->inputPos, &consumed,
+                                        data + len, blksize - len);
+        if (written == 0) {
+            break; // Fin du fichier
+        }
+        session->inputPos += consumed;
+        len += written;
     }
+    return len;
+}
 
-    fclose(file);
+// Position du premier CR ou LF de p, len s'il n'y en a pas. Avec SSE2 on compare
+// 16 octets à la fois, ce qui laisse le texte sans fin de ligne passer à la vitesse de memcpy.
+size_t findLineBreak(const char *p, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == '\r' || p[i] == '\n') {
+            return i;
+        }
+    }
+    return len;
 }
 
+// Convertit in en netascii dans out, jusqu'à le remplir. Le second octet d'une paire qui ne
+// tient plus attend dans l'état le bloc suivant. Retourne le nombre d'octets écrits ;
+// consumed reçoit le nombre d'octets lus dans in.
+size_t netasciiEncode(NetasciiState *state, const char *in, size_t inLen, size_t *consumed, char *out, size_t outLen) {
+    size_t i = 0, o = 0;
+    if (state->hasPending && outLen > 0) {
+        out[o++] = state->pending;
+        state->hasPending = 0;
+    }
 
-int waitForAck(int sockfd, struct sockaddr_in *clientAddr, socklen_t *clientAddrLen, unsigned int expectedBlockNum) {
-    char buffer[4]; // Taille suffisante pour un paquet ACK
-    struct timeval tv;
-    fd_set readfds;
+    while (i < inLen && o < outLen) {
+        size_t room = inLen - i < outLen - o ? inLen - i : outLen - o;
+        size_t run = findLineBreak(in + i, room);
+        memcpy(out + o, in + i, run);
+        i += run;
+        o += run;
+        if (run == room) {
+            break;
+        }
 
-    FD_ZERO(&readfds);
-    FD_SET(sockfd, &readfds);
+        char second = in[i++] == '\n' ? '\n' : '\0';
+        out[o++] = '\r';
+        if (o < outLen) {
+            out[o++] = second;
+        } else {
+            state->pending = second;
+            state->hasPending = 1;
+        }
+    }
+    *consumed = i;
+    return o;
+}
 
-    // Configurer le timeout
-    tv.tv_sec = TIMEOUT_SEC;
-    tv.tv_usec = 0;
+// Conversion inverse d'un bloc reçu : CR LF devient LF et CR NUL devient CR ; un CR suivi
+// d'autre chose est gardé tel quel. out doit avoir la place de inLen + 1 octets (CR du bloc
+// précédent). memchr, vectorisé par la libc, cherche les CR.
+size_t netasciiDecode(NetasciiState *state, const char *in, size_t inLen, char *out) {
+    size_t i = 0, o = 0;
+    if (state->sawCR && inLen > 0) {
+        state->sawCR = 0;
+        if (in[0] == '\n' || in[0] == '\0') {
+            i++;
+        }
+        out[o++] = in[0] == '\n' ? '\n' : '\r';
+    }
 
-    // Attendre la réponse
-    if (select(sockfd + 1, &readfds, NULL, NULL, &tv) > 0) {
-        // Un paquet est arrivé, vérifier s'il s'agit d'un ACK
-        if (recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)clientAddr, clientAddrLen) >= 4) {
-            // Vérifier l'opcode et le numéro de bloc
-            if (buffer[1] == OP_ACK) {
-                unsigned int blockNum = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
-                if (blockNum == expectedBlockNum) {
-                    return 1; // C'est l'ACK attendu
-                }
-            }
+    while (i < inLen) {
+        const char *cr = memchr(in + i, '\r', inLen - i);
+        size_t run = cr ? (size_t)(cr - (in + i)) : inLen - i;
+        memcpy(out + o, in + i, run);
+        i += run;
+        o += run;
+        if (!cr) {
+            break;
+        }
+
+        i++;
+        if (i == inLen) {
+            state->sawCR = 1; // La suite de la paire est dans le bloc suivant
+            break;
+        }
+        if (in[i] == '\n' || in[i] == '\0') {
+            out[o++] = in[i] == '\n' ? '\n' : '\r';
+            i++;
+        } else {
+            out[o++] = '\r';
         }
     }
+    return o;
+}
 
-    return 0; // Timeout ou ACK incorrect
+// Numéro de bloc sur 16 bits d'un bloc absolu : après 65535 on repart à rollover (0 ou 1)
+unsigned int wireBlockNum(unsigned long block, int rollover) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rollover ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
 }
 
 
@@ -312,11 +2977,174 @@ void sendACK(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen
     // Envoyer le paquet ACK au client
     if (sendto(sockfd, ackPacket, sizeof(ackPacket), 0, (struct sockaddr *)clientAddr, clientAddrLen) < 0) {
         perror("sendACK failed");
-        exit(EXIT_FAILURE);
     }
 }
 
+// Analyse la liste d'options "nom\0valeur\0..." qui suit le mode (RFC 2347).
+// Les options inconnues ou invalides sont ignorées, comme le veut la RFC.
+void parseOptions(int opcode, const char *options, const char *end, struct sockaddr_in *clientAddr, TftpOptions *opts) {
+    opts->blksize = DEFAULT_BLKSIZE;
+    opts->hasBlksize = 0;
+    opts->windowsize = 1;
+    opts->hasWindowsize = 0;
+    opts->timeout = 0;
+    opts->hasTimeout = 0;
+    opts->rollover = rolloverBase;
+    opts->hasRollover = 0;
+    opts->tsize = 0;
+    opts->hasTsize = 0;
+    opts->offset = 0;
+    opts->mtime = 0;
+    opts->hasOffset = 0;
+    opts->rangeStart = 0;
+    opts->rangeLength = 0;
+    opts->hasRange = 0;
+
+    const char *name = options;
+    while (name < end) {
+        const char *value = name + strlen(name) + 1;
+        if (value >= end) {
+            break;
+        }
+
+        if (strcasecmp(name, OPTION_BLKSIZE) == 0) {
+            // RFC 2348 : 8 <= blksize <= 65464, le serveur peut proposer moins
+            int requested = atoi(value);
+            if (requested >= MIN_BLKSIZE) {
+                if (requested > MAX_BLKSIZE) {
+                    requested = MAX_BLKSIZE;
+                }
+                if (clampToPathMtu) {
+                    int mtuBlksize = pathMtuBlksize(clientAddr);
+                    if (requested > mtuBlksize) {
+                        requested = mtuBlksize;
+                    }
+                }
+                opts->blksize = requested;
+                opts->hasBlksize = 1;
+            }
+        } else if (strcasecmp(name, OPTION_WINDOWSIZE) == 0 && opcode == OP_RRQ) {
+            // RFC 7440 : 1 <= windowsize <= 65535, le serveur peut proposer moins.
+            // Seul l'envoi (RRQ) est fenêtré, le WRQ reste en lock-step.
+            int requested = atoi(value);
+            if (requested >= 1) {
+                opts->windowsize = requested > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : requested;
+                opts->hasWindowsize = 1;
+            }
+        } else if (strcasecmp(name, OPTION_TIMEOUT) == 0) {
+            // RFC 2349 : une valeur hors de 1..255 fait ignorer l'option
+            int requested = atoi(value);
+            if (requested >= MIN_TIMEOUT_OPTION && requested <= MAX_TIMEOUT_OPTION) {
+                opts->timeout = requested;
+                opts->hasTimeout = 1;
+            }
+        } else if (strcasecmp(name, OPTION_ROLLOVER) == 0) {
+            // Seules les valeurs 0 et 1 ont un sens ; le client impose sa convention
+            if (strcmp(value, "0") == 0 || strcmp(value, "1") == 0) {
+                opts->rollover = value[0] - '0';
+                opts->hasRollover = 1;
+            }
+        } else if (strcasecmp(name, OPTION_TSIZE) == 0) {
+            // RFC 2349 : 0 dans un RRQ (le serveur répond par la taille), la taille du fichier
+            // dans un WRQ
+            char *endptr;
+            long long requested = strtoll(value, &endptr, 10);
+            if (*value != '\0' && *endptr == '\0' && requested >= 0) {
+                opts->tsize = requested;
+                opts->hasTsize = 1;
+            }
+        } else if (strcasecmp(name, OPTION_OFFSET) == 0) {
+            // "octets,mtime" : position déjà transférée et date de la version correspondante.
+            // La position d'un WRQ est choisie par le serveur, seule la date compte.
+            char *endptr;
+            long long requested = strtoll(value, &endptr, 10);
+            long long mtime = 0;
+            if (*endptr == ',') {
+                mtime = strtoll(endptr + 1, &endptr, 10);
+            }
+            if (*value != '\0' && *endptr == '\0' && requested >= 0) {
+                opts->offset = opcode == OP_RRQ ? requested : 0;
+                opts->mtime = mtime;
+                opts->hasOffset = 1;
+            }
+        } else if (strcasecmp(name, OPTION_RANGE) == 0 && opcode == OP_RRQ) {
+            // "début,longueur" en octets
+            char *endptr;
+            long long start = strtoll(value, &endptr, 10);
+            long long length = -1;
+            if (*endptr == ',') {
+                length = strtoll(endptr + 1, &endptr, 10);
+            }
+            if (*value != '\0' && *endptr == '\0' && start >= 0 && length >= 0) {
+                opts->rangeStart = start;
+                opts->rangeLength = length;
+                opts->hasRange = 1;
+            }
+        }
+
+        name = value + strlen(value) + 1;
+    }
+}
+
+// Retourne la plus grande taille de bloc qui tient dans le MTU du chemin vers le client,
+// afin d'éviter la fragmentation IP des paquets DATA.
+int pathMtuBlksize(struct sockaddr_in *clientAddr) {
+    int blksize = MAX_BLKSIZE;
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe < 0) {
+        return blksize;
+    }
+
+    // IP_MTU n'est disponible que sur une socket connectée
+    int mtu;
+    socklen_t mtuLen = sizeof(mtu);
+    if (connect(probe, (struct sockaddr *)clientAddr, sizeof(*clientAddr)) == 0 &&
+        getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &mtuLen) == 0) {
+        blksize = mtu - IP_UDP_HEADERS - 4;
+        if (blksize < MIN_BLKSIZE) {
+            blksize = MIN_BLKSIZE;
+        } else if (blksize > MAX_BLKSIZE) {
+            blksize = MAX_BLKSIZE;
+        }
+    }
+
+    close(probe);
+    return blksize;
+}
 
+void sendOACK(int sockfd, struct sockaddr_in *clientAddr, socklen_t clientAddrLen, const TftpOptions *opts) {
+    char buffer[BUFFER_SIZE];
+    int len = 0;
 
+    buffer[len++] = 0;
+    buffer[len++] = OP_OACK;
+    if (opts->hasBlksize) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_BLKSIZE, 0, opts->blksize, 0);
+    }
+    if (opts->hasWindowsize) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_WINDOWSIZE, 0, opts->windowsize, 0);
+    }
+    if (opts->hasTimeout) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_TIMEOUT, 0, opts->timeout, 0);
+    }
+    if (opts->hasRollover) {
+        len += sprintf(buffer + len, "%s%c%d%c", OPTION_ROLLOVER, 0, opts->rollover, 0);
+    }
+    if (opts->hasTsize) {
+        len += sprintf(buffer + len, "%s%c%lld%c", OPTION_TSIZE, 0, opts->tsize, 0);
+    }
+    if (opts->hasOffset) {
+        len += sprintf(buffer + len, "%s%c%lld,%lld%c", OPTION_OFFSET, 0, opts->offset, opts->mtime, 0);
+    }
+    if (opts->hasRange) {
+        len += sprintf(buffer + len, "%s%c%lld,%lld,%lld%c", OPTION_RANGE, 0, opts->rangeStart, opts->rangeLength, opts->mtime, 0);
+    }
 
+    if (sendto(sockfd, buffer, len, 0, (struct sockaddr *)clientAddr, clientAddrLen) < 0) {
+        perror("sendOACK failed");
+    }
+}
 
+int hasOptions(const TftpOptions *opts) {
+    return opts->hasBlksize || opts->hasWindowsize || opts->hasTimeout || opts->hasRollover || opts->hasTsize || opts->hasOffset || opts->hasRange;
+}
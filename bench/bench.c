@@ -0,0 +1,506 @@
+// Banc de charge TFTP : lance de nombreux RRQ simultanés depuis un seul processus
+// et mesure le temps de complétion de chacun. Avec -u taille, les sessions téléversent
+// chacune taille octets (WRQ, en pas à pas) vers fichier.N au lieu de lire fichier.
+//
+// Des sessions "bloquées" (-S) envoient leur RRQ puis n'acquittent jamais rien ;
+// sur un serveur qui traite les sessions une par une, elles figent toutes les autres
+// jusqu'à épuisement des retransmissions. Sur un serveur événementiel, la latence
+// des sessions saines doit rester la même avec ou sans sessions bloquées.
+//
+// Le débit est aussi donné en paquets par seconde (DATA reçus + ACK émis), pour
+// comparer les modes d'entrées/sorties d'un même serveur, par exemple le serveur
+// de l'étape 4 avec ses lots recvmmsg/sendmmsg et avec -B (un appel par paquet).
+//
+// Avec -P pid, le temps CPU consommé par le serveur pendant la mesure est lu dans
+// /proc et rapporté au volume servi (secondes CPU par Go), par exemple pour comparer
+// les envois classiques et les envois segmentés UDP GSO (-G) du serveur de l'étape 4.
+//
+// Sous pertes (serveur de l'étape 3 lancé avec -I), les sessions réémettent leur dernier
+// paquet après RETRY_US sans réponse, mais jamais sur un doublon : les doublons reçus sont
+// comptés à part, un nombre qui suit celui des paquets trahit une tempête de doublons
+// (syndrome de l'apprenti sorcier, où chaque doublon en provoque un autre).
+//
+// Avec -r 0|1, l'option rollover est demandée au serveur et les numéros de bloc suivent le
+// passage choisi après 65535. bench ne compare pas les octets reçus : les transferts de plus
+// de 65535 blocs sont vérifiés octet par octet par bench/rollover.sh.
+//
+// bench/run.sh lance un serveur de l'étape choisie sur la boucle locale et enchaîne les mesures.
+//
+// Usage : bench -s 127.0.0.1 -p 6969 -f fichier [-n sessions] [-S bloquées] [-u taille]
+//               [-b blksize] [-w windowsize] [-r 0|1] [-T secondes] [-P pid du serveur]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#define OP_RRQ 1
+#define OP_WRQ 2
+#define OP_DATA 3
+#define OP_ACK 4
+#define OP_ERROR 5
+#define OP_OACK 6
+#define DEFAULT_BLKSIZE 512
+#define MAX_PACKET_SIZE (65464 + 4)
+#define MAX_EVENTS 256
+#define RETRY_US 500000 // Silence du serveur après lequel une session réémet son dernier paquet
+
+// Un client simulé
+typedef struct {
+    int sockfd;
+    int stalled;             // N'acquitte jamais rien
+    int done;                // 1 terminé, -1 échec
+    int blksize;
+    int windowsize;
+    unsigned int expected;   // Prochain numéro de bloc attendu
+    unsigned int lastBlock;  // Dernier bloc reçu dans l'ordre (0 au départ)
+    int receivedInWindow;
+    unsigned long sentBlock; // Téléversement : dernier bloc DATA émis (numéro absolu, 0 au départ)
+    size_t sentLen;          // Taille de ses données
+    unsigned long long bytes;
+    unsigned long long packets; // DATA reçus et ACK émis (DATA émis et ACK reçus en téléversement)
+    long long start, end;    // En microsecondes
+    long long lastHeardUs;   // Dernier paquet du serveur, ou dernière réémission
+    struct sockaddr_in peer; // TID du serveur, connu à sa première réponse
+    int hasPeer;
+    char request[512];       // RRQ ou WRQ, réémis tant que le serveur ne répond pas
+    int requestLen;
+    unsigned long long duplicates; // DATA ou ACK reçus en double ou hors séquence
+    unsigned long long retries;    // Réémissions sur expiration du délai
+    unsigned long long strangers;  // Paquets d'un autre TID que le serveur, rejetés (erreur 5)
+} Client;
+
+// Numéro de bloc qui suit 65535 : 0 par défaut comme les serveurs, 1 avec -r 1
+int rolloverBase = 0;
+int sendRollover = 0;
+
+// Téléversement (-u) : taille envoyée par chaque session, -1 pour lire ; les blocs partent
+// tous du même tampon, seule la taille du dernier change
+long long uploadSize = -1;
+char *uploadData = NULL;
+
+long long nowUs(void);
+int startClient(Client *client, int epollfd, struct sockaddr_in *serverAddr, const char *filename, int blksize, int windowsize);
+void clientPacket(Client *client, const char *packet, int len, struct sockaddr_in *fromAddr);
+void uploadAck(Client *client, unsigned int blockNum, struct sockaddr_in *toAddr);
+void sendData(Client *client, struct sockaddr_in *toAddr);
+void sendAck(Client *client, unsigned int blockNum, struct sockaddr_in *toAddr);
+void rejectUnknownTid(Client *client, struct sockaddr_in *fromAddr);
+void clientRetry(Client *client, struct sockaddr_in *serverAddr);
+unsigned int nextBlockNum(unsigned int blockNum);
+unsigned int wireBlockNum(unsigned long block);
+int compareLongLong(const void *a, const void *b);
+double processCpuSeconds(int pid);
+
+int main(int argc, char *argv[]) {
+    const char *serverIP = "127.0.0.1";
+    const char *filename = NULL;
+    int serverPort = 6969, sessions = 100, stalled = 0;
+    int blksize = DEFAULT_BLKSIZE, windowsize = 1, maxSeconds = 60;
+    int serverPid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:f:n:S:u:b:w:r:T:P:")) != -1) {
+        switch (opt) {
+            case 's': serverIP = optarg; break;
+            case 'p': serverPort = atoi(optarg); break;
+            case 'f': filename = optarg; break;
+            case 'n': sessions = atoi(optarg); break;
+            case 'S': stalled = atoi(optarg); break;
+            case 'u': uploadSize = atoll(optarg); break;
+            case 'b': blksize = atoi(optarg); break;
+            case 'w': windowsize = atoi(optarg); break;
+            case 'r': rolloverBase = atoi(optarg) == 1; sendRollover = 1; break;
+            case 'T': maxSeconds = atoi(optarg); break;
+            case 'P': serverPid = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s -s ip -p port -f file [-n sessions] [-S stalled] [-u upload bytes] [-b blksize] [-w windowsize] [-r 0|1] [-T seconds] [-P server pid]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!filename || sessions < 1) {
+        fprintf(stderr, "A remote file (-f) and at least one session (-n) are required\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(serverPort);
+    if (inet_pton(AF_INET, serverIP, &serverAddr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address/ Address not supported \n");
+        exit(EXIT_FAILURE);
+    }
+
+    int epollfd = epoll_create1(0);
+    int total = sessions + stalled;
+    Client *clients = calloc(total, sizeof(Client));
+    if (epollfd < 0 || !clients) {
+        perror("Setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (uploadSize >= 0) {
+        uploadData = malloc(blksize);
+        if (!uploadData) {
+            perror("Setup failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < blksize; i++) {
+            uploadData[i] = 'a' + i % 26;
+        }
+    }
+
+    double serverCpuStart = serverPid ? processCpuSeconds(serverPid) : 0;
+
+    // Les sessions bloquées partent en premier pour occuper le serveur ; en téléversement
+    // chacune écrit son propre fichier, pour mesurer le serveur et non l'attente d'un verrou
+    for (int i = 0; i < total; i++) {
+        char name[512];
+        if (uploadSize >= 0) {
+            snprintf(name, sizeof(name), "%s.%d", filename, i);
+        } else {
+            snprintf(name, sizeof(name), "%s", filename);
+        }
+        clients[i].stalled = (i < stalled);
+        if (!startClient(&clients[i], epollfd, &serverAddr, name, blksize, windowsize)) {
+            clients[i].done = -1;
+        }
+    }
+
+    long long start = nowUs();
+    long long deadline = start + (long long)maxSeconds * 1000000;
+    int remaining = 0;
+    for (int i = stalled; i < total; i++) {
+        remaining += (clients[i].done == 0);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    char packet[MAX_PACKET_SIZE];
+    while (remaining > 0 && nowUs() < deadline) {
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            Client *client = events[i].data.ptr;
+            while (1) {
+                struct sockaddr_in fromAddr;
+                socklen_t fromAddrLen = sizeof(fromAddr);
+                int len = recvfrom(client->sockfd, packet, sizeof(packet), 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+                if (len < 0) {
+                    break;
+                }
+                if (client->stalled || client->done) {
+                    continue;
+                }
+                // La session est fixée par la première réponse : une seconde session ouverte
+                // par une requête réémise reçoit une erreur 5 et s'arrête au lieu de tourner
+                // jusqu'à son propre abandon
+                if (client->hasPeer && (fromAddr.sin_addr.s_addr != client->peer.sin_addr.s_addr ||
+                                        fromAddr.sin_port != client->peer.sin_port)) {
+                    rejectUnknownTid(client, &fromAddr);
+                    continue;
+                }
+                client->lastHeardUs = nowUs();
+                client->peer = fromAddr;
+                client->hasPeer = 1;
+                clientPacket(client, packet, len, &fromAddr);
+                if (client->done) {
+                    remaining--;
+                }
+            }
+        }
+
+        long long now = nowUs();
+        for (int i = stalled; i < total; i++) {
+            if (clients[i].done == 0 && now - clients[i].lastHeardUs >= RETRY_US) {
+                clientRetry(&clients[i], &serverAddr);
+            }
+        }
+    }
+    long long elapsed = nowUs() - start;
+    double serverCpu = serverPid ? processCpuSeconds(serverPid) - serverCpuStart : 0;
+
+    // Statistiques sur les sessions saines uniquement
+    long long *latencies = malloc(sessions * sizeof(long long));
+    int completed = 0, failed = 0;
+    unsigned long long bytes = 0, packets = 0, duplicates = 0, retries = 0, strangers = 0;
+    for (int i = stalled; i < total; i++) {
+        packets += clients[i].packets;
+        duplicates += clients[i].duplicates;
+        retries += clients[i].retries;
+        strangers += clients[i].strangers;
+        if (clients[i].done == 1) {
+            latencies[completed++] = clients[i].end - clients[i].start;
+            bytes += clients[i].bytes;
+        } else {
+            failed++;
+        }
+    }
+    qsort(latencies, completed, sizeof(long long), compareLongLong);
+
+    printf("sessions: %d healthy, %d stalled\n", sessions, stalled);
+    printf("completed: %d, failed: %d\n", completed, failed);
+    printf("elapsed: %.3f s\n", elapsed / 1e6);
+    printf("throughput: %.2f MB/s, %.1f transfers/s\n", bytes / (elapsed / 1e6) / 1e6, completed / (elapsed / 1e6));
+    printf("packets: %llu, %.0f packets/s\n", packets, packets / (elapsed / 1e6));
+    printf("duplicates: %llu received (%.1f%% of packets), client retries: %llu, unknown TIDs rejected: %llu\n",
+           duplicates, packets ? 100.0 * duplicates / packets : 0.0, retries, strangers);
+    if (serverPid && serverCpuStart >= 0 && serverCpu >= 0) {
+        printf("server cpu: %.2f s (%.0f%%), %.2f s/GB\n", serverCpu, 100.0 * serverCpu / (elapsed / 1e6),
+               bytes ? serverCpu / (bytes / 1e9) : 0.0);
+    }
+    if (completed > 0) {
+        printf("latency p50: %.2f ms, p99: %.2f ms, max: %.2f ms\n",
+               latencies[completed / 2] / 1e3, latencies[(completed * 99) / 100] / 1e3, latencies[completed - 1] / 1e3);
+    }
+
+    for (int i = 0; i < total; i++) {
+        if (clients[i].sockfd > 0) {
+            close(clients[i].sockfd);
+        }
+    }
+    free(latencies);
+    free(clients);
+    close(epollfd);
+    return failed == 0 ? 0 : 1;
+}
+
+long long nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int startClient(Client *client, int epollfd, struct sockaddr_in *serverAddr, const char *filename, int blksize, int windowsize) {
+    char request[512];
+    int len;
+
+    client->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (client->sockfd < 0) {
+        perror("socket");
+        return 0;
+    }
+    client->blksize = DEFAULT_BLKSIZE;
+    client->windowsize = 1;
+    client->expected = 1;
+
+    len = snprintf(request, sizeof(request), "%c%c%s%c%s%c", 0, uploadSize >= 0 ? OP_WRQ : OP_RRQ, filename, 0, "octet", 0);
+    if (blksize != DEFAULT_BLKSIZE) {
+        len += snprintf(request + len, sizeof(request) - len, "blksize%c%d%c", 0, blksize, 0);
+    }
+    if (windowsize != 1 && uploadSize < 0) {
+        len += snprintf(request + len, sizeof(request) - len, "windowsize%c%d%c", 0, windowsize, 0);
+        // Le tampon de réception doit contenir une fenêtre ; il n'est jamais réduit, le
+        // défaut dépassant déjà largement une fenêtre de petits blocs
+        int rcvbuf = windowsize * (blksize + 4) * 2;
+        int current = 0;
+        socklen_t optLen = sizeof(current);
+        if (getsockopt(client->sockfd, SOL_SOCKET, SO_RCVBUF, &current, &optLen) != 0 || current < rcvbuf) {
+            setsockopt(client->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+    }
+    if (sendRollover) {
+        len += snprintf(request + len, sizeof(request) - len, "rollover%c%d%c", 0, rolloverBase, 0);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, client->sockfd, &ev);
+
+    memcpy(client->request, request, len);
+    client->requestLen = len;
+    client->start = nowUs();
+    client->lastHeardUs = client->start;
+    return sendto(client->sockfd, request, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr)) == len;
+}
+
+void clientPacket(Client *client, const char *packet, int len, struct sockaddr_in *fromAddr) {
+    if (len < 4) {
+        return;
+    }
+    int opcode = packet[1];
+
+    if (opcode == OP_OACK) {
+        // Lecture des options acceptées, puis ACK du bloc 0
+        const char *p = packet + 2, *end = packet + len;
+        while (p < end) {
+            const char *value = p + strlen(p) + 1;
+            if (value >= end) {
+                break;
+            }
+            if (strcasecmp(p, "blksize") == 0) {
+                client->blksize = atoi(value);
+            } else if (strcasecmp(p, "windowsize") == 0) {
+                client->windowsize = atoi(value);
+            } else if (strcasecmp(p, "rollover") == 0) {
+                rolloverBase = atoi(value) == 1;
+            }
+            p = value + strlen(value) + 1;
+        }
+        if (uploadSize >= 0) {
+            uploadAck(client, 0, fromAddr); // L'OACK d'un WRQ tient lieu d'ACK du bloc 0
+        } else {
+            sendAck(client, 0, fromAddr);
+        }
+    } else if (opcode == OP_ACK && uploadSize >= 0) {
+        uploadAck(client, ((unsigned char)packet[2] << 8) | (unsigned char)packet[3], fromAddr);
+    } else if (opcode == OP_DATA) {
+        unsigned int blockNum = ((unsigned char)packet[2] << 8) | (unsigned char)packet[3];
+        client->packets++;
+        if (blockNum != client->expected) {
+            client->duplicates++;
+            // Hors séquence : on rappelle au serveur le dernier bloc reçu dans l'ordre
+            if (client->receivedInWindow > 0 || client->windowsize > 1) {
+                sendAck(client, client->lastBlock, fromAddr);
+                client->receivedInWindow = 0;
+            }
+            return;
+        }
+        client->bytes += len - 4;
+        int last = (len - 4 < client->blksize);
+        if (++client->receivedInWindow >= client->windowsize || last) {
+            sendAck(client, blockNum, fromAddr);
+            client->receivedInWindow = 0;
+        }
+        client->lastBlock = blockNum;
+        client->expected = nextBlockNum(blockNum);
+        if (last) {
+            client->done = 1;
+            client->end = nowUs();
+        }
+    } else if (opcode == OP_ERROR) {
+        fprintf(stderr, "Error packet received: %.*s\n", len - 4, packet + 4);
+        client->done = -1;
+        client->end = nowUs();
+    }
+}
+
+// ACK reçu pendant un téléversement : le bloc en attente est acquitté et le suivant part.
+// Un ACK du bloc précédent signale que le DATA s'est perdu : on le réémet.
+void uploadAck(Client *client, unsigned int blockNum, struct sockaddr_in *toAddr) {
+    client->packets++;
+    if (blockNum == wireBlockNum(client->sentBlock)) {
+        if (client->sentBlock != 0) {
+            client->bytes += client->sentLen;
+            if (client->sentLen < (size_t)client->blksize) {
+                client->done = 1;
+                client->end = nowUs();
+                return;
+            }
+        }
+        unsigned long long left = uploadSize - client->bytes;
+        client->sentLen = left < (unsigned long long)client->blksize ? left : (size_t)client->blksize;
+        client->sentBlock++;
+        sendData(client, toAddr);
+    } else {
+        // ACK en double : le DATA en attente n'est réémis qu'à l'expiration du délai (RFC 1123)
+        client->duplicates++;
+    }
+}
+
+// Le serveur se tait depuis RETRY_US : la requête, le DATA en attente ou le dernier ACK repart
+void clientRetry(Client *client, struct sockaddr_in *serverAddr) {
+    client->retries++;
+    client->lastHeardUs = nowUs();
+    if (!client->hasPeer) {
+        sendto(client->sockfd, client->request, client->requestLen, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+    } else if (uploadSize >= 0) {
+        if (client->sentBlock != 0) {
+            sendData(client, &client->peer);
+        }
+    } else {
+        sendAck(client, client->lastBlock, &client->peer);
+    }
+}
+
+// Émet le bloc en attente : en-tête et données en deux iovec, sans recopie
+void sendData(Client *client, struct sockaddr_in *toAddr) {
+    unsigned int blockNum = wireBlockNum(client->sentBlock);
+    char header[4];
+    header[0] = 0;
+    header[1] = OP_DATA;
+    header[2] = (blockNum >> 8) & 0xFF;
+    header[3] = blockNum & 0xFF;
+
+    struct iovec iov[2] = {{header, sizeof(header)}, {uploadData, client->sentLen}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = toAddr;
+    msg.msg_namelen = sizeof(*toAddr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    client->packets++;
+    sendmsg(client->sockfd, &msg, 0);
+}
+
+void sendAck(Client *client, unsigned int blockNum, struct sockaddr_in *toAddr) {
+    char ack[4];
+    ack[0] = 0;
+    ack[1] = OP_ACK;
+    ack[2] = (blockNum >> 8) & 0xFF;
+    ack[3] = blockNum & 0xFF;
+    client->packets++;
+    sendto(client->sockfd, ack, sizeof(ack), 0, (struct sockaddr *)toAddr, sizeof(*toAddr));
+}
+
+void rejectUnknownTid(Client *client, struct sockaddr_in *fromAddr) {
+    char error[32];
+    int len = snprintf(error, sizeof(error), "%c%c%c%cUnknown transfer ID", 0, OP_ERROR, 0, 5);
+    client->strangers++;
+    sendto(client->sockfd, error, len + 1, 0, (struct sockaddr *)fromAddr, sizeof(*fromAddr));
+}
+
+// Même roll-over que le serveur : après 65535 on repart à rolloverBase
+unsigned int nextBlockNum(unsigned int blockNum) {
+    return blockNum == 65535 ? (unsigned int)rolloverBase : blockNum + 1;
+}
+
+// Numéro sur 16 bits d'un bloc compté sans roll-over
+unsigned int wireBlockNum(unsigned long block) {
+    if (block <= 65535) {
+        return block;
+    }
+    return rolloverBase ? (unsigned int)((block - 1) % 65535) + 1 : (unsigned int)(block & 0xFFFF);
+}
+
+int compareLongLong(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Temps CPU (utilisateur + système) consommé par un processus, en secondes, -1 si illisible
+double processCpuSeconds(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    // Le nom du processus peut contenir des espaces : on repart de la dernière parenthèse
+    char line[1024];
+    size_t len = fread(line, 1, sizeof(line) - 1, file);
+    fclose(file);
+    line[len] = '\0';
+    char *p = strrchr(line, ')');
+    unsigned long utime, stime;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
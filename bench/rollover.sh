@@ -0,0 +1,138 @@
+#!/bin/sh
+# Vérification du roll-over des numéros de bloc. Un fichier creux de plus de 65535 blocs de
+# 512 octets est marqué bloc par bloc autour du passage de 65535 à 0 (ou 1), et de loin en
+# loin ailleurs, pour qu'un bloc mal placé ne passe pas inaperçu au milieu des zéros. Il est
+# lu (RRQ) puis téléversé (WRQ) avec -r 0 et -r 1 à travers chaque serveur, par le client de
+# l'étape 1 & 2 et par celui de l'étape 4 ; chaque copie est comparée à la source avec cmp.
+#
+# Usage : bench/rollover.sh [-b répertoire des programmes] [-p port]
+#
+#   -b   répertoire contenant etape12-serveur, etape12-client, etape3-serveur,
+#        etape3-multithread, etape4-serveur et etape4-client ; sans -b ils sont
+#        compilés dans le répertoire temporaire
+#
+# Le script s'arrête sur un code de retour non nul si une copie diffère de la source.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BIN=""
+PORT=7069
+BLOCKS=81920 # 40 Mo : un passage de 65535 à 0 ou 1 dans chaque sens
+
+usage() {
+    sed -n '8,12p' "$0" | sed 's/^# \{0,1\}//' >&2
+    exit 1
+}
+
+while getopts "b:p:" opt; do
+    case $opt in
+        b) BIN=$(cd "$OPTARG" && pwd) ;;
+        p) PORT=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+WORK=$(mktemp -d)
+SERVER_PID=""
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+if [ -z "$BIN" ]; then
+    BIN="$WORK/bin"
+    mkdir -p "$BIN"
+    CC=${CC:-cc}
+    $CC -O2 -o "$BIN/etape12-serveur" "$ROOT/Etape 1 & 2/serveur/serveur.c"
+    $CC -O2 -o "$BIN/etape12-client" "$ROOT/Etape 1 & 2/client/client.c"
+    $CC -O2 -o "$BIN/etape3-serveur" "$ROOT/Etape 3/monothread/serveur.c"
+    $CC -O2 -o "$BIN/etape3-multithread" "$ROOT/Etape 3/multithread/serveur.c" -pthread
+    $CC -O2 -o "$BIN/etape4-serveur" "$ROOT/Etape 4/serveur/serveur.c" -pthread
+    $CC -O2 -o "$BIN/etape4-client" "$ROOT/Etape 4/client/client.c"
+fi
+
+# Fichier source : creux, avec le numéro de chaque bloc marqué au début des blocs retenus
+SRC="$WORK/source.bin"
+truncate -s $((BLOCKS * 512)) "$SRC"
+mark() {
+    printf 'block %d\n' "$1" | dd of="$SRC" bs=512 seek=$(($1 - 1)) conv=notrunc 2>/dev/null
+}
+block=65528
+while [ $block -le 65544 ]; do
+    mark $block
+    block=$((block + 1))
+done
+block=1
+while [ $block -le $BLOCKS ]; do
+    mark $block
+    block=$((block + 509))
+done
+mark $BLOCKS
+
+# Attend que la copie soit complète (un serveur peut renommer le fichier après le dernier
+# ACK) puis la compare à la source
+check() {
+    tries=0
+    while ! cmp -s "$SRC" "$1" && [ $tries -lt 20 ]; do
+        sleep 0.5
+        tries=$((tries + 1))
+    done
+    if cmp "$SRC" "$1"; then
+        echo "ok"
+    else
+        echo "FAILED"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# Réponses aux invites des clients : adresse, port, opération, fichier, mode, puis pour
+# l'étape 4 la taille de bloc, la fenêtre (lecture seulement) et le délai
+client() {
+    name=$1 rollover=$2 operation=$3 file=$4
+    case $name in
+        etape12) printf '127.0.0.1\n%d\n%d\n%s\noctet\n' "$PORT" "$operation" "$file" ;;
+        etape4) if [ "$operation" = 1 ]; then
+                    printf '127.0.0.1\n%d\n1\n%s\noctet\n512\n1\n0\n' "$PORT" "$file"
+                else
+                    printf '127.0.0.1\n%d\n2\n%s\noctet\n512\n0\n' "$PORT" "$file"
+                fi ;;
+    esac | (cd "$WORK/client" && "$BIN/$name-client" -r "$rollover" > "$WORK/client.log" 2>&1) || true
+}
+
+FAILURES=0
+for server in etape12-serveur etape3-serveur etape3-multithread etape4-serveur; do
+    for rollover in 0 1; do
+        rm -rf "$WORK/server" "$WORK/client"
+        mkdir -p "$WORK/server" "$WORK/client"
+        cp "$SRC" "$WORK/server/rollover.bin"
+        printf '127.0.0.1\n%d\n' "$PORT" > "$WORK/server.in"
+        (cd "$WORK/server" && exec "$BIN/$server" -r "$rollover" < "$WORK/server.in" > "$WORK/server.log" 2>&1) &
+        SERVER_PID=$!
+        sleep 0.5
+
+        for name in etape12 etape4; do
+            printf '%s, client %s, -r %d, RRQ: ' "$server" "$name" "$rollover"
+            rm -f "$WORK/client/rollover.bin"
+            client $name "$rollover" 1 rollover.bin
+            check "$WORK/client/rollover.bin"
+
+            printf '%s, client %s, -r %d, WRQ: ' "$server" "$name" "$rollover"
+            cp "$SRC" "$WORK/client/upload.bin"
+            client $name "$rollover" 2 upload.bin
+            check "$WORK/server/upload.bin"
+            rm -f "$WORK/server/upload.bin"
+        done
+
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+        SERVER_PID=""
+    done
+done
+
+if [ $FAILURES -gt 0 ]; then
+    echo "$FAILURES transfers differ from the source" >&2
+    exit 1
+fi
+echo "All transfers match the source"
@@ -0,0 +1,100 @@
+#!/bin/sh
+# Banc de référence : lance un serveur sur la boucle locale dans un répertoire temporaire,
+# y crée un fichier par taille demandée, puis mesure avec bench les lectures (et avec -u les
+# téléversements) de N sessions simultanées : Mo/s, transferts/s, latence p50/p99 et temps
+# CPU du serveur. Les programmes sont pris dans build/ (make).
+#
+# Usage : bench/run.sh serveur [-n sessions] [-z tailles] [-u] [-b blksize] [-w windowsize]
+#                      [-p port] [-T secondes] [-- options du serveur]
+#
+#   serveur   etape12, etape3, etape3mt ou etape4
+#   -z        tailles séparées par des virgules, suffixes K, M, G (défaut 64K,1M,16M)
+#   -u        mesure aussi les téléversements de chaque taille
+#
+# Exemple : bench/run.sh etape4 -n 100 -z 1M -b 1428 -w 16 -- -t 4
+#           bench/run.sh etape3mt -n 10 -z 1M -u -- -I drop=0.01,dup=0.01,delay=2,jitter=5
+#           (pertes simulées par le serveur de l'étape 3 multithread : goodput et doublons)
+# Le serveur de l'étape 1 & 2 sert un seul client à la fois sur sa socket d'écoute :
+# on le mesure avec -n 1.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD="$ROOT/build"
+
+usage() {
+    sed -n '7,13p' "$0" | sed 's/^# \{0,1\}//' >&2
+    exit 1
+}
+
+[ $# -ge 1 ] || usage
+case "$1" in
+    etape12) SERVER="$BUILD/etape12-serveur" ;;
+    etape3) SERVER="$BUILD/etape3-serveur" ;;
+    etape3mt) SERVER="$BUILD/etape3-multithread" ;;
+    etape4) SERVER="$BUILD/etape4-serveur" ;;
+    *) usage ;;
+esac
+NAME=$1
+shift
+
+SESSIONS=20
+SIZES=64K,1M,16M
+UPLOAD=0
+PORT=6969
+SECONDS_MAX=60
+BENCH_OPTS=""
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -n) SESSIONS=$2; shift 2 ;;
+        -z) SIZES=$2; shift 2 ;;
+        -u) UPLOAD=1; shift ;;
+        -b|-w) BENCH_OPTS="$BENCH_OPTS $1 $2"; shift 2 ;;
+        -p) PORT=$2; shift 2 ;;
+        -T) SECONDS_MAX=$2; shift 2 ;;
+        --) shift; break ;;
+        *) usage ;;
+    esac
+done
+
+for program in "$SERVER" "$BUILD/bench"; do
+    if [ ! -x "$program" ]; then
+        echo "$program is missing, run make first" >&2
+        exit 1
+    fi
+done
+
+WORKDIR=$(mktemp -d)
+SERVER_PID=""
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+# Les serveurs demandent l'adresse et le port sur l'entrée standard
+printf '127.0.0.1\n%s\n' "$PORT" > "$WORKDIR/stdin"
+for size in $(echo "$SIZES" | tr ',' ' '); do
+    head -c "$size" /dev/urandom > "$WORKDIR/file-$size"
+done
+
+(cd "$WORKDIR" && exec "$SERVER" "$@" < stdin > server.log 2>&1) &
+SERVER_PID=$!
+sleep 0.5
+if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo "$NAME server failed to start:" >&2
+    cat "$WORKDIR/server.log" >&2
+    exit 1
+fi
+
+status=0
+for size in $(echo "$SIZES" | tr ',' ' '); do
+    echo "== $NAME RRQ $size x $SESSIONS sessions"
+    "$BUILD/bench" -p "$PORT" -f "file-$size" -n "$SESSIONS" -T "$SECONDS_MAX" -P "$SERVER_PID" $BENCH_OPTS || status=1
+    if [ "$UPLOAD" = 1 ]; then
+        echo "== $NAME WRQ $size x $SESSIONS sessions"
+        "$BUILD/bench" -p "$PORT" -f "upload-$size" -u "$(numfmt --from=iec "$size")" -n "$SESSIONS" \
+            -T "$SECONDS_MAX" -P "$SERVER_PID" $BENCH_OPTS || status=1
+    fi
+done
+exit $status